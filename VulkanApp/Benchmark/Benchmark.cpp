@@ -0,0 +1,587 @@
+#define STB_IMAGE_IMPLEMENTATION
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <stdexcept>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+#include "../VulkanRenderer.h"
+#include "../VulkanWindow.h"
+#include "SyntheticScene.h"
+#include "TraceReplay.h"
+
+//Frame throughput benchmark. Renders a synthetic scene, or replays a captured trace, for a fixed number of frames and writes the timings as JSON.
+//Run it from the VulkanApp folder so the shaders are found.
+
+struct BenchmarkSettings
+{
+	int models = 100;
+	int meshesPerModel = 4;
+	int instancesPerModel = 1;
+	int textures = 8;
+	int meshDetail = 4;
+	int frames = 1000;
+	int warmupFrames = 60;
+	uint32_t width = 800;
+	uint32_t height = 600;
+	int framesInFlight = DEFAULT_FRAME_DRAWS;
+	PresentPolicy presentPolicy = PresentPolicy::LowLatency;
+	bool pipelineStats = false;
+	bool commandCaching = true;
+	bool drawSorting = false;
+	bool gpuCulling = false;
+	bool occlusionCulling = false;	//Hi-Z on top of GPU culling
+	bool cpuCulling = true;
+	bool depthPrepass = false;
+	int cullBenchSpheres = 0;		//Only run the CPU culling benchmark on this many spheres
+	int recordThreads = 0;			//0 uses every thread the renderer started
+	bool headless = true;
+	std::string replayFile;			//Replay this trace instead of the synthetic scene
+	bool paced = false;				//Replay at the recorded pace instead of as fast as possible
+
+	//A replay takes these from the trace unless they are given
+	bool sizeGiven = false;
+	bool framesGiven = false;
+	bool framesInFlightGiven = false;
+	std::string outputFile = "benchmark.json";
+};
+
+struct Summary
+{
+	double mean = 0.0;
+	double p50 = 0.0;
+	double p95 = 0.0;
+	double p99 = 0.0;
+	double min = 0.0;
+	double max = 0.0;
+};
+
+static void printUsage()
+{
+	printf("Usage: Benchmark [options]\n"
+		"  --models N      models in the scene (default 100)\n"
+		"  --meshes M      meshes per model (default 4)\n"
+		"  --instances I   copies of every model drawn through createInstances (default 1, no instancing)\n"
+		"  --textures T    distinct textures (default 8)\n"
+		"  --detail D      quads per cube face edge (default 4)\n"
+		"  --frames K      measured frames (default 1000)\n"
+		"  --warmup W      frames rendered before measuring (default 60)\n"
+		"  --width W --height H   render size (default 800x600)\n"
+		"  --frames-in-flight F   frame slots used, 1-4 (default 2)\n"
+		"  --present P     low-latency, throughput or fifo-relaxed (default low-latency, window only)\n"
+		"  --window        render to a window instead of headless\n"
+		"  --pipeline-stats   collect vertex/clipping/fragment counts per model\n"
+		"  --no-cache      re-record the scene command buffers every frame\n"
+		"  --sort          record draws sorted by state instead of in model order, no per model GPU times\n"
+		"  --gpu-cull      frustum cull on the GPU with a compute pass\n"
+		"  --occlusion-cull   also cull against the Hi-Z depth pyramid, implies --gpu-cull\n"
+		"  --no-cpu-cull   draw every mesh instead of frustum culling them on the CPU\n"
+		"  --depth-prepass   draw depth only first, then shade with an EQUAL depth test\n"
+		"  --cull-bench N  only time CPU frustum culling of N random spheres, no rendering\n"
+		"  --record-threads N   threads recording scene commands (default all, up to 8)\n"
+		"  --replay FILE   replay a trace captured with VulkanRenderer::startTrace instead of the synthetic scene,\n"
+		"                  size, frames in flight and frame count default to the trace's\n"
+		"  --paced         replay at the recorded pace instead of as fast as possible\n"
+		"  --output FILE   JSON output (default benchmark.json)\n");
+}
+
+static bool parseArguments(int argc, char* argv[], BenchmarkSettings& settings)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--window") { settings.headless = false; }
+		else if (arg == "--pipeline-stats") { settings.pipelineStats = true; }
+		else if (arg == "--no-cache") { settings.commandCaching = false; }
+		else if (arg == "--sort") { settings.drawSorting = true; }
+		else if (arg == "--gpu-cull") { settings.gpuCulling = true; }
+		else if (arg == "--occlusion-cull") { settings.gpuCulling = true; settings.occlusionCulling = true; }
+		else if (arg == "--no-cpu-cull") { settings.cpuCulling = false; }
+		else if (arg == "--depth-prepass") { settings.depthPrepass = true; }
+		else if (arg == "--cull-bench" && hasValue) { settings.cullBenchSpheres = std::stoi(argv[++i]); }
+		else if (arg == "--paced") { settings.paced = true; }
+		else if (arg == "--replay" && hasValue) { settings.replayFile = argv[++i]; }
+		else if (arg == "--record-threads" && hasValue) { settings.recordThreads = std::stoi(argv[++i]); }
+		else if (arg == "--models" && hasValue) { settings.models = std::stoi(argv[++i]); }
+		else if (arg == "--meshes" && hasValue) { settings.meshesPerModel = std::stoi(argv[++i]); }
+		else if (arg == "--instances" && hasValue) { settings.instancesPerModel = std::stoi(argv[++i]); }
+		else if (arg == "--textures" && hasValue) { settings.textures = std::stoi(argv[++i]); }
+		else if (arg == "--detail" && hasValue) { settings.meshDetail = std::stoi(argv[++i]); }
+		else if (arg == "--frames" && hasValue) { settings.frames = std::stoi(argv[++i]); settings.framesGiven = true; }
+		else if (arg == "--warmup" && hasValue) { settings.warmupFrames = std::stoi(argv[++i]); }
+		else if (arg == "--width" && hasValue) { settings.width = static_cast<uint32_t>(std::stoul(argv[++i])); settings.sizeGiven = true; }
+		else if (arg == "--height" && hasValue) { settings.height = static_cast<uint32_t>(std::stoul(argv[++i])); settings.sizeGiven = true; }
+		else if (arg == "--frames-in-flight" && hasValue) { settings.framesInFlight = std::stoi(argv[++i]); settings.framesInFlightGiven = true; }
+		else if (arg == "--present" && hasValue)
+		{
+			std::string policy = argv[++i];
+			if (policy == "low-latency") { settings.presentPolicy = PresentPolicy::LowLatency; }
+			else if (policy == "throughput") { settings.presentPolicy = PresentPolicy::Throughput; }
+			else if (policy == "fifo-relaxed") { settings.presentPolicy = PresentPolicy::FifoRelaxed; }
+			else { return false; }
+		}
+		else if (arg == "--output" && hasValue) { settings.outputFile = argv[++i]; }
+		else
+		{
+			return false;
+		}
+	}
+
+	//One texture is taken by the renderer itself
+	return settings.models > 0 && settings.meshesPerModel > 0 && settings.instancesPerModel > 0 && settings.textures > 0 && settings.textures < MAX_TEXTURES
+		&& settings.meshDetail > 0 && settings.frames > 0 && settings.warmupFrames >= 0;
+}
+
+//Trace paths on Windows are full of backslashes
+static std::string jsonEscape(const std::string& text)
+{
+	std::string escaped;
+	for (char c : text)
+	{
+		if (c == '\\' || c == '"') { escaped += '\\'; }
+		escaped += c;
+	}
+	return escaped;
+}
+
+static const char* presentModeName(VkPresentModeKHR presentMode)
+{
+	switch (presentMode)
+	{
+	case VK_PRESENT_MODE_IMMEDIATE_KHR: return "immediate";
+	case VK_PRESENT_MODE_MAILBOX_KHR: return "mailbox";
+	case VK_PRESENT_MODE_FIFO_KHR: return "fifo";
+	case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "fifo_relaxed";
+	default: return "other";
+	}
+}
+
+static Summary summarise(std::vector<double> samples)
+{
+	Summary summary;
+	if (samples.empty())
+	{
+		return summary;
+	}
+
+	std::sort(samples.begin(), samples.end());
+
+	double total = 0.0;
+	for (double sample : samples)
+	{
+		total += sample;
+	}
+
+	//Nearest rank percentiles
+	auto percentile = [&samples](double p) {
+		size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * samples.size()));
+		return samples[std::max<size_t>(rank, 1) - 1];
+	};
+
+	summary.mean = total / samples.size();
+	summary.p50 = percentile(50.0);
+	summary.p95 = percentile(95.0);
+	summary.p99 = percentile(99.0);
+	summary.min = samples.front();
+	summary.max = samples.back();
+	return summary;
+}
+
+static void writeSummary(std::ofstream& file, const char* name, const Summary& summary, bool last)
+{
+	file << "  \"" << name << "\": { \"mean\": " << summary.mean << ", \"p50\": " << summary.p50
+		<< ", \"p95\": " << summary.p95 << ", \"p99\": " << summary.p99
+		<< ", \"min\": " << summary.min << ", \"max\": " << summary.max << " }" << (last ? "\n" : ",\n");
+}
+
+//Culls random spheres around the renderer's default camera, without a device, to see how many spheres a millisecond the SIMD test gets through
+static int runCullBenchmark(const BenchmarkSettings& settings)
+{
+	std::mt19937 random(1);
+	std::uniform_real_distribution<float> position(-60.0f, 60.0f);
+	std::uniform_real_distribution<float> radius(0.5f, 2.0f);
+
+	FrustumCuller culler;
+	for (int i = 0; i < settings.cullBenchSpheres; i++)
+	{
+		culler.addSphere(glm::vec4(position(random), position(random), position(random), radius(random)), 0);
+	}
+	culler.updateWorldSpheres(std::vector<glm::mat4>(1, glm::mat4(1.0f)));
+
+	glm::mat4 projection = glm::perspective(glm::radians(45.0f), static_cast<float>(settings.width) / settings.height, 0.1f, 100.0f);
+	projection[1][1] *= -1;
+	glm::mat4 view = glm::lookAt(glm::vec3(30.0f, 0.0f, 20.0f), glm::vec3(0.0f, 0.0f, -4.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 viewProjection = projection * view;
+
+	std::vector<uint8_t> visibility;
+	uint32_t visible = 0;
+	for (int i = 0; i < settings.warmupFrames; i++)
+	{
+		visible = culler.cull(viewProjection, visibility);
+	}
+
+	std::vector<double> passMs;
+	passMs.reserve(settings.frames);
+	for (int i = 0; i < settings.frames; i++)
+	{
+		auto passStart = std::chrono::high_resolution_clock::now();
+		visible = culler.cull(viewProjection, visibility);
+		passMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - passStart).count());
+	}
+
+	std::ofstream file(settings.outputFile);
+	if (!file.is_open())
+	{
+		printf("Failed to open %s\n", settings.outputFile.c_str());
+		return EXIT_FAILURE;
+	}
+
+	Summary summary = summarise(passMs);
+	file << "{\n";
+	file << "  \"cull_benchmark\": { \"spheres\": " << settings.cullBenchSpheres << ", \"visible\": " << visible << " },\n";
+	file << "  \"passes\": " << passMs.size() << ",\n";
+	writeSummary(file, "cull_pass_ms", summary, false);
+	file << "  \"spheres_per_ms\": " << settings.cullBenchSpheres / summary.mean << "\n";
+	file << "}\n";
+	file.close();
+
+	printf("%d spheres, %u visible, mean %.4f ms, %.0f spheres/ms, %s written\n",
+		settings.cullBenchSpheres, visible, summary.mean, settings.cullBenchSpheres / summary.mean, settings.outputFile.c_str());
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	BenchmarkSettings settings;
+	if (!parseArguments(argc, argv, settings))
+	{
+		printUsage();
+		return EXIT_FAILURE;
+	}
+
+	if (settings.cullBenchSpheres > 0)
+	{
+		return runCullBenchmark(settings);
+	}
+
+	TraceReplay replay;
+	bool replaying = !settings.replayFile.empty();
+	if (replaying)
+	{
+		if (!replay.load(settings.replayFile))
+		{
+			printf("Failed to read trace %s\n", settings.replayFile.c_str());
+			return EXIT_FAILURE;
+		}
+
+		TraceHeader header = replay.getHeader();
+		if (!settings.sizeGiven) { settings.width = header.width; settings.height = header.height; }
+		if (!settings.framesInFlightGiven) { settings.framesInFlight = header.maxFrameDraws; }
+		if (!settings.framesGiven) { settings.frames = std::max(1, static_cast<int>(replay.getDrawCount()) - settings.warmupFrames); }
+	}
+
+	VulkanRenderer vulkanRenderer;
+	VulkanWindow* window = nullptr;
+	vulkanRenderer.setMaxFrameDraws(settings.framesInFlight);
+
+	if (settings.headless)
+	{
+		if (vulkanRenderer.initHeadless(settings.width, settings.height) == EXIT_FAILURE)
+		{
+			return EXIT_FAILURE;
+		}
+	}
+	else
+	{
+		window = new VulkanWindow("Benchmark", settings.width, settings.height);
+		if (vulkanRenderer.init(window->GetWindow(), settings.presentPolicy) == EXIT_FAILURE)
+		{
+			return EXIT_FAILURE;
+		}
+	}
+
+	vulkanRenderer.setPipelineStatisticsEnabled(settings.pipelineStats);
+	vulkanRenderer.setCommandBufferCachingEnabled(settings.commandCaching);
+	vulkanRenderer.setDrawSortingEnabled(settings.drawSorting);
+	vulkanRenderer.setGpuCullingEnabled(settings.gpuCulling);
+	vulkanRenderer.setOcclusionCullingEnabled(settings.occlusionCulling);
+	vulkanRenderer.setCpuCullingEnabled(settings.cpuCulling);
+	vulkanRenderer.setDepthPrepassEnabled(settings.depthPrepass);
+	if (settings.gpuCulling && !vulkanRenderer.isGpuCullingSupported())
+	{
+		printf("GPU culling needs drawIndirectCount and multiDrawIndirect, drawing everything\n");
+	}
+	else if (settings.occlusionCulling && !vulkanRenderer.isOcclusionCullingSupported())
+	{
+		printf("Occlusion culling needs a depth format that can be sampled, frustum culling only\n");
+	}
+	if (settings.recordThreads > 0)
+	{
+		vulkanRenderer.setRecordThreadCount(settings.recordThreads);
+	}
+	if (settings.pipelineStats && !vulkanRenderer.isPipelineStatisticsSupported())
+	{
+		printf("Pipeline statistics queries are not supported by this device\n");
+	}
+
+	SyntheticScene scene(settings.models, settings.meshesPerModel, settings.instancesPerModel, settings.textures, settings.meshDetail);
+	if (!replaying)
+	{
+		scene.build(vulkanRenderer);
+	}
+
+	std::vector<double> cpuFrameMs;
+	std::vector<double> gpuFrameMs;
+	std::vector<double> gpuMainPassMs;
+	std::vector<double> gpuModelMs;
+	std::vector<double> cpuWaitMs;
+	std::vector<double> cpuRecordMs;
+	std::vector<double> cpuSubmitMs;
+	std::vector<double> cpuPresentMs;
+	std::vector<double> cpuCullMs;
+	cpuFrameMs.reserve(settings.frames);
+	gpuFrameMs.reserve(settings.frames);
+	gpuMainPassMs.reserve(settings.frames);
+	cpuWaitMs.reserve(settings.frames);
+	cpuRecordMs.reserve(settings.frames);
+	cpuSubmitMs.reserve(settings.frames);
+	cpuPresentMs.reserve(settings.frames);
+	cpuCullMs.reserve(settings.frames);
+	uint64_t lastGpuFrame = 0;
+
+	//Summed over every GPU frame, averaged when written
+	std::vector<ModelPipelineStats> modelStatsSum;
+	size_t modelStatsFrames = 0;
+
+	uint64_t drawCalls = 0;
+	uint64_t indirectCommands = 0;
+	uint64_t bytesUploaded = 0;
+	uint64_t uniformBytesUsed = 0;
+	uint64_t reusedFrames = 0;
+	uint64_t bindsIssued = 0;
+	uint64_t bindsSkipped = 0;
+	uint64_t bindsUnsorted = 0;
+	uint64_t gpuVisibleDraws = 0;
+	uint64_t gpuCulledDraws = 0;
+	uint64_t gpuOccludedDraws = 0;
+	uint64_t gpuLateDraws = 0;
+	uint64_t cpuVisibleDraws = 0;
+	uint64_t cpuCulledDraws = 0;
+	uint64_t blendedDraws = 0;
+
+	//Fixed time step so every run animates the same way
+	const float timeStep = 1.0f / 60.0f;
+	int totalFrames = settings.warmupFrames + settings.frames;
+
+	auto runStart = std::chrono::high_resolution_clock::now();
+	for (int frame = 0; frame < totalFrames; frame++)
+	{
+		if (window != nullptr)
+		{
+			glfwPollEvents();
+			if (glfwWindowShouldClose(window->GetWindow()))
+			{
+				break;
+			}
+		}
+
+		auto frameStart = std::chrono::high_resolution_clock::now();
+
+		if (replaying)
+		{
+			//The trace brings its own models and draw calls
+			if (!replay.playFrame(vulkanRenderer, settings.paced))
+			{
+				break;
+			}
+		}
+		else
+		{
+			scene.update(vulkanRenderer, frame * timeStep);
+			vulkanRenderer.draw();
+		}
+
+		auto frameEnd = std::chrono::high_resolution_clock::now();
+
+		if (frame < settings.warmupFrames)
+		{
+			runStart = frameEnd;
+			continue;
+		}
+
+		FrameStats stats = vulkanRenderer.getFrameStats();
+		cpuFrameMs.push_back(std::chrono::duration<double, std::milli>(frameEnd - frameStart).count());
+		cpuWaitMs.push_back(stats.cpuWaitMs);
+		cpuRecordMs.push_back(stats.cpuRecordMs);
+		cpuSubmitMs.push_back(stats.cpuSubmitMs);
+		cpuPresentMs.push_back(stats.cpuPresentMs);
+		cpuCullMs.push_back(stats.cpuCullMs);
+
+		//GPU numbers arrive a few frames late, only take each measured frame once
+		if (stats.gpuFrameMs >= 0.0 && stats.gpuStatsFrame != lastGpuFrame)
+		{
+			lastGpuFrame = stats.gpuStatsFrame;
+			gpuFrameMs.push_back(stats.gpuFrameMs);
+			gpuMainPassMs.push_back(stats.gpuMainPassMs);
+			gpuVisibleDraws += stats.gpuVisibleDraws;
+			gpuCulledDraws += stats.gpuCulledDraws;
+			gpuOccludedDraws += stats.gpuOccludedDraws;
+			gpuLateDraws += stats.gpuLateDraws;
+			for (double modelMs : stats.gpuModelMs)
+			{
+				if (modelMs >= 0.0)
+				{
+					gpuModelMs.push_back(modelMs);
+				}
+			}
+
+			if (!stats.modelPipelineStats.empty())
+			{
+				modelStatsSum.resize(stats.modelPipelineStats.size());
+				for (size_t i = 0; i < stats.modelPipelineStats.size(); i++)
+				{
+					modelStatsSum[i].vertexInvocations += stats.modelPipelineStats[i].vertexInvocations;
+					modelStatsSum[i].clippingPrimitives += stats.modelPipelineStats[i].clippingPrimitives;
+					modelStatsSum[i].fragmentInvocations += stats.modelPipelineStats[i].fragmentInvocations;
+				}
+				modelStatsFrames++;
+			}
+		}
+		drawCalls += stats.drawCalls;
+		indirectCommands += stats.indirectCommands;
+		bytesUploaded += stats.bytesUploaded;
+		uniformBytesUsed += stats.uniformBytesUsed;
+		reusedFrames += stats.sceneCommandsReused ? 1 : 0;
+		bindsIssued += stats.bindsIssued;
+		bindsSkipped += stats.bindsSkipped;
+		bindsUnsorted += stats.bindsUnsorted;
+		cpuVisibleDraws += stats.cpuVisibleDraws;
+		cpuCulledDraws += stats.cpuCulledDraws;
+		blendedDraws += stats.blendedDraws;
+	}
+	double runSeconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - runStart).count();
+
+	size_t measuredFrames = cpuFrameMs.size();
+	FrameStats finalStats = vulkanRenderer.getFrameStats();
+
+	vulkanRenderer.cleanUp();
+	if (window != nullptr)
+	{
+		window->DestroyWindow();
+		delete window;
+	}
+
+	if (measuredFrames == 0)
+	{
+		printf("No frames were measured\n");
+		return EXIT_FAILURE;
+	}
+
+	Summary cpuSummary = summarise(cpuFrameMs);
+	Summary gpuSummary = summarise(gpuFrameMs);
+
+	std::ofstream file(settings.outputFile);
+	if (!file.is_open())
+	{
+		printf("Failed to open %s\n", settings.outputFile.c_str());
+		return EXIT_FAILURE;
+	}
+
+	file << "{\n";
+	if (replaying)
+	{
+		file << "  \"scene\": { \"trace\": \"" << jsonEscape(settings.replayFile) << "\", \"models\": " << replay.getModelCount()
+			<< ", \"draws\": " << replay.getDrawCount() << ", \"paced\": " << (settings.paced ? "true" : "false") << " },\n";
+	}
+	else
+	{
+		file << "  \"scene\": { \"models\": " << settings.models << ", \"meshes_per_model\": " << settings.meshesPerModel
+			<< ", \"instances_per_model\": " << settings.instancesPerModel
+			<< ", \"textures\": " << settings.textures << ", \"detail\": " << settings.meshDetail
+			<< ", \"meshes\": " << scene.getMeshCount() << ", \"triangles\": " << scene.getTriangleCount() << " },\n";
+	}
+	file << "  \"render\": { \"width\": " << settings.width << ", \"height\": " << settings.height
+		<< ", \"headless\": " << (settings.headless ? "true" : "false")
+		<< ", \"frames_in_flight\": " << vulkanRenderer.getMaxFrameDraws()
+		<< ", \"present_mode\": \"" << presentModeName(vulkanRenderer.getPresentMode())
+		<< "\", \"swapchain_images\": " << vulkanRenderer.getSwapchainImageCount()
+		<< ", \"command_caching\": " << (settings.commandCaching ? "true" : "false")
+		<< ", \"cpu_culling\": " << (settings.cpuCulling ? "true" : "false")
+		<< ", \"gpu_culling\": " << (vulkanRenderer.isGpuCullingSupported() && settings.gpuCulling ? "true" : "false")
+		<< ", \"occlusion_culling\": " << (vulkanRenderer.isOcclusionCullingSupported() && settings.occlusionCulling ? "true" : "false")
+		<< ", \"depth_prepass\": " << (settings.depthPrepass ? "true" : "false")
+		<< ", \"draw_sorting\": " << (settings.drawSorting ? "true" : "false")
+		<< ", \"record_threads\": " << vulkanRenderer.getRecordThreadCount() << " },\n";
+	//Device memory at the end of the run, resources per vkAllocateMemory call shows what sub-allocation saved
+	DeviceMemoryStats memoryStats = vulkanRenderer.getMemoryStats();
+	file << "  \"memory\": { \"blocks\": " << memoryStats.blockCount << ", \"dedicated\": " << memoryStats.dedicatedCount
+		<< ", \"allocations\": " << memoryStats.allocationCount << ", \"allocate_calls\": " << memoryStats.memoryAllocateCalls
+		<< ", \"reserved_bytes\": " << memoryStats.bytesReserved << ", \"used_bytes\": " << memoryStats.bytesUsed
+		<< ", \"largest_free_bytes\": " << memoryStats.largestFreeRange << " },\n";
+	file << "  \"frames\": " << measuredFrames << ",\n";
+	file << "  \"warmup_frames\": " << settings.warmupFrames << ",\n";
+	file << "  \"fps\": " << measuredFrames / runSeconds << ",\n";
+	writeSummary(file, "cpu_frame_ms", cpuSummary, false);
+	writeSummary(file, "cpu_wait_ms", summarise(cpuWaitMs), false);
+	writeSummary(file, "cpu_record_ms", summarise(cpuRecordMs), false);
+	writeSummary(file, "cpu_submit_ms", summarise(cpuSubmitMs), false);
+	writeSummary(file, "cpu_present_ms", summarise(cpuPresentMs), false);
+	writeSummary(file, "cpu_cull_ms", summarise(cpuCullMs), false);
+	writeSummary(file, "gpu_frame_ms", gpuSummary, false);
+	writeSummary(file, "gpu_main_pass_ms", summarise(gpuMainPassMs), false);
+	writeSummary(file, "gpu_model_ms", summarise(gpuModelMs), false);
+	file << "  \"gpu_samples\": " << gpuFrameMs.size() << ",\n";
+	file << "  \"scene_commands_reused\": " << static_cast<double>(reusedFrames) / measuredFrames << ",\n";
+	file << "  \"draw_calls_per_frame\": " << static_cast<double>(drawCalls) / measuredFrames << ",\n";
+	if (!gpuFrameMs.empty())
+	{
+		//Per GPU sample, same frames as the GPU times
+		file << "  \"gpu_visible_draws_per_frame\": " << static_cast<double>(gpuVisibleDraws) / gpuFrameMs.size() << ",\n";
+		file << "  \"gpu_culled_draws_per_frame\": " << static_cast<double>(gpuCulledDraws) / gpuFrameMs.size() << ",\n";
+		file << "  \"gpu_occluded_draws_per_frame\": " << static_cast<double>(gpuOccludedDraws) / gpuFrameMs.size() << ",\n";
+		file << "  \"gpu_late_draws_per_frame\": " << static_cast<double>(gpuLateDraws) / gpuFrameMs.size() << ",\n";
+	}
+	file << "  \"cpu_visible_draws_per_frame\": " << static_cast<double>(cpuVisibleDraws) / measuredFrames << ",\n";
+	file << "  \"cpu_culled_draws_per_frame\": " << static_cast<double>(cpuCulledDraws) / measuredFrames << ",\n";
+	file << "  \"blended_draws_per_frame\": " << static_cast<double>(blendedDraws) / measuredFrames << ",\n";
+	file << "  \"indirect_commands_per_frame\": " << static_cast<double>(indirectCommands) / measuredFrames << ",\n";
+	//Untracked is model order without the bind tracker, the same with or without --sort, so it is the count before both
+	file << "  \"binds_per_frame\": " << static_cast<double>(bindsIssued) / measuredFrames << ",\n";
+	file << "  \"binds_per_frame_skipped\": " << static_cast<double>(bindsSkipped) / measuredFrames << ",\n";
+	file << "  \"binds_per_frame_untracked\": " << static_cast<double>(bindsUnsorted) / measuredFrames << ",\n";
+	file << "  \"bytes_uploaded_per_frame\": " << static_cast<double>(bytesUploaded) / measuredFrames << ",\n";
+	file << "  \"uniform_bytes_per_frame\": " << static_cast<double>(uniformBytesUsed) / measuredFrames << ",\n";
+	file << "  \"bytes_uploaded_total\": " << finalStats.totalBytesUploaded << (modelStatsFrames > 0 ? ",\n" : "\n");
+	if (modelStatsFrames > 0)
+	{
+		//Per frame averages for every model ID
+		file << "  \"model_pipeline_stats\": [\n";
+		for (size_t i = 0; i < modelStatsSum.size(); i++)
+		{
+			file << "    { \"model\": " << i
+				<< ", \"vertex_invocations\": " << static_cast<double>(modelStatsSum[i].vertexInvocations) / modelStatsFrames
+				<< ", \"clipping_primitives\": " << static_cast<double>(modelStatsSum[i].clippingPrimitives) / modelStatsFrames
+				<< ", \"fragment_invocations\": " << static_cast<double>(modelStatsSum[i].fragmentInvocations) / modelStatsFrames
+				<< " }" << (i + 1 < modelStatsSum.size() ? ",\n" : "\n");
+		}
+		file << "  ]\n";
+	}
+	file << "}\n";
+	file.close();
+
+	printf("%zu frames, %.1f fps, cpu mean %.3f ms p99 %.3f ms, gpu mean %.3f ms, %s written\n",
+		measuredFrames, measuredFrames / runSeconds, cpuSummary.mean, cpuSummary.p99, gpuSummary.mean, settings.outputFile.c_str());
+
+	return 0;
+}
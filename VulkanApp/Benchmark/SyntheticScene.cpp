@@ -0,0 +1,177 @@
+#include "SyntheticScene.h"
+
+#include <cmath>
+
+//Distance between instances of a model, and between models when they have none
+static const float INSTANCE_SPACING = 3.0f;
+
+SyntheticScene::SyntheticScene(int modelCount, int meshesPerModel, int instancesPerModel, int textureCount, int meshDetail)
+{
+	this->modelCount = modelCount;
+	this->meshesPerModel = meshesPerModel;
+	this->instancesPerModel = instancesPerModel;
+	this->textureCount = textureCount;
+	this->meshDetail = meshDetail;
+}
+
+void SyntheticScene::build(VulkanRenderer& renderer)
+{
+	//Textures first so meshes can refer to their descriptor IDs
+	const uint32_t textureSize = 64;
+	std::vector<int> textureIDs;
+	for (int i = 0; i < textureCount; i++)
+	{
+		std::vector<unsigned char> pixels = createCheckerTexture(textureSize, i);
+		textureIDs.push_back(renderer.createTexture(textureSize, textureSize, pixels.data()));
+	}
+
+	//Lay the models out on a square grid around the point the camera looks at, instances of a model on a smaller grid inside its cell
+	int gridSize = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(modelCount))));
+	int instanceGridSize = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(instancesPerModel))));
+	const float modelSpacing = INSTANCE_SPACING * instanceGridSize;
+	const glm::vec3 gridCentre = glm::vec3(0.0f, 0.0f, -4.0f);
+
+	for (int i = 0; i < modelCount; i++)
+	{
+		std::vector<MeshData> meshes;
+
+		//Meshes of a model are small cubes stacked on top of each other
+		for (int j = 0; j < meshesPerModel; j++)
+		{
+			int textureID = textureIDs[(i * meshesPerModel + j) % textureCount];
+			glm::vec3 meshCentre = glm::vec3(0.0f, j * 0.6f, 0.0f);
+			meshes.push_back(createCube(meshCentre, 0.25f, meshDetail, textureID));
+
+			triangleCount += meshes.back().indices.size() / 3 * instancesPerModel;
+		}
+		meshCount += meshes.size();
+
+		modelIDs.push_back(renderer.createMeshModel(meshes));
+		if (instancesPerModel > 1)
+		{
+			renderer.createInstances(modelIDs.back(), instancesPerModel);
+		}
+
+		float x = (i % gridSize - (gridSize - 1) * 0.5f) * modelSpacing;
+		float z = (i / gridSize - (gridSize - 1) * 0.5f) * modelSpacing;
+		modelPositions.push_back(gridCentre + glm::vec3(x, 0.0f, z));
+	}
+
+	instanceMatrices.resize(instancesPerModel);
+}
+
+void SyntheticScene::update(VulkanRenderer& renderer, float time)
+{
+	//Every model spins so each frame pushes a new matrix like the main app does
+	for (size_t i = 0; i < modelIDs.size(); i++)
+	{
+		glm::mat4 model = glm::translate(glm::mat4(1.0f), modelPositions[i]);
+		model = glm::rotate(model, glm::radians(time * 10.0f + i * 7.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+		if (instancesPerModel == 1)
+		{
+			renderer.updateModel(modelIDs[i], model);
+			continue;
+		}
+
+		//Instances spin with their model, spread over its cell, all in one call
+		int instanceGridSize = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(instancesPerModel))));
+		for (int j = 0; j < instancesPerModel; j++)
+		{
+			float x = (j % instanceGridSize - (instanceGridSize - 1) * 0.5f) * INSTANCE_SPACING;
+			float z = (j / instanceGridSize - (instanceGridSize - 1) * 0.5f) * INSTANCE_SPACING;
+			instanceMatrices[j] = glm::translate(glm::mat4(1.0f), glm::vec3(x, 0.0f, z)) * model;
+		}
+		renderer.updateInstances(modelIDs[i], instanceMatrices);
+	}
+}
+
+size_t SyntheticScene::getMeshCount()
+{
+	return meshCount;
+}
+
+size_t SyntheticScene::getTriangleCount()
+{
+	return triangleCount;
+}
+
+SyntheticScene::~SyntheticScene()
+{
+}
+
+MeshData SyntheticScene::createCube(glm::vec3 centre, float halfSize, int detail, int textureID)
+{
+	MeshData mesh;
+	mesh.textureID = textureID;
+
+	//Face normal, and the two axes spanning the face
+	const glm::vec3 faces[6][3] = {
+		{ {  1, 0, 0 }, { 0, 0, -1 }, { 0, 1, 0 } },
+		{ { -1, 0, 0 }, { 0, 0,  1 }, { 0, 1, 0 } },
+		{ { 0,  1, 0 }, { 1, 0,  0 }, { 0, 0, -1 } },
+		{ { 0, -1, 0 }, { 1, 0,  0 }, { 0, 0,  1 } },
+		{ { 0, 0,  1 }, { 1, 0,  0 }, { 0, 1, 0 } },
+		{ { 0, 0, -1 }, { -1, 0, 0 }, { 0, 1, 0 } },
+	};
+
+	for (const auto& face : faces)
+	{
+		uint32_t firstVertex = static_cast<uint32_t>(mesh.vertices.size());
+
+		for (int y = 0; y <= detail; y++)
+		{
+			for (int x = 0; x <= detail; x++)
+			{
+				float u = static_cast<float>(x) / detail;
+				float v = static_cast<float>(y) / detail;
+
+				Vertex vertex;
+				vertex.pos = centre + (face[0] + face[1] * (u * 2.0f - 1.0f) + face[2] * (v * 2.0f - 1.0f)) * halfSize;
+				vertex.col = { 1.0f, 1.0f, 1.0f };
+				vertex.tex = { u, 1.0f - v };
+				mesh.vertices.push_back(vertex);
+			}
+		}
+
+		//Counter clockwise when looking at the face from outside
+		for (int y = 0; y < detail; y++)
+		{
+			for (int x = 0; x < detail; x++)
+			{
+				uint32_t i0 = firstVertex + y * (detail + 1) + x;
+				uint32_t i1 = i0 + 1;
+				uint32_t i2 = i0 + (detail + 1);
+				uint32_t i3 = i2 + 1;
+
+				mesh.indices.insert(mesh.indices.end(), { i0, i1, i3, i0, i3, i2 });
+			}
+		}
+	}
+
+	return mesh;
+}
+
+std::vector<unsigned char> SyntheticScene::createCheckerTexture(uint32_t size, int seed)
+{
+	std::vector<unsigned char> pixels(size * size * 4);
+
+	//Cheap hash so each texture gets its own colour
+	unsigned char r = static_cast<unsigned char>(64 + (seed * 97) % 192);
+	unsigned char g = static_cast<unsigned char>(64 + (seed * 57) % 192);
+	unsigned char b = static_cast<unsigned char>(64 + (seed * 31) % 192);
+
+	for (uint32_t y = 0; y < size; y++)
+	{
+		for (uint32_t x = 0; x < size; x++)
+		{
+			bool light = ((x / 8) + (y / 8)) % 2 == 0;
+			unsigned char* pixel = &pixels[(y * size + x) * 4];
+			pixel[0] = light ? r : r / 2;
+			pixel[1] = light ? g : g / 2;
+			pixel[2] = light ? b : b / 2;
+			pixel[3] = 255;
+		}
+	}
+
+	return pixels;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "../VulkanRenderer.h"
+
+//Procedurally generated scene used by the benchmark: N models x M meshes x T textures, each model drawn I times
+class SyntheticScene
+{
+public:
+	SyntheticScene(int modelCount, int meshesPerModel, int instancesPerModel, int textureCount, int meshDetail);
+
+	void build(VulkanRenderer& renderer);
+	void update(VulkanRenderer& renderer, float time);
+
+	size_t getMeshCount();
+	size_t getTriangleCount();
+
+	~SyntheticScene();
+
+private:
+	int modelCount;
+	int meshesPerModel;
+	int instancesPerModel;		//More than 1 uses the renderer's instancing
+	int textureCount;
+	int meshDetail;				//Quads per cube face edge
+
+	size_t meshCount = 0;
+	size_t triangleCount = 0;
+
+	std::vector<int> modelIDs;
+	std::vector<glm::vec3> modelPositions;
+	std::vector<glm::mat4> instanceMatrices;
+
+	static MeshData createCube(glm::vec3 centre, float halfSize, int detail, int textureID);
+	static std::vector<unsigned char> createCheckerTexture(uint32_t size, int seed);
+};
@@ -0,0 +1,96 @@
+#include "TraceReplay.h"
+
+#include <thread>
+
+TraceReplay::TraceReplay()
+{
+}
+
+bool TraceReplay::load(const std::string& fileName)
+{
+	FrameTraceReader reader;
+	if (!reader.open(fileName))
+	{
+		return false;
+	}
+	header = reader.getHeader();
+
+	TraceRecord record;
+	while (reader.readNext(record))
+	{
+		if (record.type == TraceRecordType::Draw) { drawCount++; }
+		if (record.type == TraceRecordType::CreateMeshModelFile || record.type == TraceRecordType::CreateMeshModelData) { modelCount++; }
+		records.push_back(record);
+		record = TraceRecord();
+	}
+	return true;
+}
+
+TraceHeader TraceReplay::getHeader()
+{
+	return header;
+}
+
+size_t TraceReplay::getDrawCount()
+{
+	return drawCount;
+}
+
+size_t TraceReplay::getModelCount()
+{
+	return modelCount;
+}
+
+bool TraceReplay::playFrame(VulkanRenderer& renderer, bool paced)
+{
+	while (nextRecord < records.size())
+	{
+		TraceRecord& record = records[nextRecord++];
+
+		if (!started)
+		{
+			startTime = std::chrono::steady_clock::now() - std::chrono::microseconds(record.timeMicros);
+			started = true;
+		}
+
+		switch (record.type)
+		{
+		case TraceRecordType::CreateMeshModelFile:
+			renderer.createMeshModel(record.fileName);
+			break;
+		case TraceRecordType::CreateMeshModelData:
+			renderer.createMeshModel(record.meshData);
+			break;
+		case TraceRecordType::CreateTexture:
+			renderer.createTexture(record.width, record.height, record.pixels.data());
+			break;
+		case TraceRecordType::UpdateModel:
+			renderer.updateModel(record.value, record.matrix);
+			break;
+		case TraceRecordType::SetMaxFrameDraws:
+			renderer.setMaxFrameDraws(record.value);
+			break;
+		case TraceRecordType::CreateInstances:
+			renderer.createInstances(record.value, record.count);
+			break;
+		case TraceRecordType::UpdateInstances:
+			renderer.updateInstances(record.value, record.matrices);
+			break;
+		case TraceRecordType::DestroyMeshModel:
+			renderer.destroyMeshModel(record.value);
+			break;
+		case TraceRecordType::Draw:
+			if (paced)
+			{
+				std::this_thread::sleep_until(startTime + std::chrono::microseconds(record.timeMicros));
+			}
+			renderer.draw();
+			return true;
+		}
+	}
+	return false;
+}
+
+TraceReplay::~TraceReplay()
+{
+}
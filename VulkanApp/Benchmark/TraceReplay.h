@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <chrono>
+
+#include "../VulkanRenderer.h"
+#include "../FrameTrace.h"
+
+//Plays a trace captured with VulkanRenderer::startTrace back into a renderer, one frame per call
+class TraceReplay
+{
+public:
+	TraceReplay();
+
+	//Reads the whole trace up front so file reads don't end up in the frame times
+	bool load(const std::string& fileName);
+
+	TraceHeader getHeader();
+	size_t getDrawCount();
+	size_t getModelCount();
+
+	//Runs the calls up to and including the next draw. Paced waits until the draw's recorded time,
+	//otherwise it goes as fast as possible. False once the trace has no draws left
+	bool playFrame(VulkanRenderer& renderer, bool paced);
+
+	~TraceReplay();
+
+private:
+	TraceHeader header;
+	std::vector<TraceRecord> records;
+	size_t nextRecord = 0;
+	size_t drawCount = 0;
+	size_t modelCount = 0;
+
+	bool started = false;
+	std::chrono::steady_clock::time_point startTime;	//Replay time that lines up with trace time 0
+};
@@ -0,0 +1,497 @@
+#include "DeviceAllocator.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+const VkDeviceSize MIN_REGION_SIZE = 256;				//Every region's offset and size are a multiple of it
+const VkDeviceSize DEFAULT_BLOCK_SIZE = 64ull << 20;
+const VkDeviceSize SMALL_HEAP_SIZE = 512ull << 20;		//Heaps up to this get blocks of an eighth of their size
+const uint32_t SL_BITS = 4;								//Second level lists split each power of two into 16
+const uint32_t SL_COUNT = 1 << SL_BITS;
+const uint32_t FL_COUNT = 64;
+const uint32_t NO_REGION = UINT32_MAX;
+
+//A used or free range of a block. Regions are chained in address order, free ones also in their size class list
+struct Region
+{
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	uint32_t prevPhysical = NO_REGION;
+	uint32_t nextPhysical = NO_REGION;
+	uint32_t prevFree = NO_REGION;
+	uint32_t nextFree = NO_REGION;
+	bool free = false;
+};
+
+struct MemoryBlock
+{
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize size = 0;
+	char* mapped = nullptr;
+	uint32_t pool = 0;
+
+	std::vector<Region> regions;
+	std::vector<uint32_t> unusedRegions;	//Slots of merged regions, reused before regions grows
+
+	//Bit fl of flBitmap is set when any list of that power of two has a region, bit sl of slBitmap[fl] when list [fl][sl] has
+	uint64_t flBitmap = 0;
+	uint32_t slBitmap[FL_COUNT] = {};
+	uint32_t freeHeads[FL_COUNT][SL_COUNT];
+
+	uint32_t allocationCount = 0;
+	VkDeviceSize bytesUsed = 0;
+};
+
+static uint32_t highestBit(uint64_t value)
+{
+	uint32_t bit = 0;
+	while (value >>= 1)
+	{
+		bit++;
+	}
+	return bit;
+}
+
+static uint32_t lowestBit(uint64_t value)
+{
+	uint32_t bit = 0;
+	while ((value & 1) == 0)
+	{
+		value >>= 1;
+		bit++;
+	}
+	return bit;
+}
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+//Size class of a free region: fl is its highest bit, sl the next SL_BITS bits below it
+static void sizeClass(VkDeviceSize size, uint32_t* fl, uint32_t* sl)
+{
+	*fl = highestBit(size);
+	*sl = static_cast<uint32_t>(size >> (*fl - SL_BITS)) & (SL_COUNT - 1);
+}
+
+static uint32_t newRegion(MemoryBlock& block)
+{
+	if (!block.unusedRegions.empty())
+	{
+		uint32_t region = block.unusedRegions.back();
+		block.unusedRegions.pop_back();
+		block.regions[region] = Region();
+		return region;
+	}
+
+	block.regions.push_back(Region());
+	return static_cast<uint32_t>(block.regions.size() - 1);
+}
+
+static void insertFree(MemoryBlock& block, uint32_t region)
+{
+	Region& free = block.regions[region];
+	uint32_t fl, sl;
+	sizeClass(free.size, &fl, &sl);
+
+	free.free = true;
+	free.prevFree = NO_REGION;
+	free.nextFree = block.freeHeads[fl][sl];
+	if (free.nextFree != NO_REGION)
+	{
+		block.regions[free.nextFree].prevFree = region;
+	}
+	block.freeHeads[fl][sl] = region;
+	block.flBitmap |= 1ull << fl;
+	block.slBitmap[fl] |= 1u << sl;
+}
+
+static void removeFree(MemoryBlock& block, uint32_t region)
+{
+	Region& free = block.regions[region];
+	uint32_t fl, sl;
+	sizeClass(free.size, &fl, &sl);
+
+	if (free.prevFree != NO_REGION)
+	{
+		block.regions[free.prevFree].nextFree = free.nextFree;
+	}
+	else
+	{
+		block.freeHeads[fl][sl] = free.nextFree;
+	}
+	if (free.nextFree != NO_REGION)
+	{
+		block.regions[free.nextFree].prevFree = free.prevFree;
+	}
+
+	if (block.freeHeads[fl][sl] == NO_REGION)
+	{
+		block.slBitmap[fl] &= ~(1u << sl);
+		if (block.slBitmap[fl] == 0)
+		{
+			block.flBitmap &= ~(1ull << fl);
+		}
+	}
+	free.free = false;
+}
+
+//Splits size bytes off the front of region, the rest becomes a new region after it
+static uint32_t splitRegion(MemoryBlock& block, uint32_t region, VkDeviceSize size)
+{
+	uint32_t rest = newRegion(block);
+	Region& first = block.regions[region];
+	Region& second = block.regions[rest];
+
+	second.offset = first.offset + size;
+	second.size = first.size - size;
+	second.prevPhysical = region;
+	second.nextPhysical = first.nextPhysical;
+	if (second.nextPhysical != NO_REGION)
+	{
+		block.regions[second.nextPhysical].prevPhysical = rest;
+	}
+	first.size = size;
+	first.nextPhysical = rest;
+	return rest;
+}
+
+//Folds the region after region into it
+static void mergeNext(MemoryBlock& block, uint32_t region)
+{
+	Region& first = block.regions[region];
+	uint32_t next = first.nextPhysical;
+	Region& second = block.regions[next];
+
+	first.size += second.size;
+	first.nextPhysical = second.nextPhysical;
+	if (first.nextPhysical != NO_REGION)
+	{
+		block.regions[first.nextPhysical].prevPhysical = region;
+	}
+	block.unusedRegions.push_back(next);
+}
+
+//First region of a list whose every region is at least size, found from the bitmaps without walking any list
+static uint32_t findFree(MemoryBlock& block, VkDeviceSize size)
+{
+	//Rounded up to the next size class, the class of size itself can hold smaller regions
+	uint32_t fl, sl;
+	sizeClass(size, &fl, &sl);
+	size += (1ull << (fl - SL_BITS)) - 1;
+	sizeClass(size, &fl, &sl);
+	if (fl >= FL_COUNT)
+	{
+		return NO_REGION;
+	}
+
+	uint32_t slMap = block.slBitmap[fl] & (~0u << sl);
+	if (slMap == 0)
+	{
+		uint64_t flMap = fl + 1 < FL_COUNT ? block.flBitmap & (~0ull << (fl + 1)) : 0;
+		if (flMap == 0)
+		{
+			return NO_REGION;
+		}
+		fl = lowestBit(flMap);
+		slMap = block.slBitmap[fl];
+	}
+	return block.freeHeads[fl][lowestBit(slMap)];
+}
+
+static uint32_t blockAllocate(MemoryBlock& block, VkDeviceSize size, VkDeviceSize alignment)
+{
+	//Region offsets are already MIN_REGION_SIZE aligned, bigger alignments can need that much less padding in front
+	size = alignUp(size, MIN_REGION_SIZE);
+	VkDeviceSize padding = alignment > MIN_REGION_SIZE ? alignment - MIN_REGION_SIZE : 0;
+	uint32_t region = findFree(block, size + padding);
+	if (region == NO_REGION)
+	{
+		return NO_REGION;
+	}
+	removeFree(block, region);
+
+	//Padding becomes a free region of its own
+	VkDeviceSize front = alignUp(block.regions[region].offset, alignment) - block.regions[region].offset;
+	if (front > 0)
+	{
+		uint32_t aligned = splitRegion(block, region, front);
+		insertFree(block, region);
+		region = aligned;
+	}
+
+	if (block.regions[region].size - size >= MIN_REGION_SIZE)
+	{
+		insertFree(block, splitRegion(block, region, size));
+	}
+	return region;
+}
+
+static void blockFree(MemoryBlock& block, uint32_t region)
+{
+	//Free neighbours are merged straight away, so two free regions are never next to each other
+	uint32_t next = block.regions[region].nextPhysical;
+	if (next != NO_REGION && block.regions[next].free)
+	{
+		removeFree(block, next);
+		mergeNext(block, region);
+	}
+
+	uint32_t prev = block.regions[region].prevPhysical;
+	if (prev != NO_REGION && block.regions[prev].free)
+	{
+		removeFree(block, prev);
+		mergeNext(block, prev);
+		region = prev;
+	}
+	insertFree(block, region);
+}
+
+DeviceAllocator::DeviceAllocator()
+{
+}
+
+void DeviceAllocator::init(VkPhysicalDevice physicalDevice, VkDevice device)
+{
+	this->physicalDevice = physicalDevice;
+	this->device = device;
+	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+	pools.resize(memoryProperties.memoryTypeCount * 2);
+	blockSizes.resize(memoryProperties.memoryTypeCount);
+	for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+	{
+		//Small heaps, like the host visible device local one, would be used up by a few blocks
+		VkDeviceSize heapSize = memoryProperties.memoryHeaps[memoryProperties.memoryTypes[i].heapIndex].size;
+		VkDeviceSize blockSize = heapSize <= SMALL_HEAP_SIZE ? heapSize / 8 : DEFAULT_BLOCK_SIZE;
+		blockSizes[i] = std::max(blockSize / MIN_REGION_SIZE * MIN_REGION_SIZE, MIN_REGION_SIZE);
+	}
+}
+
+void DeviceAllocator::destroy()
+{
+	//Everything placed in the blocks should have been freed by now
+	for (auto& pool : pools)
+	{
+		for (auto& block : pool)
+		{
+			freeMemory(block->memory, block->mapped);
+		}
+		pool.clear();
+	}
+}
+
+VkDevice DeviceAllocator::getDevice()
+{
+	return device;
+}
+
+void DeviceAllocator::allocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, DeviceAllocation* allocation)
+{
+	VkMemoryRequirements memoryRequirements;
+	vkGetBufferMemoryRequirements(device, buffer, &memoryRequirements);
+
+	allocate(memoryRequirements, properties, true, allocation);
+	vkBindBufferMemory(device, buffer, allocation->memory, allocation->offset);
+}
+
+void DeviceAllocator::allocateImage(VkImage image, VkImageTiling tiling, VkMemoryPropertyFlags properties, DeviceAllocation* allocation)
+{
+	VkMemoryRequirements memoryRequirements;
+	vkGetImageMemoryRequirements(device, image, &memoryRequirements);
+
+	allocate(memoryRequirements, properties, tiling == VK_IMAGE_TILING_LINEAR, allocation);
+	vkBindImageMemory(device, image, allocation->memory, allocation->offset);
+}
+
+void DeviceAllocator::free(DeviceAllocation& allocation)
+{
+	if (allocation.memory == VK_NULL_HANDLE)
+	{
+		return;
+	}
+	allocationCount--;
+
+	if (allocation.block == nullptr)
+	{
+		freeMemory(allocation.memory, allocation.mapped);
+		dedicatedCount--;
+		dedicatedBytes -= allocation.size;
+		allocation = DeviceAllocation();
+		return;
+	}
+
+	MemoryBlock& block = *allocation.block;
+	block.bytesUsed -= allocation.size;
+	block.allocationCount--;
+	blockFree(block, allocation.region);
+
+	//An empty block is kept while it is its pool's only one, so a lone staging buffer doesn't allocate a block every time
+	std::vector<std::unique_ptr<MemoryBlock>>& pool = pools[block.pool];
+	if (block.allocationCount == 0 && pool.size() > 1)
+	{
+		auto found = std::find_if(pool.begin(), pool.end(), [&](const std::unique_ptr<MemoryBlock>& candidate) {
+			return candidate.get() == &block;
+		});
+		freeMemory(block.memory, block.mapped);
+		pool.erase(found);
+	}
+	allocation = DeviceAllocation();
+}
+
+DeviceMemoryStats DeviceAllocator::getStats()
+{
+	DeviceMemoryStats stats;
+	stats.dedicatedCount = dedicatedCount;
+	stats.allocationCount = allocationCount;
+	stats.memoryAllocateCalls = memoryAllocateCalls;
+	stats.bytesReserved = dedicatedBytes;
+	stats.bytesUsed = dedicatedBytes;
+
+	for (auto& pool : pools)
+	{
+		for (auto& block : pool)
+		{
+			stats.blockCount++;
+			stats.bytesReserved += block->size;
+			stats.bytesUsed += block->bytesUsed;
+
+			//Largest free region sits in the highest non empty list
+			if (block->flBitmap != 0)
+			{
+				uint32_t fl = highestBit(block->flBitmap);
+				uint32_t sl = highestBit(block->slBitmap[fl]);
+				for (uint32_t region = block->freeHeads[fl][sl]; region != NO_REGION; region = block->regions[region].nextFree)
+				{
+					stats.largestFreeRange = std::max(stats.largestFreeRange, block->regions[region].size);
+				}
+			}
+		}
+	}
+	return stats;
+}
+
+DeviceAllocator::~DeviceAllocator()
+{
+}
+
+uint32_t DeviceAllocator::findMemoryType(uint32_t allowedTypes, VkMemoryPropertyFlags properties)
+{
+	for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+	{
+		if ((allowedTypes & (1 << i))//index of memory type must mach corrosponding bit in allowedTypes
+			&& (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) //Desired propperty bit flags are part of memory's type flags
+		{
+			return i;
+		}
+	}
+
+	throw std::runtime_error("Failed to find a suitable memory type");
+}
+
+void DeviceAllocator::allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool linear, DeviceAllocation* allocation)
+{
+	uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, properties);
+	VkDeviceSize blockSize = blockSizes[memoryType];
+	*allocation = DeviceAllocation();
+	allocation->size = requirements.size;
+
+	//Anything over half a block would leave most of a new block unusable
+	if (requirements.size > blockSize / 2)
+	{
+		void* mapped = nullptr;
+		allocation->memory = allocateMemory(requirements.size, memoryType, &mapped);
+		allocation->mapped = mapped;
+		dedicatedCount++;
+		dedicatedBytes += requirements.size;
+		allocationCount++;
+		return;
+	}
+
+	uint32_t poolIndex = memoryType * 2 + (linear ? 1 : 0);
+	std::vector<std::unique_ptr<MemoryBlock>>& pool = pools[poolIndex];
+	uint32_t region = NO_REGION;
+	MemoryBlock* block = nullptr;
+	for (auto& candidate : pool)
+	{
+		region = blockAllocate(*candidate, requirements.size, requirements.alignment);
+		if (region != NO_REGION)
+		{
+			block = candidate.get();
+			break;
+		}
+	}
+
+	if (block == nullptr)
+	{
+		std::unique_ptr<MemoryBlock> newBlock(new MemoryBlock());
+		void* mapped = nullptr;
+		newBlock->memory = allocateMemory(blockSize, memoryType, &mapped);
+		newBlock->mapped = static_cast<char*>(mapped);
+		newBlock->size = blockSize;
+		newBlock->pool = poolIndex;
+		std::fill(&newBlock->freeHeads[0][0], &newBlock->freeHeads[0][0] + FL_COUNT * SL_COUNT, NO_REGION);
+
+		//Starts as one free region covering the whole block
+		uint32_t whole = newRegion(*newBlock);
+		newBlock->regions[whole].size = blockSize;
+		insertFree(*newBlock, whole);
+
+		region = blockAllocate(*newBlock, requirements.size, requirements.alignment);
+		if (region == NO_REGION)
+		{
+			freeMemory(newBlock->memory, newBlock->mapped);
+			throw std::runtime_error("Failed to place an allocation in a new memory block");
+		}
+		block = newBlock.get();
+		pool.push_back(std::move(newBlock));
+	}
+
+	allocationCount++;
+	block->allocationCount++;
+	block->bytesUsed += requirements.size;
+	allocation->memory = block->memory;
+	allocation->offset = block->regions[region].offset;
+	allocation->mapped = block->mapped ? block->mapped + allocation->offset : nullptr;
+	allocation->block = block;
+	allocation->region = region;
+}
+
+VkDeviceMemory DeviceAllocator::allocateMemory(VkDeviceSize size, uint32_t memoryType, void** mapped)
+{
+	VkMemoryAllocateInfo memoryAllocateInfo = {};
+	memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	memoryAllocateInfo.allocationSize = size;
+	memoryAllocateInfo.memoryTypeIndex = memoryType;
+
+	VkDeviceMemory memory;
+	VkResult result = vkAllocateMemory(device, &memoryAllocateInfo, nullptr, &memory);
+	if (result != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to allocate device memory");
+	}
+	memoryAllocateCalls++;
+
+	//A VkDeviceMemory can only be mapped once, so host visible memory is mapped whole for its lifetime
+	*mapped = nullptr;
+	if (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+	{
+		result = vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, mapped);
+		if (result != VK_SUCCESS)
+		{
+			vkFreeMemory(device, memory, nullptr);
+			throw std::runtime_error("Failed to map device memory");
+		}
+	}
+	return memory;
+}
+
+void DeviceAllocator::freeMemory(VkDeviceMemory memory, void* mapped)
+{
+	if (mapped != nullptr)
+	{
+		vkUnmapMemory(device, memory);
+	}
+	vkFreeMemory(device, memory, nullptr);
+}
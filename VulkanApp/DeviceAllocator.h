@@ -0,0 +1,77 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+struct MemoryBlock;
+
+//Where a buffer or image lives, handed back to DeviceAllocator::free
+struct DeviceAllocation
+{
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;			//What the resource asked for, the range reserved for it can be bigger
+	void* mapped = nullptr;			//Host visible memory stays mapped, points at offset
+
+	MemoryBlock* block = nullptr;	//Null for dedicated allocations
+	uint32_t region = 0;			//Region of the block
+};
+
+struct DeviceMemoryStats
+{
+	uint32_t blockCount = 0;			//Shared VkDeviceMemory blocks
+	uint32_t dedicatedCount = 0;		//Resources too big for a block, with their own VkDeviceMemory
+	uint32_t allocationCount = 0;		//Live resources, in blocks or dedicated
+	uint64_t memoryAllocateCalls = 0;	//vkAllocateMemory calls since init, blocks and dedicated
+	VkDeviceSize bytesReserved = 0;		//Size of every block and dedicated allocation
+	VkDeviceSize bytesUsed = 0;			//Asked for by live resources
+	VkDeviceSize largestFreeRange = 0;	//Biggest free range in any block
+};
+
+//Places buffers and images in large VkDeviceMemory blocks instead of one vkAllocateMemory per resource.
+//Blocks are kept per memory type, and separately for linear (buffers) and optimal (images) resources so the two
+//never share a bufferImageGranularity page. Inside a block free ranges are found with a two level segregated fit
+//(TLSF): free lists by power of two and sixteen steps within each, with bitmaps to find a non empty one in constant time.
+//Not thread safe, resources are only created and destroyed on the renderer's thread
+class DeviceAllocator
+{
+public:
+	DeviceAllocator();
+
+	void init(VkPhysicalDevice physicalDevice, VkDevice device);
+	void destroy();
+
+	VkDevice getDevice();
+
+	//Allocates and binds memory for a created resource
+	void allocateBuffer(VkBuffer buffer, VkMemoryPropertyFlags properties, DeviceAllocation* allocation);
+	void allocateImage(VkImage image, VkImageTiling tiling, VkMemoryPropertyFlags properties, DeviceAllocation* allocation);
+	void free(DeviceAllocation& allocation);
+
+	DeviceMemoryStats getStats();
+
+	~DeviceAllocator();
+
+private:
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	VkPhysicalDeviceMemoryProperties memoryProperties = {};
+
+	//[memory type * 2 + linear], blocks of that memory type
+	std::vector<std::vector<std::unique_ptr<MemoryBlock>>> pools;
+	std::vector<VkDeviceSize> blockSizes;		//Per memory type, from the size of its heap
+
+	uint32_t dedicatedCount = 0;
+	uint32_t allocationCount = 0;
+	uint64_t memoryAllocateCalls = 0;
+	VkDeviceSize dedicatedBytes = 0;
+
+	uint32_t findMemoryType(uint32_t allowedTypes, VkMemoryPropertyFlags properties);
+	void allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, bool linear, DeviceAllocation* allocation);
+	VkDeviceMemory allocateMemory(VkDeviceSize size, uint32_t memoryType, void** mapped);
+	void freeMemory(VkDeviceMemory memory, void* mapped);
+};
@@ -0,0 +1,148 @@
+#include "DrawQueue.h"
+
+DrawQueue::DrawQueue()
+{
+}
+
+uint64_t DrawQueue::makeSortKey(uint32_t pipelineID, uint32_t textureID, uint32_t geometryID)
+{
+	return (static_cast<uint64_t>(pipelineID & 0xFF) << 56)
+		| (static_cast<uint64_t>(textureID & 0xFFFF) << 40)
+		| (static_cast<uint64_t>(geometryID) << 8);
+}
+
+void DrawQueue::build(const std::vector<DrawPacket>& packets)
+{
+	keys.resize(packets.size());
+	order.resize(packets.size());
+	for (size_t i = 0; i < packets.size(); i++)
+	{
+		keys[i] = packets[i].sortKey;
+		order[i] = static_cast<uint32_t>(i);
+	}
+
+	radixSort();
+}
+
+const std::vector<uint32_t>& DrawQueue::getOrder()
+{
+	return order;
+}
+
+DrawQueue::~DrawQueue()
+{
+}
+
+void DrawQueue::radixSort()
+{
+	size_t count = keys.size();
+	keysScratch.resize(count);
+	orderScratch.resize(count);
+
+	//Histograms of all 8 bytes in one go
+	uint32_t histograms[8][256] = {};
+	for (size_t i = 0; i < count; i++)
+	{
+		uint64_t key = keys[i];
+		for (int byte = 0; byte < 8; byte++)
+		{
+			histograms[byte][(key >> (byte * 8)) & 0xFF]++;
+		}
+	}
+
+	//LSD passes, one per byte. Bytes that are the same in every key (spare bits, single pipeline) are skipped
+	for (int byte = 0; byte < 8; byte++)
+	{
+		uint32_t* histogram = histograms[byte];
+		uint64_t firstBucket = (keys.empty() ? 0 : (keys[0] >> (byte * 8)) & 0xFF);
+		if (histogram[firstBucket] == count)
+		{
+			continue;
+		}
+
+		uint32_t offset = 0;
+		for (int bucket = 0; bucket < 256; bucket++)
+		{
+			uint32_t bucketCount = histogram[bucket];
+			histogram[bucket] = offset;
+			offset += bucketCount;
+		}
+
+		for (size_t i = 0; i < count; i++)
+		{
+			uint32_t destination = histogram[(keys[i] >> (byte * 8)) & 0xFF]++;
+			keysScratch[destination] = keys[i];
+			orderScratch[destination] = order[i];
+		}
+
+		keys.swap(keysScratch);
+		order.swap(orderScratch);
+	}
+}
+
+BindTracker::BindTracker(VkCommandBuffer newCommandBuffer, VkPipelineLayout newPipelineLayout)
+{
+	commandBuffer = newCommandBuffer;
+	pipelineLayout = newPipelineLayout;
+}
+
+void BindTracker::bindPipeline(VkPipeline pipeline)
+{
+	if (pipeline == boundPipeline) { bindsSkipped++; return; }
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	boundPipeline = pipeline;
+	bindsIssued++;
+}
+
+void BindTracker::bindVertexBuffer(VkBuffer buffer, VkDeviceSize offset)
+{
+	if (buffer == boundVertexBuffer && offset == boundVertexOffset) { bindsSkipped++; return; }
+
+	vkCmdBindVertexBuffers(commandBuffer, 0, 1, &buffer, &offset);
+	boundVertexBuffer = buffer;
+	boundVertexOffset = offset;
+	bindsIssued++;
+}
+
+void BindTracker::bindIndexBuffer(VkBuffer buffer)
+{
+	if (buffer == boundIndexBuffer) { bindsSkipped++; return; }
+
+	vkCmdBindIndexBuffer(commandBuffer, buffer, 0, VK_INDEX_TYPE_UINT32);
+	boundIndexBuffer = buffer;
+	bindsIssued++;
+}
+
+void BindTracker::bindDescriptorSet(uint32_t set, VkDescriptorSet descriptorSet)
+{
+	if (descriptorSet == boundSets[set]) { bindsSkipped++; return; }
+
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, set, 1, &descriptorSet, 0, nullptr);
+	boundSets[set] = descriptorSet;
+	bindsIssued++;
+}
+
+void BindTracker::bindDescriptorSet(uint32_t set, VkDescriptorSet descriptorSet, uint32_t dynamicOffset)
+{
+	if (descriptorSet == boundSets[set] && dynamicOffset == boundDynamicOffsets[set]) { bindsSkipped++; return; }
+
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, set, 1, &descriptorSet, 1, &dynamicOffset);
+	boundSets[set] = descriptorSet;
+	boundDynamicOffsets[set] = dynamicOffset;
+	bindsIssued++;
+}
+
+uint32_t BindTracker::getBindsIssued()
+{
+	return bindsIssued;
+}
+
+uint32_t BindTracker::getBindsSkipped()
+{
+	return bindsSkipped;
+}
+
+BindTracker::~BindTracker()
+{
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <vector>
+
+#include "Utilities.h"
+
+//Orders draw packets by their sort key so draws sharing state end up next to each other.
+//Key layout, most significant first: pipeline 8 bits, texture 16 bits, geometry 32 bits, 8 spare.
+//Every mesh is in the one GeometryBuffer, so geometry is 0 for now and packets of a texture keep their order
+class DrawQueue
+{
+public:
+	DrawQueue();
+
+	static uint64_t makeSortKey(uint32_t pipelineID, uint32_t textureID, uint32_t geometryID);
+
+	//Stable, packets with the same key keep their order
+	void build(const std::vector<DrawPacket>& packets);
+	const std::vector<uint32_t>& getOrder();
+
+	~DrawQueue();
+
+private:
+	std::vector<uint64_t> keys;
+	std::vector<uint32_t> order;
+	std::vector<uint64_t> keysScratch;
+	std::vector<uint32_t> orderScratch;
+
+	void radixSort();
+};
+
+//Records binds into one command buffer, skipping any that would set what is already bound
+class BindTracker
+{
+public:
+	BindTracker(VkCommandBuffer newCommandBuffer, VkPipelineLayout newPipelineLayout);
+
+	void bindPipeline(VkPipeline pipeline);
+	void bindVertexBuffer(VkBuffer buffer, VkDeviceSize offset);
+	void bindIndexBuffer(VkBuffer buffer);
+	void bindDescriptorSet(uint32_t set, VkDescriptorSet descriptorSet);
+	void bindDescriptorSet(uint32_t set, VkDescriptorSet descriptorSet, uint32_t dynamicOffset);	//For sets with one dynamic buffer
+
+	uint32_t getBindsIssued();
+	uint32_t getBindsSkipped();
+
+	~BindTracker();
+
+private:
+	VkCommandBuffer commandBuffer;
+	VkPipelineLayout pipelineLayout;
+
+	//Nothing is bound at the start of a command buffer
+	VkPipeline boundPipeline = VK_NULL_HANDLE;
+	VkBuffer boundVertexBuffer = VK_NULL_HANDLE;
+	VkDeviceSize boundVertexOffset = 0;
+	VkBuffer boundIndexBuffer = VK_NULL_HANDLE;
+	VkDescriptorSet boundSets[2] = { VK_NULL_HANDLE, VK_NULL_HANDLE };
+	uint32_t boundDynamicOffsets[2] = { 0, 0 };
+
+	uint32_t bindsIssued = 0;
+	uint32_t bindsSkipped = 0;
+};
@@ -0,0 +1,240 @@
+#include "FrameTrace.h"
+
+FrameTraceWriter::FrameTraceWriter()
+{
+}
+
+bool FrameTraceWriter::open(const std::string& fileName, const TraceHeader& header)
+{
+	file.open(fileName, std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+	{
+		return false;
+	}
+
+	startTime = std::chrono::steady_clock::now();
+	writeBytes(&header, sizeof(TraceHeader));
+	return true;
+}
+
+bool FrameTraceWriter::isOpen()
+{
+	return file.is_open();
+}
+
+void FrameTraceWriter::close()
+{
+	if (file.is_open())
+	{
+		file.close();
+	}
+}
+
+void FrameTraceWriter::writeCreateMeshModel(const std::string& fileName)
+{
+	writeRecordStart(TraceRecordType::CreateMeshModelFile);
+	uint32_t length = static_cast<uint32_t>(fileName.size());
+	writeBytes(&length, sizeof(uint32_t));
+	writeBytes(fileName.data(), length);
+}
+
+void FrameTraceWriter::writeCreateMeshModel(const std::vector<MeshData>& meshData)
+{
+	writeRecordStart(TraceRecordType::CreateMeshModelData);
+	uint32_t meshCount = static_cast<uint32_t>(meshData.size());
+	writeBytes(&meshCount, sizeof(uint32_t));
+
+	for (const MeshData& mesh : meshData)
+	{
+		uint32_t vertexCount = static_cast<uint32_t>(mesh.vertices.size());
+		uint32_t indexCount = static_cast<uint32_t>(mesh.indices.size());
+		int32_t textureID = mesh.textureID;
+		uint8_t materialClass = static_cast<uint8_t>(mesh.materialClass);
+
+		writeBytes(&vertexCount, sizeof(uint32_t));
+		writeBytes(mesh.vertices.data(), vertexCount * sizeof(Vertex));
+		writeBytes(&indexCount, sizeof(uint32_t));
+		writeBytes(mesh.indices.data(), indexCount * sizeof(uint32_t));
+		writeBytes(&textureID, sizeof(int32_t));
+		writeBytes(&materialClass, sizeof(uint8_t));
+	}
+}
+
+void FrameTraceWriter::writeCreateTexture(uint32_t width, uint32_t height, const unsigned char* pixels)
+{
+	writeRecordStart(TraceRecordType::CreateTexture);
+	writeBytes(&width, sizeof(uint32_t));
+	writeBytes(&height, sizeof(uint32_t));
+	writeBytes(pixels, static_cast<size_t>(width) * height * 4);
+}
+
+void FrameTraceWriter::writeUpdateModel(int modelID, const glm::mat4& matrix)
+{
+	writeRecordStart(TraceRecordType::UpdateModel);
+	int32_t id = modelID;
+	writeBytes(&id, sizeof(int32_t));
+	writeBytes(&matrix, sizeof(glm::mat4));
+}
+
+void FrameTraceWriter::writeCreateInstances(int modelID, int count)
+{
+	writeRecordStart(TraceRecordType::CreateInstances);
+	int32_t id = modelID;
+	int32_t instances = count;
+	writeBytes(&id, sizeof(int32_t));
+	writeBytes(&instances, sizeof(int32_t));
+}
+
+void FrameTraceWriter::writeUpdateInstances(int modelID, const std::vector<glm::mat4>& matrices)
+{
+	writeRecordStart(TraceRecordType::UpdateInstances);
+	int32_t id = modelID;
+	int32_t count = static_cast<int32_t>(matrices.size());
+	writeBytes(&id, sizeof(int32_t));
+	writeBytes(&count, sizeof(int32_t));
+	writeBytes(matrices.data(), matrices.size() * sizeof(glm::mat4));
+}
+
+void FrameTraceWriter::writeDestroyMeshModel(int modelID)
+{
+	writeRecordStart(TraceRecordType::DestroyMeshModel);
+	int32_t id = modelID;
+	writeBytes(&id, sizeof(int32_t));
+}
+
+void FrameTraceWriter::writeDraw()
+{
+	writeRecordStart(TraceRecordType::Draw);
+}
+
+void FrameTraceWriter::writeSetMaxFrameDraws(int frameDraws)
+{
+	writeRecordStart(TraceRecordType::SetMaxFrameDraws);
+	int32_t value = frameDraws;
+	writeBytes(&value, sizeof(int32_t));
+}
+
+FrameTraceWriter::~FrameTraceWriter()
+{
+	close();
+}
+
+void FrameTraceWriter::writeRecordStart(TraceRecordType type)
+{
+	uint64_t timeMicros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+	writeBytes(&type, sizeof(TraceRecordType));
+	writeBytes(&timeMicros, sizeof(uint64_t));
+}
+
+void FrameTraceWriter::writeBytes(const void* data, size_t size)
+{
+	file.write(reinterpret_cast<const char*>(data), size);
+}
+
+FrameTraceReader::FrameTraceReader()
+{
+}
+
+bool FrameTraceReader::open(const std::string& fileName)
+{
+	file.open(fileName, std::ios::binary);
+	if (!file.is_open())
+	{
+		return false;
+	}
+
+	return readBytes(&header, sizeof(TraceHeader)) && header.magic == TRACE_MAGIC && header.version >= 1 && header.version <= TRACE_VERSION;
+}
+
+TraceHeader FrameTraceReader::getHeader()
+{
+	return header;
+}
+
+bool FrameTraceReader::readNext(TraceRecord& record)
+{
+	if (!readBytes(&record.type, sizeof(TraceRecordType)) || !readBytes(&record.timeMicros, sizeof(uint64_t)))
+	{
+		return false;
+	}
+
+	switch (record.type)
+	{
+	//Sizes come from the file, a corrupt one is rejected before it can ask for a huge allocation
+	case TraceRecordType::CreateMeshModelFile:
+	{
+		uint32_t length = 0;
+		if (!readBytes(&length, sizeof(uint32_t)) || length > TRACE_MAX_FILE_NAME) { return false; }
+		record.fileName.resize(length);
+		return readBytes(&record.fileName[0], length);
+	}
+	case TraceRecordType::CreateMeshModelData:
+	{
+		uint32_t meshCount = 0;
+		if (!readBytes(&meshCount, sizeof(uint32_t)) || meshCount > static_cast<uint32_t>(MAX_INDIRECT_DRAWS)) { return false; }
+		record.meshData.resize(meshCount);
+
+		for (MeshData& mesh : record.meshData)
+		{
+			uint32_t vertexCount = 0;
+			uint32_t indexCount = 0;
+			int32_t textureID = 0;
+
+			if (!readBytes(&vertexCount, sizeof(uint32_t)) || vertexCount > MAX_GEOMETRY_VERTICES) { return false; }
+			mesh.vertices.resize(vertexCount);
+			if (!readBytes(mesh.vertices.data(), vertexCount * sizeof(Vertex))) { return false; }
+
+			if (!readBytes(&indexCount, sizeof(uint32_t)) || indexCount > MAX_GEOMETRY_INDICES) { return false; }
+			mesh.indices.resize(indexCount);
+			if (!readBytes(mesh.indices.data(), indexCount * sizeof(uint32_t))) { return false; }
+
+			if (!readBytes(&textureID, sizeof(int32_t))) { return false; }
+			mesh.textureID = textureID;
+
+			//Older traces have no material class, everything in them was drawn opaque
+			if (header.version >= 3)
+			{
+				uint8_t materialClass = 0;
+				if (!readBytes(&materialClass, sizeof(uint8_t)) || materialClass > static_cast<uint8_t>(MaterialClass::Blended)) { return false; }
+				mesh.materialClass = static_cast<MaterialClass>(materialClass);
+			}
+		}
+		return true;
+	}
+	case TraceRecordType::CreateTexture:
+	{
+		if (!readBytes(&record.width, sizeof(uint32_t)) || !readBytes(&record.height, sizeof(uint32_t))
+			|| record.width > TRACE_MAX_TEXTURE_SIZE || record.height > TRACE_MAX_TEXTURE_SIZE) { return false; }
+		record.pixels.resize(static_cast<size_t>(record.width) * record.height * 4);
+		return readBytes(record.pixels.data(), record.pixels.size());
+	}
+	case TraceRecordType::UpdateModel:
+		return readBytes(&record.value, sizeof(int32_t)) && readBytes(&record.matrix, sizeof(glm::mat4));
+	case TraceRecordType::Draw:
+		return true;
+	case TraceRecordType::SetMaxFrameDraws:
+		return readBytes(&record.value, sizeof(int32_t));
+	case TraceRecordType::CreateInstances:
+		return readBytes(&record.value, sizeof(int32_t)) && readBytes(&record.count, sizeof(int32_t));
+	case TraceRecordType::UpdateInstances:
+		//No model can have more matrices than the buffer holds
+		if (!readBytes(&record.value, sizeof(int32_t)) || !readBytes(&record.count, sizeof(int32_t)) || record.count < 0 || record.count > MAX_TRANSFORMS) { return false; }
+		record.matrices.resize(record.count);
+		return readBytes(record.matrices.data(), record.matrices.size() * sizeof(glm::mat4));
+	case TraceRecordType::DestroyMeshModel:
+		return readBytes(&record.value, sizeof(int32_t));
+	default:
+		//Unknown record, the rest of the trace can't be trusted
+		return false;
+	}
+}
+
+FrameTraceReader::~FrameTraceReader()
+{
+}
+
+bool FrameTraceReader::readBytes(void* data, size_t size)
+{
+	file.read(reinterpret_cast<char*>(data), size);
+	return static_cast<size_t>(file.gcount()) == size;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include <glm/glm.hpp>
+
+#include "Utilities.h"
+
+//Binary trace of the renderer's public calls, written while a session runs and replayed by Benchmark --replay (TraceReplay).
+//Layout: header, then records of [type u8][microseconds since start u64][payload], all little endian as in memory.
+const uint32_t TRACE_MAGIC = 0x52544B56; //"VKTR"
+const uint32_t TRACE_VERSION = 4;	//2 added the instance records, 3 the material class per mesh, 4 destroying models, older traces still read
+const uint32_t TRACE_MAX_FILE_NAME = 4096;		//Longest model path a trace may hold
+const uint32_t TRACE_MAX_TEXTURE_SIZE = 16384;	//Widest or tallest texture a trace may hold
+
+enum class TraceRecordType : uint8_t
+{
+	CreateMeshModelFile = 1,	//file name
+	CreateMeshModelData = 2,	//meshes with vertices, indices, texture ID and material class
+	CreateTexture = 3,			//width, height, RGBA pixels
+	UpdateModel = 4,			//model ID, matrix
+	Draw = 5,
+	SetMaxFrameDraws = 6,		//frames in flight
+	CreateInstances = 7,		//model ID, count
+	UpdateInstances = 8,		//model ID, count, matrices
+	DestroyMeshModel = 9		//model ID
+};
+
+struct TraceHeader
+{
+	uint32_t magic = TRACE_MAGIC;
+	uint32_t version = TRACE_VERSION;
+	uint32_t width = 0;			//Render size the trace was captured at
+	uint32_t height = 0;
+	int32_t maxFrameDraws = DEFAULT_FRAME_DRAWS;
+};
+
+//One decoded record, only the fields of its type are filled
+struct TraceRecord
+{
+	TraceRecordType type;
+	uint64_t timeMicros = 0;
+
+	std::string fileName;
+	std::vector<MeshData> meshData;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<unsigned char> pixels;
+	int32_t value = 0;			//Model ID or frames in flight
+	int32_t count = 0;			//Instances
+	glm::mat4 matrix = glm::mat4(1.0f);
+	std::vector<glm::mat4> matrices;
+};
+
+class FrameTraceWriter
+{
+public:
+	FrameTraceWriter();
+
+	bool open(const std::string& fileName, const TraceHeader& header);
+	bool isOpen();
+	void close();
+
+	void writeCreateMeshModel(const std::string& fileName);
+	void writeCreateMeshModel(const std::vector<MeshData>& meshData);
+	void writeCreateTexture(uint32_t width, uint32_t height, const unsigned char* pixels);
+	void writeUpdateModel(int modelID, const glm::mat4& matrix);
+	void writeCreateInstances(int modelID, int count);
+	void writeUpdateInstances(int modelID, const std::vector<glm::mat4>& matrices);
+	void writeDestroyMeshModel(int modelID);
+	void writeDraw();
+	void writeSetMaxFrameDraws(int frameDraws);
+
+	~FrameTraceWriter();
+
+private:
+	std::ofstream file;
+	std::chrono::steady_clock::time_point startTime;
+
+	void writeRecordStart(TraceRecordType type);
+	void writeBytes(const void* data, size_t size);
+};
+
+class FrameTraceReader
+{
+public:
+	FrameTraceReader();
+
+	bool open(const std::string& fileName);
+	TraceHeader getHeader();
+
+	//False once the trace ends or a record is cut off
+	bool readNext(TraceRecord& record);
+
+	~FrameTraceReader();
+
+private:
+	std::ifstream file;
+	TraceHeader header;
+
+	bool readBytes(void* data, size_t size);
+};
@@ -0,0 +1,163 @@
+#include "FrustumCuller.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define FRUSTUM_CULLER_SSE
+#endif
+
+FrustumCuller::FrustumCuller()
+{
+}
+
+void FrustumCuller::addSphere(const glm::vec4& sphere, uint32_t transformIndex)
+{
+	modelX.push_back(sphere.x);
+	modelY.push_back(sphere.y);
+	modelZ.push_back(sphere.z);
+	modelRadius.push_back(sphere.w);
+	transformIndices.push_back(transformIndex);
+}
+
+void FrustumCuller::clear()
+{
+	modelX.clear();
+	modelY.clear();
+	modelZ.clear();
+	modelRadius.clear();
+	transformIndices.clear();
+}
+
+size_t FrustumCuller::getSphereCount()
+{
+	return modelX.size();
+}
+
+void FrustumCuller::updateWorldSpheres(const std::vector<glm::mat4>& modelMatrices)
+{
+	size_t count = modelX.size();
+	size_t paddedCount = (count + 7) & ~static_cast<size_t>(7);
+
+	//Padding spheres have radius 0 at the origin, their results are never read
+	worldX.assign(paddedCount, 0.0f);
+	worldY.assign(paddedCount, 0.0f);
+	worldZ.assign(paddedCount, 0.0f);
+	worldRadius.assign(paddedCount, 0.0f);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		//A model with no instances owns no matrix, its index can be past the end. Nothing draws it so it keeps the padding sphere
+		if (transformIndices[i] >= modelMatrices.size())
+		{
+			continue;
+		}
+
+		const glm::mat4& model = modelMatrices[transformIndices[i]];
+		glm::vec4 centre = model * glm::vec4(modelX[i], modelY[i], modelZ[i], 1.0f);
+
+		//Radius grows with the largest axis scale
+		float scale = std::max(glm::dot(glm::vec3(model[0]), glm::vec3(model[0])),
+			std::max(glm::dot(glm::vec3(model[1]), glm::vec3(model[1])), glm::dot(glm::vec3(model[2]), glm::vec3(model[2]))));
+
+		worldX[i] = centre.x;
+		worldY[i] = centre.y;
+		worldZ[i] = centre.z;
+		worldRadius[i] = modelRadius[i] * std::sqrt(scale);
+	}
+}
+
+uint32_t FrustumCuller::cull(const glm::mat4& viewProjection, std::vector<uint8_t>& visibility)
+{
+	size_t count = modelX.size();
+	size_t paddedCount = worldX.size();
+	visibility.resize(paddedCount);
+
+	//Planes from the rows of the view projection matrix, normalised so the distance compares with the radius.
+	//The near plane is the -w..w one, looser than the 0..w Vulkan one so it never culls anything visible
+	float planes[6][4];
+	for (int i = 0; i < 6; i++)
+	{
+		int row = i / 2;
+		float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+		glm::vec4 plane(viewProjection[0][3] + sign * viewProjection[0][row],
+			viewProjection[1][3] + sign * viewProjection[1][row],
+			viewProjection[2][3] + sign * viewProjection[2][row],
+			viewProjection[3][3] + sign * viewProjection[3][row]);
+		float length = std::sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+		planes[i][0] = plane.x / length;
+		planes[i][1] = plane.y / length;
+		planes[i][2] = plane.z / length;
+		planes[i][3] = plane.w / length;
+	}
+
+	size_t i = 0;
+#if defined(__AVX2__)
+	for (; i < paddedCount; i += 8)
+	{
+		__m256 x = _mm256_loadu_ps(&worldX[i]);
+		__m256 y = _mm256_loadu_ps(&worldY[i]);
+		__m256 z = _mm256_loadu_ps(&worldZ[i]);
+		__m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&worldRadius[i]));
+
+		__m256 outside = _mm256_setzero_ps();
+		for (int p = 0; p < 6; p++)
+		{
+			__m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(planes[p][0])), _mm256_mul_ps(y, _mm256_set1_ps(planes[p][1]))),
+				_mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(planes[p][2])), _mm256_set1_ps(planes[p][3])));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(distance, negativeRadius, _CMP_LT_OQ));
+		}
+
+		int outsideMask = _mm256_movemask_ps(outside);
+		for (int k = 0; k < 8; k++)
+		{
+			visibility[i + k] = static_cast<uint8_t>(((outsideMask >> k) & 1) ^ 1);
+		}
+	}
+#elif defined(FRUSTUM_CULLER_SSE)
+	for (; i < paddedCount; i += 4)
+	{
+		__m128 x = _mm_loadu_ps(&worldX[i]);
+		__m128 y = _mm_loadu_ps(&worldY[i]);
+		__m128 z = _mm_loadu_ps(&worldZ[i]);
+		__m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&worldRadius[i]));
+
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; p++)
+		{
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[p][0])), _mm_mul_ps(y, _mm_set1_ps(planes[p][1]))),
+				_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[p][2])), _mm_set1_ps(planes[p][3])));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negativeRadius));
+		}
+
+		int outsideMask = _mm_movemask_ps(outside);
+		for (int k = 0; k < 4; k++)
+		{
+			visibility[i + k] = static_cast<uint8_t>(((outsideMask >> k) & 1) ^ 1);
+		}
+	}
+#endif
+	//Scalar for targets without SSE
+	for (; i < paddedCount; i++)
+	{
+		bool outside = false;
+		for (int p = 0; p < 6; p++)
+		{
+			float distance = worldX[i] * planes[p][0] + worldY[i] * planes[p][1] + worldZ[i] * planes[p][2] + planes[p][3];
+			outside = outside || distance < -worldRadius[i];
+		}
+		visibility[i] = outside ? 0 : 1;
+	}
+
+	uint32_t visible = 0;
+	for (size_t j = 0; j < count; j++)
+	{
+		visible += visibility[j];
+	}
+	return visible;
+}
+
+FrustumCuller::~FrustumCuller()
+{
+}
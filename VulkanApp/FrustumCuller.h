@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include <glm/glm.hpp>
+
+//Bounding spheres kept as structure of arrays, tested against the view frustum 8 (AVX2) or 4 (SSE) at a time.
+//Spheres are added in model space with the index of the model matrix that moves them
+class FrustumCuller
+{
+public:
+	FrustumCuller();
+
+	void addSphere(const glm::vec4& sphere, uint32_t transformIndex);
+	void clear();
+	size_t getSphereCount();
+
+	//World space spheres from the model matrices, only needed when a matrix changed
+	void updateWorldSpheres(const std::vector<glm::mat4>& modelMatrices);
+
+	//visibility gets 1 for spheres touching the frustum of viewProjection and 0 for the rest, returns the visible count
+	uint32_t cull(const glm::mat4& viewProjection, std::vector<uint8_t>& visibility);
+
+	~FrustumCuller();
+
+private:
+	//Model space
+	std::vector<float> modelX;
+	std::vector<float> modelY;
+	std::vector<float> modelZ;
+	std::vector<float> modelRadius;
+	std::vector<uint32_t> transformIndices;
+
+	//World space, padded to a multiple of 8 so the SIMD loop never needs a tail
+	std::vector<float> worldX;
+	std::vector<float> worldY;
+	std::vector<float> worldZ;
+	std::vector<float> worldRadius;
+};
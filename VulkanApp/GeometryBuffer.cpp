@@ -0,0 +1,210 @@
+#include "GeometryBuffer.h"
+
+#include <stdexcept>
+#include <cstring>
+#include <iterator>
+
+RangeList::RangeList()
+{
+}
+
+void RangeList::reset(uint32_t capacity)
+{
+	used = 0;
+	freeRanges.clear();
+	if (capacity > 0)
+	{
+		freeRanges[0] = capacity;
+	}
+}
+
+bool RangeList::allocate(uint32_t count, uint32_t* first)
+{
+	//Nothing to place, any offset will do
+	if (count == 0)
+	{
+		*first = 0;
+		return true;
+	}
+
+	for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it)
+	{
+		if (it->second < count)
+		{
+			continue;
+		}
+
+		//Taken from the front, what is left stays free
+		*first = it->first;
+		uint32_t remainingFirst = it->first + count;
+		uint32_t remaining = it->second - count;
+		freeRanges.erase(it);
+		if (remaining > 0)
+		{
+			freeRanges[remainingFirst] = remaining;
+		}
+		used += count;
+		return true;
+	}
+	return false;
+}
+
+void RangeList::free(uint32_t first, uint32_t count)
+{
+	if (count == 0)
+	{
+		return;
+	}
+	used -= count;
+
+	//Merge with the free range after it, then with the one before it
+	auto next = freeRanges.lower_bound(first);
+	if (next != freeRanges.end() && first + count == next->first)
+	{
+		count += next->second;
+		next = freeRanges.erase(next);
+	}
+	if (next != freeRanges.begin())
+	{
+		auto previous = std::prev(next);
+		if (previous->first + previous->second == first)
+		{
+			previous->second += count;
+			return;
+		}
+	}
+	freeRanges[first] = count;
+}
+
+uint32_t RangeList::getUsed()
+{
+	return used;
+}
+
+RangeList::~RangeList()
+{
+}
+
+GeometryBuffer::GeometryBuffer()
+{
+}
+
+void GeometryBuffer::create(DeviceAllocator* newAllocator, uint32_t maxVertices, uint32_t maxIndices)
+{
+	allocator = newAllocator;
+
+	//Sized up front, meshes are copied in with transfers so neither is ever mapped
+	createBuffer(allocator, sizeof(Vertex) * static_cast<VkDeviceSize>(maxVertices),
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		&vertexBuffer, &vertexBufferMemory);
+	createBuffer(allocator, sizeof(uint32_t) * static_cast<VkDeviceSize>(maxIndices),
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		&indexBuffer, &indexBufferMemory);
+
+	vertexRanges.reset(maxVertices);
+	indexRanges.reset(maxIndices);
+}
+
+void GeometryBuffer::destroy()
+{
+	if (vertexBuffer == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	destroyBuffer(allocator, vertexBuffer, vertexBufferMemory);
+	destroyBuffer(allocator, indexBuffer, indexBufferMemory);
+	vertexBuffer = VK_NULL_HANDLE;
+	indexBuffer = VK_NULL_HANDLE;
+}
+
+void GeometryBuffer::upload(VkQueue transferQueue, const UploadPool& transferPool, const std::vector<Vertex>& vertices,
+	const std::vector<uint32_t>& indices, int32_t* vertexOffset, uint32_t* firstIndex)
+{
+	uint32_t vertexCount = static_cast<uint32_t>(vertices.size());
+	uint32_t indexCount = static_cast<uint32_t>(indices.size());
+
+	uint32_t firstVertex = 0;
+	if (!vertexRanges.allocate(vertexCount, &firstVertex))
+	{
+		throw std::runtime_error("Geometry buffer is full, it holds MAX_GEOMETRY_VERTICES vertices");
+	}
+	if (!indexRanges.allocate(indexCount, firstIndex))
+	{
+		vertexRanges.free(firstVertex, vertexCount);
+		throw std::runtime_error("Geometry buffer is full, it holds MAX_GEOMETRY_INDICES indices");
+	}
+	*vertexOffset = static_cast<int32_t>(firstVertex);
+
+	if (vertexCount == 0 && indexCount == 0)
+	{
+		return;
+	}
+
+	//Vertices then indices in one staging buffer, both copies go in one submit
+	VkDeviceSize vertexSize = sizeof(Vertex) * static_cast<VkDeviceSize>(vertexCount);
+	VkDeviceSize indexSize = sizeof(uint32_t) * static_cast<VkDeviceSize>(indexCount);
+
+	VkBuffer stagingBuffer;
+	DeviceAllocation stagingBufferMemory;
+	createBuffer(allocator, vertexSize + indexSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBuffer, &stagingBufferMemory);
+
+	char* staging = static_cast<char*>(stagingBufferMemory.mapped);
+	memcpy(staging, vertices.data(), (size_t)vertexSize);
+	memcpy(staging + vertexSize, indices.data(), (size_t)indexSize);
+
+	VkDevice device = allocator->getDevice();
+	VkCommandBuffer transferCommandBuffer = beginCommandBuffer(device, transferPool);
+
+	if (vertexSize > 0)
+	{
+		VkBufferCopy vertexRegion = {};
+		vertexRegion.srcOffset = 0;
+		vertexRegion.dstOffset = sizeof(Vertex) * static_cast<VkDeviceSize>(firstVertex);
+		vertexRegion.size = vertexSize;
+		vkCmdCopyBuffer(transferCommandBuffer, stagingBuffer, vertexBuffer, 1, &vertexRegion);
+	}
+	if (indexSize > 0)
+	{
+		VkBufferCopy indexRegion = {};
+		indexRegion.srcOffset = vertexSize;
+		indexRegion.dstOffset = sizeof(uint32_t) * static_cast<VkDeviceSize>(*firstIndex);
+		indexRegion.size = indexSize;
+		vkCmdCopyBuffer(transferCommandBuffer, stagingBuffer, indexBuffer, 1, &indexRegion);
+	}
+
+	endAndSubmitCommandBuffer(device, transferPool, transferQueue, transferCommandBuffer);
+
+	destroyBuffer(allocator, stagingBuffer, stagingBufferMemory);
+}
+
+void GeometryBuffer::free(int32_t vertexOffset, uint32_t vertexCount, uint32_t firstIndex, uint32_t indexCount)
+{
+	vertexRanges.free(static_cast<uint32_t>(vertexOffset), vertexCount);
+	indexRanges.free(firstIndex, indexCount);
+}
+
+VkBuffer GeometryBuffer::getVertexBuffer()
+{
+	return vertexBuffer;
+}
+
+VkBuffer GeometryBuffer::getIndexBuffer()
+{
+	return indexBuffer;
+}
+
+uint32_t GeometryBuffer::getVerticesUsed()
+{
+	return vertexRanges.getUsed();
+}
+
+uint32_t GeometryBuffer::getIndicesUsed()
+{
+	return indexRanges.getUsed();
+}
+
+GeometryBuffer::~GeometryBuffer()
+{
+}
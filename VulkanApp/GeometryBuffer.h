@@ -0,0 +1,67 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <vector>
+#include <map>
+#include <cstdint>
+
+#include "Utilities.h"
+
+//Free ranges of a fixed size array, in elements. Neighbouring free ranges are merged so unloading makes room for bigger meshes
+class RangeList
+{
+public:
+	RangeList();
+
+	void reset(uint32_t capacity);
+
+	//First free range that fits, false when none does
+	bool allocate(uint32_t count, uint32_t* first);
+	void free(uint32_t first, uint32_t count);
+
+	uint32_t getUsed();
+
+	~RangeList();
+
+private:
+	std::map<uint32_t, uint32_t> freeRanges;	//First element -> count, in order
+	uint32_t used = 0;
+};
+
+//One device local vertex buffer and one index buffer holding the geometry of every mesh.
+//Meshes only keep where they are in them, so a frame binds geometry once and draws with vertexOffset and firstIndex
+class GeometryBuffer
+{
+public:
+	GeometryBuffer();
+
+	void create(DeviceAllocator* newAllocator, uint32_t maxVertices, uint32_t maxIndices);
+	void destroy();
+
+	//Copies the mesh into free ranges of both buffers, throws when either is full
+	void upload(VkQueue transferQueue, const UploadPool& transferPool, const std::vector<Vertex>& vertices,
+		const std::vector<uint32_t>& indices, int32_t* vertexOffset, uint32_t* firstIndex);
+	//Only once the GPU is done with draws that use the ranges
+	void free(int32_t vertexOffset, uint32_t vertexCount, uint32_t firstIndex, uint32_t indexCount);
+
+	VkBuffer getVertexBuffer();
+	VkBuffer getIndexBuffer();
+
+	uint32_t getVerticesUsed();
+	uint32_t getIndicesUsed();
+
+	~GeometryBuffer();
+
+private:
+	DeviceAllocator* allocator = nullptr;
+
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
+	DeviceAllocation vertexBufferMemory;
+	RangeList vertexRanges;
+
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	DeviceAllocation indexBufferMemory;
+	RangeList indexRanges;
+};
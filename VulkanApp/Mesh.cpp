@@ -4,17 +4,36 @@ Mesh::Mesh()
 {
 }
 
-Mesh::Mesh(VkPhysicalDevice newPhysicalDevice, VkDevice newDevice, VkQueue transferQueue, VkCommandPool transferCommandPool, std::vector<Vertex>* vertices, std::vector<uint32_t>* indices, int textureID)
+Mesh::Mesh(GeometryBuffer* newGeometry, VkQueue transferQueue, const UploadPool& transferPool, std::vector<Vertex>* vertices, std::vector<uint32_t>* indices, int textureID, MaterialClass newMaterialClass)
 {
 	vertexCount = vertices->size();
 	indexCount = indices->size();
-	physicalDevice = newPhysicalDevice;
-	device = newDevice;
-	createVertexBuffer(transferQueue, transferCommandPool, vertices);
-	createIndexBuffer(transferQueue, transferCommandPool, indices);
+	geometry = newGeometry;
+	geometry->upload(transferQueue, transferPool, *vertices, *indices, &vertexOffset, &firstIndex);
 
 	model.model = glm::mat4(1.0f);
 	textID = textureID;
+	materialClass = newMaterialClass;
+
+	//Sphere around the AABB centre, not the tightest but cheap and good enough to cull with
+	glm::vec3 minPos(0.0f);
+	glm::vec3 maxPos(0.0f);
+	if (!vertices->empty())
+	{
+		minPos = maxPos = (*vertices)[0].pos;
+	}
+	for (const Vertex& vertex : *vertices)
+	{
+		minPos = glm::min(minPos, vertex.pos);
+		maxPos = glm::max(maxPos, vertex.pos);
+	}
+	glm::vec3 centre = (minPos + maxPos) * 0.5f;
+	float radius = 0.0f;
+	for (const Vertex& vertex : *vertices)
+	{
+		radius = glm::max(radius, glm::length(vertex.pos - centre));
+	}
+	boundingSphere = glm::vec4(centre, radius);
 }
 
 
@@ -35,87 +54,43 @@ int Mesh::getTextureID()
 	return textID;
 }
 
-int Mesh::getVertexCount()
+MaterialClass Mesh::getMaterialClass()
 {
-	return vertexCount;
+	return materialClass;
 }
 
-VkBuffer Mesh::getVertexBuffer()
+glm::vec4 Mesh::getBoundingSphere()
 {
-	return vertexBuffer;
+	return boundingSphere;
 }
 
-int Mesh::getIndexCount()
+int Mesh::getVertexCount()
 {
-	return indexCount;
+	return vertexCount;
 }
 
-VkBuffer Mesh::getIndexBuffer()
+int32_t Mesh::getVertexOffset()
 {
-	return indexBuffer;
+	return vertexOffset;
 }
 
-void Mesh::destroyBuffers()
+int Mesh::getIndexCount()
 {
-	vkDestroyBuffer(device, vertexBuffer, nullptr);
-	vkFreeMemory(device, vertexBufferMemory, nullptr);
-	vkDestroyBuffer(device, indexBuffer, nullptr);
-	vkFreeMemory(device, indexBufferMemory, nullptr);
+	return indexCount;
 }
 
-Mesh::~Mesh()
+uint32_t Mesh::getFirstIndex()
 {
+	return firstIndex;
 }
 
-void Mesh::createVertexBuffer(VkQueue transferQueue, VkCommandPool transferCommandPool, std::vector<Vertex>* vertices)
+void Mesh::freeGeometry()
 {
-	VkDeviceSize bufferSize = sizeof(Vertex) * vertices->size();
-
-	//Temp stage buffer
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-
-
-	createBuffer(physicalDevice, device, bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, 
-		&stagingBuffer, &stagingBufferMemory);
-
-	//Map memory to vertex buffer
-	void* data;
-	vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices->data(),(size_t)bufferSize);
-	vkUnmapMemory(device, stagingBufferMemory);
-
-	//The actual buffer that gpu is gonna use
-	createBuffer(physicalDevice, device, bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertexBuffer, &vertexBufferMemory);
-	
-	//Copy staging buffer to vertex buffer on GPU
-	copyBuffer(device, transferQueue, transferCommandPool, stagingBuffer, vertexBuffer, bufferSize);
-
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory, nullptr);
-
+	geometry->free(vertexOffset, vertexCount, firstIndex, indexCount);
+	vertexCount = 0;
+	indexCount = 0;
 }
 
-void Mesh::createIndexBuffer(VkQueue transferQueue, VkCommandPool transferCommandPool, std::vector<uint32_t>* indices)
+Mesh::~Mesh()
 {
-	VkDeviceSize bufferSize = sizeof(uint32_t) * indices->size();
-	
-	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-	createBuffer(physicalDevice, device, bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &stagingBuffer, &stagingBufferMemory);
-
-	void* data;
-	vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices->data(), (size_t)bufferSize);
-	vkUnmapMemory(device, stagingBufferMemory);
-
-	createBuffer(physicalDevice, device, bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &indexBuffer, &indexBufferMemory);
-	copyBuffer(device, transferQueue, transferCommandPool, stagingBuffer, indexBuffer, bufferSize);
-
-	vkDestroyBuffer(device, stagingBuffer, nullptr);
-	vkFreeMemory(device, stagingBufferMemory,nullptr);
 }
@@ -5,6 +5,7 @@
 
 #include <vector>
 #include "Utilities.h"
+#include "GeometryBuffer.h"
 
 struct Model {
 	glm::mat4 model;
@@ -15,21 +16,24 @@ class Mesh
 
 public:
 	Mesh();
-	Mesh(VkPhysicalDevice newPhysicalDevice, VkDevice newDevice,VkQueue transferQueue, VkCommandPool transferCommandPool
-		,std::vector<Vertex> *vertices , std::vector<uint32_t> *indices, int textureID);
+	Mesh(GeometryBuffer* newGeometry, VkQueue transferQueue, const UploadPool& transferPool
+		,std::vector<Vertex> *vertices , std::vector<uint32_t> *indices, int textureID, MaterialClass newMaterialClass);
 
 	void setModel(glm::mat4 newModel);
 	Model getModel();
 
 	int getTextureID();
+	MaterialClass getMaterialClass();
+	glm::vec4 getBoundingSphere();
 
 	int getVertexCount();
-	VkBuffer getVertexBuffer();
+	int32_t getVertexOffset();
 
 	int getIndexCount();
-	VkBuffer getIndexBuffer();
+	uint32_t getFirstIndex();
 
-	void destroyBuffers();
+	//Gives the mesh's ranges back to the geometry buffer, safe to call twice
+	void freeGeometry();
 
 
 	~Mesh();
@@ -39,21 +43,17 @@ private:
 	Model model;
 
 	int textID; // TODO: create a texture struct
+	MaterialClass materialClass;
+	glm::vec4 boundingSphere; //Centre (xyz) and radius (w) in model space
 
+	//Where the mesh is in the shared geometry buffer
 	int vertexCount;
-	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
+	int32_t vertexOffset;
 	
 	int indexCount;
-	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	uint32_t firstIndex;
 
-	VkPhysicalDevice physicalDevice;
-	VkDevice device;
-
-
-	void createVertexBuffer(VkQueue transferQueue, VkCommandPool transferCommandPool,std::vector<Vertex>* vertices);
-	void createIndexBuffer(VkQueue transferQueue, VkCommandPool transferCommandPool,std::vector<uint32_t>* indices);
+	GeometryBuffer* geometry;
 
 };
 
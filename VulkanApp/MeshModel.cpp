@@ -38,20 +38,38 @@ void MeshModel::destroyMesh()
 {
 	for (auto& mesh : meshList)
 	{
-		mesh.destroyBuffers();
+		mesh.freeGeometry();
 	}
 }
 
-std::vector<std::string> MeshModel::LoadMaterials(const aiScene* scene)
+std::vector<std::string> MeshModel::LoadMaterials(const aiScene* scene, std::vector<MaterialClass>* materialClasses)
 {
 	//Create 1:1 sized list of textures
 	std::vector < std::string> textureList(scene->mNumMaterials);
+	materialClasses->assign(scene->mNumMaterials, MaterialClass::Opaque);
 
 	for (size_t i = 0; i < scene->mNumMaterials; i++)
 	{
 		aiMaterial* material = scene->mMaterials[i];
 		textureList[i] = "";
 
+		//glTF says what it wants outright, otherwise an opacity below 1 blends and an opacity map only cuts out
+		aiString alphaMode;
+		float opacity = 1.0f;
+		if (material->Get("$mat.gltf.alphaMode", 0, 0, alphaMode) == AI_SUCCESS)
+		{
+			std::string mode = alphaMode.C_Str();
+			(*materialClasses)[i] = mode == "BLEND" ? MaterialClass::Blended : mode == "MASK" ? MaterialClass::AlphaTested : MaterialClass::Opaque;
+		}
+		else if (material->Get(AI_MATKEY_OPACITY, opacity) == AI_SUCCESS && opacity < 1.0f)
+		{
+			(*materialClasses)[i] = MaterialClass::Blended;
+		}
+		else if (material->GetTextureCount(aiTextureType_OPACITY) > 0)
+		{
+			(*materialClasses)[i] = MaterialClass::AlphaTested;
+		}
+
 		if (material->GetTextureCount(aiTextureType_DIFFUSE))
 		{
 
@@ -70,25 +88,25 @@ std::vector<std::string> MeshModel::LoadMaterials(const aiScene* scene)
 	return textureList;
 }
 
-std::vector<Mesh> MeshModel::LoadNode(VkPhysicalDevice newPhysicalDevice, VkDevice newDevice, VkQueue transferQueue, VkCommandPool transferCommandPool, aiNode* node, const aiScene* scene, std::vector<int> matToText)
+std::vector<Mesh> MeshModel::LoadNode(GeometryBuffer* geometry, VkQueue transferQueue, const UploadPool& transferPool, aiNode* node, const aiScene* scene, std::vector<int> matToText, const std::vector<MaterialClass>& materialClasses)
 {
 	std::vector<Mesh> meshList;
 
 	for (size_t i = 0; i < node->mNumMeshes; i++)
 	{
-		meshList.push_back(LoadMesh(newPhysicalDevice, newDevice, transferQueue, transferCommandPool, scene->mMeshes[node->mMeshes[i]], scene, matToText));
+		meshList.push_back(LoadMesh(geometry, transferQueue, transferPool, scene->mMeshes[node->mMeshes[i]], scene, matToText, materialClasses));
 	}
 	//Go through each node attached to this node and load it then append their meshes to this node's mesh list
 	for (size_t i = 0; i < node->mNumChildren; i++)
 	{
-		std::vector<Mesh> newList = LoadNode(newPhysicalDevice, newDevice, transferQueue, transferCommandPool, node->mChildren[i], scene, matToText);
+		std::vector<Mesh> newList = LoadNode(geometry, transferQueue, transferPool, node->mChildren[i], scene, matToText, materialClasses);
 		meshList.insert(meshList.end(), newList.begin(), newList.end());
 	}
 
 	return meshList;
 }
 
-Mesh MeshModel::LoadMesh(VkPhysicalDevice newPhysicalDevice, VkDevice newDevice, VkQueue transferQueue, VkCommandPool transferCommandPool, aiMesh* mesh, const aiScene* scene, std::vector<int> matToText)
+Mesh MeshModel::LoadMesh(GeometryBuffer* geometry, VkQueue transferQueue, const UploadPool& transferPool, aiMesh* mesh, const aiScene* scene, std::vector<int> matToText, const std::vector<MaterialClass>& materialClasses)
 {
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
@@ -122,7 +140,8 @@ Mesh MeshModel::LoadMesh(VkPhysicalDevice newPhysicalDevice, VkDevice newDevice,
 			indices.push_back(face.mIndices[j]);
 		}
 	}
-	Mesh newMesh = Mesh(newPhysicalDevice, newDevice, transferQueue, transferCommandPool, &vertices, &indices, matToText[mesh->mMaterialIndex]);
+	Mesh newMesh = Mesh(geometry, transferQueue, transferPool, &vertices, &indices, matToText[mesh->mMaterialIndex],
+		materialClasses[mesh->mMaterialIndex]);
 
 	return newMesh;
 }
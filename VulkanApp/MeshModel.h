@@ -22,11 +22,12 @@ public:
 
 	void destroyMesh();
 
-	static std::vector<std::string> LoadMaterials(const aiScene * scene);
-	static std::vector<Mesh> LoadNode(VkPhysicalDevice newPhysicalDevice, VkDevice newDevice, VkQueue transferQueue, VkCommandPool transferCommandPool,
-		aiNode* node, const aiScene* scene, std::vector<int> matToText);
-	static Mesh LoadMesh(VkPhysicalDevice newPhysicalDevice, VkDevice newDevice, VkQueue transferQueue, VkCommandPool transferCommandPool,
-		aiMesh* mesh, const aiScene* scene, std::vector<int> matToText);
+	//Texture file of every material, and how each one uses alpha in materialClasses
+	static std::vector<std::string> LoadMaterials(const aiScene * scene, std::vector<MaterialClass>* materialClasses);
+	static std::vector<Mesh> LoadNode(GeometryBuffer* geometry, VkQueue transferQueue, const UploadPool& transferPool,
+		aiNode* node, const aiScene* scene, std::vector<int> matToText, const std::vector<MaterialClass>& materialClasses);
+	static Mesh LoadMesh(GeometryBuffer* geometry, VkQueue transferQueue, const UploadPool& transferPool,
+		aiMesh* mesh, const aiScene* scene, std::vector<int> matToText, const std::vector<MaterialClass>& materialClasses);
 	
 
 	~MeshModel();
@@ -1,3 +1,6 @@
 C:\VulkanSDK\1.3.250.1\Bin\glslangValidator.exe -V shader.vert
 C:\VulkanSDK\1.3.250.1\Bin\glslangValidator.exe -V shader.frag
+C:\VulkanSDK\1.3.250.1\Bin\glslangValidator.exe -V cull.comp -o cull.spv
+C:\VulkanSDK\1.3.250.1\Bin\glslangValidator.exe -V hiz.comp -o hiz.spv
+C:\VulkanSDK\1.3.250.1\Bin\glslangValidator.exe -V depth.vert -o depth.spv
 pause
\ No newline at end of file
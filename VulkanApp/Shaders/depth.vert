@@ -0,0 +1,21 @@
+#version 450
+
+//Depth pre-pass, position only and no fragment shader. gl_Position has to come out bit for bit the same
+//as in shader.vert, the main pass tests with VK_COMPARE_OP_EQUAL against it
+layout (location = 0) in vec3 pos;
+
+layout (set = 0, binding = 0) uniform UBOViewProjeciton{
+    mat4 projection;
+    mat4 view;
+}uboViewProjection ;
+
+layout (set = 0, binding = 1) readonly buffer ModelMatrices{
+    mat4 models[];
+}modelMatrices ;
+
+invariant gl_Position;
+
+void main()
+{
+    gl_Position = uboViewProjection.projection * uboViewProjection.view * modelMatrices.models[gl_InstanceIndex] * vec4 (pos,1.0);
+}
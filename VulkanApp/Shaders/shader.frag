@@ -5,9 +5,17 @@ layout (location = 1) in vec2 fragTex;
 
 layout (set = 1, binding = 0) uniform sampler2D textureSampler;
 
+//On for the alpha tested pipeline, texels under the cutoff leave neither colour nor depth
+layout (constant_id = 0) const bool alphaTest = false;
+const float ALPHA_CUTOFF = 0.5;
+
 layout (location = 0) out vec4 outColor;
 
 void main()
 {
     outColor = texture(textureSampler,fragTex); 
-}
\ No newline at end of file
+    if (alphaTest && outColor.a < ALPHA_CUTOFF)
+    {
+        discard;
+    }
+}
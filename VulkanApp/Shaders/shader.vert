@@ -9,20 +9,21 @@ layout (set = 0, binding = 0) uniform UBOViewProjeciton{
     mat4 view;
 }uboViewProjection ;
 
-//Not in use left for reference
-layout (set = 0, binding = 1) uniform UBOModel{
-    mat4 model;
-}uboModel ;
-
-layout (push_constant) uniform PushModel{
-    mat4 model;
-}pushModel;
+//Every model's matrices, one per instance, written by the CPU when one changes so recorded draws stay the same.
+//Indirect draws put the model's first matrix in firstInstance, so gl_InstanceIndex picks the instance's matrix
+layout (set = 0, binding = 1) readonly buffer ModelMatrices{
+    mat4 models[];
+}modelMatrices ;
 
 layout (location = 0) out vec3 fragCol;
 layout (location = 1) out vec2 fragTex;
+
+//Same position as depth.vert, for the EQUAL depth test after the pre-pass
+invariant gl_Position;
+
 void main()
 {
-    gl_Position = uboViewProjection.projection * uboViewProjection.view * pushModel.model * vec4 (pos,1.0);
+    gl_Position = uboViewProjection.projection * uboViewProjection.view * modelMatrices.models[gl_InstanceIndex] * vec4 (pos,1.0);
 
     fragCol = col;
     fragTex = tex;
@@ -0,0 +1,81 @@
+#include "UniformRing.h"
+
+#include <stdexcept>
+
+UniformRing::UniformRing()
+{
+}
+
+void UniformRing::create(DeviceAllocator* allocator, VkDeviceSize segmentSize, uint32_t segmentCount, VkDeviceSize minAlignment)
+{
+	this->allocator = allocator;
+	alignment = minAlignment > 0 ? minAlignment : 1;
+
+	//Segments start aligned too, so offsets only depend on what was allocated before them in the frame
+	this->segmentSize = (segmentSize + alignment - 1) / alignment * alignment;
+	segmentFrames.assign(segmentCount, 0);
+
+	//Host visible, so the allocator keeps it mapped
+	createBuffer(allocator, this->segmentSize * segmentCount, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &buffer, &bufferMemory);
+	mapped = static_cast<char*>(bufferMemory.mapped);
+}
+
+void UniformRing::destroy()
+{
+	if (buffer == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	destroyBuffer(allocator, buffer, bufferMemory);
+	buffer = VK_NULL_HANDLE;
+	mapped = nullptr;
+}
+
+void UniformRing::beginFrame(uint32_t segment, uint64_t frame, uint64_t completedFrame)
+{
+	//The GPU may still read the segment until the frame that wrote it is done
+	if (segmentFrames[segment] > completedFrame)
+	{
+		throw std::runtime_error("Uniform ring segment reused before its frame completed");
+	}
+
+	segmentFrames[segment] = frame;
+	segmentStart = segment * segmentSize;
+	head = 0;
+}
+
+UniformAllocation UniformRing::allocate(VkDeviceSize size)
+{
+	VkDeviceSize offset = (head + alignment - 1) / alignment * alignment;
+	if (offset + size > segmentSize)
+	{
+		throw std::runtime_error("Uniform ring segment is full");
+	}
+	head = offset + size;
+
+	UniformAllocation allocation;
+	allocation.offset = static_cast<uint32_t>(segmentStart + offset);
+	allocation.data = mapped + segmentStart + offset;
+	return allocation;
+}
+
+VkBuffer UniformRing::getBuffer()
+{
+	return buffer;
+}
+
+VkDeviceSize UniformRing::getSegmentSize()
+{
+	return segmentSize;
+}
+
+VkDeviceSize UniformRing::getBytesUsed()
+{
+	return head;
+}
+
+UniformRing::~UniformRing()
+{
+}
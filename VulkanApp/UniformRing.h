@@ -0,0 +1,50 @@
+#pragma once
+
+#define GLFW_INCLUDE_VULKAN
+#include <GLFW/glfw3.h>
+
+#include <vector>
+
+#include "Utilities.h"
+
+//A sub-range of the ring, offset is what goes in the dynamic offset of a VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC bind
+struct UniformAllocation
+{
+	uint32_t offset = 0;
+	void* data = nullptr;			//Mapped, write only
+};
+
+//One persistently mapped uniform buffer split into a segment per frame slot, used in turn as frames go round.
+//Each frame allocates from the start of its segment, so the first allocation of a slot always has the same offset,
+//and a segment is only reset once the timeline says the frame that last used it has completed
+class UniformRing
+{
+public:
+	UniformRing();
+
+	void create(DeviceAllocator* allocator, VkDeviceSize segmentSize, uint32_t segmentCount, VkDeviceSize minAlignment);
+	void destroy();
+
+	//frame is the timeline value the frame will signal, completedFrame what the timeline has reached
+	void beginFrame(uint32_t segment, uint64_t frame, uint64_t completedFrame);
+	UniformAllocation allocate(VkDeviceSize size);
+
+	VkBuffer getBuffer();
+	VkDeviceSize getSegmentSize();
+	VkDeviceSize getBytesUsed();	//Allocated in the current frame, alignment padding included
+
+	~UniformRing();
+
+private:
+	DeviceAllocator* allocator = nullptr;
+	VkBuffer buffer = VK_NULL_HANDLE;
+	DeviceAllocation bufferMemory;
+	char* mapped = nullptr;
+
+	VkDeviceSize segmentSize = 0;
+	VkDeviceSize alignment = 1;
+	std::vector<uint64_t> segmentFrames;	//Frame that last allocated from each segment, 0 if none
+
+	VkDeviceSize segmentStart = 0;
+	VkDeviceSize head = 0;					//Next free byte, relative to segmentStart
+};
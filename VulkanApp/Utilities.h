@@ -6,8 +6,39 @@
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 
-const int MAX_FRAME_DRAWS = 2;
-const int MAX_OBJECTS = 20;
+#include "DeviceAllocator.h"
+
+const int MAX_FRAME_DRAWS = 4; //Upper bound of frames in flight, per frame resources are created for all of them
+const int DEFAULT_FRAME_DRAWS = 2;
+const int MAX_TEXTURES = 256;
+const int MAX_TRANSFORMS = 65536; //Size of the model matrix buffer of each frame slot, model matrices and instances together
+const int OFFSCREEN_IMAGE_COUNT = MAX_FRAME_DRAWS; //Images in the headless render ring, one per frame slot
+const uint32_t MAX_GEOMETRY_VERTICES = 4 * 1024 * 1024; //Vertices of every mesh together, one vertex buffer holds them all
+const uint32_t MAX_GEOMETRY_INDICES = 16 * 1024 * 1024; //Same for indices
+const int MAX_INDIRECT_DRAWS = 65535; //Draw packets per frame slot, also the smallest maxDrawIndirectCount multi draw guarantees
+const int MAX_RECORD_THREADS = 8; //Threads recording scene commands, each has its own command pool per frame slot
+const int MIN_MODELS_PER_RECORD_THREAD = 64; //Smaller chunks cost more in hand off than they save
+const VkDeviceSize UNIFORM_RING_SEGMENT_SIZE = 4 * 1024 * 1024; //Per frame uniform data of one frame slot
+const int MAX_TIMED_MODELS = 1024; //Models past this one still draw but get no GPU timings or pipeline statistics
+const uint32_t MAX_HIZ_LEVELS = 16; //Depth pyramid levels, enough for a 32768 wide render
+
+//Timestamp queries of one frame slot, model j uses TIMESTAMP_FIRST_MODEL + 2j and the one after it
+const uint32_t TIMESTAMP_FRAME_BEGIN = 0;
+const uint32_t TIMESTAMP_FRAME_END = 1;
+const uint32_t TIMESTAMP_MAIN_PASS_BEGIN = 2;
+const uint32_t TIMESTAMP_MAIN_PASS_END = 3;
+const uint32_t TIMESTAMP_FIRST_MODEL = 4;
+const uint32_t TIMESTAMPS_PER_FRAME = TIMESTAMP_FIRST_MODEL + 2 * MAX_TIMED_MODELS;
+
+//Cull dispatches of a frame. The late one only runs with occlusion culling, after the depth pyramid is built
+const uint32_t CULL_PHASE_EARLY = 0;
+const uint32_t CULL_PHASE_LATE = 1;
+
+//Counters after the batch counts in the draw count buffer, read back for the stats
+const uint32_t CULL_STAT_EARLY_VISIBLE = 0;	//Drawn by the main pass
+const uint32_t CULL_STAT_LATE_VISIBLE = 1;	//Drawn by the late pass
+const uint32_t CULL_STAT_OCCLUDED = 2;		//Left out by the early cull for being behind the previous frame's depth
+const uint32_t CULL_STAT_COUNT = 3;
 
 const std::vector<const char*> deviceExtensions =
 {
@@ -21,6 +52,113 @@ struct Vertex
 	glm::vec2 tex; //Texture Coord(u,v);
 };
 
+//How frames are handed to the display
+enum class PresentPolicy
+{
+	LowLatency,		//MAILBOX (IMMEDIATE if missing) with 2 images, newest frame is shown as soon as possible
+	Throughput,		//FIFO with 3 images, vsynced and keeps the GPU busy
+	FifoRelaxed		//FIFO_RELAXED, vsynced but a late frame is shown right away instead of waiting a refresh
+};
+
+//How a material's alpha is used, each class has its own pipeline. Also the pipeline bits of the sort key,
+//so sorted draws go opaque, then alpha tested, then blended
+enum class MaterialClass : uint8_t
+{
+	Opaque = 0,			//Blending off, drawn in the depth pre-pass
+	AlphaTested = 1,	//Texels under the alpha cutoff are discarded, blending off
+	Blended = 2			//Blended over what is behind, no depth writes, drawn last back to front
+};
+
+//Geometry handed to the renderer directly instead of being loaded from a model file
+struct MeshData
+{
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	int textureID;
+	MaterialClass materialClass = MaterialClass::Opaque;
+};
+
+//Everything recording needs for one mesh draw, kept in one flat array so recording is a linear scan
+struct DrawPacket
+{
+	int32_t vertexOffset;				//First vertex in the geometry buffer, every packet draws from the same buffers
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	VkDescriptorSet textureSet;
+	uint32_t transformIndex;			//First of the model's matrices in the model matrix buffer
+	uint32_t instanceCount;				//Matrices the model has, 1 unless it was given instances
+	uint64_t sortKey;					//DrawQueue::makeSortKey of the packet's state
+	MaterialClass materialClass;
+	glm::vec4 boundingSphere;			//Model space, for culling
+};
+
+//Draw packet as the culling compute shader reads it, std430 layout of CullRecord in cull.comp
+struct CullRecord
+{
+	glm::vec4 sphere;
+	uint32_t indexCount;
+	uint32_t firstIndex;
+	int32_t vertexOffset;
+	uint32_t transformIndex;
+	uint32_t batchStart;
+	uint32_t instanceCount;
+	uint32_t padding[2];
+};
+
+//Push constants of cull.comp, std430 layout of PushCull
+struct CullPushConstants
+{
+	uint32_t recordCount;
+	uint32_t statsIndex;				//Where the CULL_STAT counters start
+	uint32_t phase;						//CULL_PHASE_EARLY or CULL_PHASE_LATE
+	uint32_t occlusion;					//Early phase also tests against the depth pyramid
+	glm::mat4 occlusionViewProjection;	//What the depth pyramid was drawn with
+};
+
+//Pipeline statistics of one model's draws
+struct ModelPipelineStats
+{
+	uint64_t vertexInvocations = 0;		//Vertex shader invocations
+	uint64_t clippingPrimitives = 0;	//Primitives that came out of clipping
+	uint64_t fragmentInvocations = 0;	//Fragment shader invocations
+};
+
+//Numbers collected while rendering a frame
+struct FrameStats
+{
+	uint32_t drawCalls = 0;				//vkCmdDraw* calls recorded for the frame
+	uint32_t indirectCommands = 0;		//Mesh draws those calls carry through the indirect buffer
+	uint32_t gpuVisibleDraws = 0;		//Mesh draws that passed GPU culling, read back with the GPU times below
+	uint32_t gpuCulledDraws = 0;
+	uint32_t gpuOccludedDraws = 0;		//Part of gpuCulledDraws, in the frustum but behind the depth pyramid
+	uint32_t gpuLateDraws = 0;			//Part of gpuVisibleDraws, occluded in the previous frame's depth but not in this one's
+	uint32_t cpuVisibleDraws = 0;		//Mesh draws that passed CPU culling this frame, everything when it is off
+	uint32_t cpuCulledDraws = 0;		//Meshes with no instances are in neither count
+	uint32_t blendedDraws = 0;			//Blended mesh draws, sorted back to front and recorded every frame
+	uint32_t bindsIssued = 0;			//Pipeline, vertex/index buffer and descriptor set binds in the frame's scene commands
+	uint32_t bindsSkipped = 0;			//Binds left out because the same state was already bound, issued + skipped is this recording without the tracker
+	uint32_t bindsUnsorted = 0;			//Binds recording in model order without the tracker would make, the count before sorting and tracking
+	bool sceneCommandsReused = false;	//Scene draws came from the slot's cached command buffers
+	uint32_t sceneRecordChunks = 0;		//Secondary command buffers the scene was split into, recorded in parallel
+	VkDeviceSize bytesUploaded = 0;		//Host to device bytes written for the frame (uniforms, changed model matrices, indirect commands when re-recorded)
+	VkDeviceSize totalBytesUploaded = 0; //Everything uploaded since init, including meshes and textures
+
+	//GPU times are read back when a frame slot comes around again, so they belong to an older frame, -1 if unknown
+	uint64_t gpuStatsFrame = 0;			//Frame number the GPU times below were measured on
+	double gpuFrameMs = -1.0;			//Whole command buffer
+	double gpuMainPassMs = -1.0;		//Main render pass
+	std::vector<double> gpuModelMs;		//Draws of each model, indexed by model ID
+	std::vector<ModelPipelineStats> modelPipelineStats; //Indexed by model ID, empty unless pipeline statistics are enabled
+
+	//CPU side of the last draw() call
+	double cpuWaitMs = 0.0;				//Waiting for the frame slot to be free
+	double cpuRecordMs = 0.0;			//Recording commands and writing uniforms
+	double cpuCullMs = 0.0;				//Frustum culling, part of cpuRecordMs
+	VkDeviceSize uniformBytesUsed = 0;	//Taken from the frame's uniform ring segment, alignment padding included
+	double cpuSubmitMs = 0.0;			//vkQueueSubmit
+	double cpuPresentMs = 0.0;			//vkQueuePresentKHR, 0 when headless
+};
+
 //Locations (Indices) of Queue Families (if they exists at all)
 struct QueueFamilyIndices {
 	int graphicsFamily = -1;
@@ -64,29 +202,8 @@ static std::vector<char> readFile(const std::string& fileName)
 	return fileBuffer;
 }
 
-static uint32_t findMemoryTypeIndex(VkPhysicalDevice physicalDevice, uint32_t allowedTypes, VkMemoryPropertyFlags properties)
-{
-	//Get properties of physical device memory
-	VkPhysicalDeviceMemoryProperties memoryProperties;
-	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
-
-	for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
-	{
-		if ((allowedTypes & (1 << i))//index of memory type must mach corrosponding bit in allowedTypes
-			&& (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) //Desired propperty bit flags are part of memory's type flags
-		{
-			//The memory is valid;
-			return i;
-		}
-	}
-
-	return 0;
-}
-
-
-static void createBuffer(VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize bufferSize, 
-						 VkBufferUsageFlags bufferUsageFlags, VkMemoryPropertyFlags bufferProperties, VkBuffer* buffer,
-						 VkDeviceMemory* bufferMemory)
+static void createBuffer(DeviceAllocator* allocator, VkDeviceSize bufferSize, VkBufferUsageFlags bufferUsageFlags,
+						 VkMemoryPropertyFlags bufferProperties, VkBuffer* buffer, DeviceAllocation* bufferAllocation)
 {
 	//Create Vertex Buffer
 	VkBufferCreateInfo bufferInfo = {};
@@ -95,51 +212,92 @@ static void createBuffer(VkPhysicalDevice physicalDevice, VkDevice device, VkDev
 	bufferInfo.usage = bufferUsageFlags;
 	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-	VkResult result = vkCreateBuffer(device, &bufferInfo, nullptr, buffer);
+	VkResult result = vkCreateBuffer(allocator->getDevice(), &bufferInfo, nullptr, buffer);
 	if (result != VK_SUCCESS)
 	{
 		throw std::runtime_error("Failed to create a vertex buffer");
 	}
 
-	//Get buffer memory Req
-	VkMemoryRequirements memoryRequirements;
-	vkGetBufferMemoryRequirements(device, *buffer, &memoryRequirements);
-
-	//Allocate memory to buffer
-	VkMemoryAllocateInfo memoryAllocateInfo = {};
-	memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	memoryAllocateInfo.allocationSize = memoryRequirements.size;
-	memoryAllocateInfo.memoryTypeIndex = findMemoryTypeIndex(physicalDevice, memoryRequirements.memoryTypeBits,
-		bufferProperties);
-	//Allocate memory to VkDevice memory
-	result = vkAllocateMemory(device, &memoryAllocateInfo, nullptr, bufferMemory);
-	if (result != VK_SUCCESS)
-	{
-		throw std::runtime_error("Failed to allocate vertex buffer memory");
-	}
-
-	vkBindBufferMemory(device, *buffer, *bufferMemory, 0);
+	//Placed in one of the allocator's blocks and bound, host visible memory comes back mapped
+	allocator->allocateBuffer(*buffer, bufferProperties, bufferAllocation);
+}
 
+static void destroyBuffer(DeviceAllocator* allocator, VkBuffer buffer, DeviceAllocation& bufferAllocation)
+{
+	vkDestroyBuffer(allocator->getDevice(), buffer, nullptr);
+	allocator->free(bufferAllocation);
 }
 
 
-static VkCommandBuffer beginCommandBuffer(VkDevice device, VkCommandPool commandPool)
+//One off commands for uploads and layout changes. The command buffer is allocated once and the pool is reset
+//after every submit, so its memory gets reused instead of a buffer being allocated and freed per upload.
+//Each submit signals the pool's own timeline one up, an upload waits for itself instead of every frame in flight
+struct UploadPool
 {
-	//If many object are needed to be loaded at the same time have more than one transfer 
-//command buffer and try to do synchronization between them
+	VkCommandPool commandPool = VK_NULL_HANDLE;
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+	VkSemaphore timeline = VK_NULL_HANDLE;
+};
 
-//Command buffer to hold and transfer commands
-	VkCommandBuffer commandBuffer;
+static UploadPool createUploadPool(VkDevice device, uint32_t queueFamilyIndex)
+{
+	UploadPool uploadPool;
+
+	//Transient, nothing recorded in it lives past one submit
+	VkCommandPoolCreateInfo poolInfo = {};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = queueFamilyIndex;
+
+	VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &uploadPool.commandPool);
+	if (result != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to create upload command pool");
+	}
 
 	VkCommandBufferAllocateInfo allocateInfo = {};
 	allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 	allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocateInfo.commandPool = commandPool;
+	allocateInfo.commandPool = uploadPool.commandPool;
 	allocateInfo.commandBufferCount = 1;
 
-	//Allocate command buffer from pool
-	vkAllocateCommandBuffers(device, &allocateInfo, &commandBuffer);
+	result = vkAllocateCommandBuffers(device, &allocateInfo, &uploadPool.commandBuffer);
+	if (result != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to allocate upload command buffer");
+	}
+
+	VkSemaphoreTypeCreateInfo timelineCreateInfo = {};
+	timelineCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+	timelineCreateInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	timelineCreateInfo.initialValue = 0;
+
+	VkSemaphoreCreateInfo semaphoreCreateInfo = {};
+	semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreCreateInfo.pNext = &timelineCreateInfo;
+
+	result = vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &uploadPool.timeline);
+	if (result != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to create upload timeline semaphore");
+	}
+
+	return uploadPool;
+}
 
+static void destroyUploadPool(VkDevice device, UploadPool& uploadPool)
+{
+	//Frees its command buffer as well
+	vkDestroyCommandPool(device, uploadPool.commandPool, nullptr);
+	vkDestroySemaphore(device, uploadPool.timeline, nullptr);
+	uploadPool = UploadPool();
+}
+
+static VkCommandBuffer beginCommandBuffer(VkDevice device, const UploadPool& uploadPool)
+{
+	//Uploads wait for their submit before returning, so the pool's one buffer is never recorded twice at once.
+	//Only ever used from the thread that owns the pool
+	VkCommandBuffer commandBuffer = uploadPool.commandBuffer;
 
 	VkCommandBufferBeginInfo beginInfo = {};
 	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -152,26 +310,60 @@ static VkCommandBuffer beginCommandBuffer(VkDevice device, VkCommandPool command
 
 }
 
-static void endAndSubmitCommandBuffer(VkDevice device, VkCommandPool commandPool, VkQueue queue, VkCommandBuffer commandBuffer)
+static void endAndSubmitCommandBuffer(VkDevice device, const UploadPool& uploadPool, VkQueue queue, VkCommandBuffer commandBuffer)
 {
 	vkEndCommandBuffer(commandBuffer);
 
+	//Every earlier submit was waited for, so the counter is at the last value signalled
+	uint64_t uploadValue = 0;
+	VkResult result = vkGetSemaphoreCounterValue(device, uploadPool.timeline, &uploadValue);
+	if (result != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to read upload timeline");
+	}
+	uploadValue++;
+
+	VkTimelineSemaphoreSubmitInfo timelineSubmitInfo = {};
+	timelineSubmitInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineSubmitInfo.signalSemaphoreValueCount = 1;
+	timelineSubmitInfo.pSignalSemaphoreValues = &uploadValue;
+
 	//Queue submission information
 	VkSubmitInfo submitInfo = {};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = &timelineSubmitInfo;
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &commandBuffer;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &uploadPool.timeline;
+
+	result = vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
+	if (result != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to submit upload Command Buffer");
+	}
 
-	vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-	vkQueueWaitIdle(queue);
+	//Only this upload, frames in flight on the same queue keep running
+	VkSemaphoreWaitInfo waitInfo = {};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &uploadPool.timeline;
+	waitInfo.pValues = &uploadValue;
+
+	result = vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+	if (result != VK_SUCCESS)
+	{
+		throw std::runtime_error("Failed to wait for upload timeline");
+	}
 
-	vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+	//Back to the initial state for the next upload, the pool keeps its memory
+	vkResetCommandPool(device, uploadPool.commandPool, 0);
 }
 
-static void copyBuffer(VkDevice device, VkQueue transferQueue, VkCommandPool transferCommandPool , 
+static void copyBuffer(VkDevice device, VkQueue transferQueue, const UploadPool& transferPool , 
 		VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize bufferSize)
 {
-	VkCommandBuffer transferCommandBuffer = beginCommandBuffer(device, transferCommandPool);
+	VkCommandBuffer transferCommandBuffer = beginCommandBuffer(device, transferPool);
 
 	//Region of data from copy from and to
 	VkBufferCopy bufferCopyRegion = {};
@@ -181,13 +373,13 @@ static void copyBuffer(VkDevice device, VkQueue transferQueue, VkCommandPool tra
 
 	vkCmdCopyBuffer(transferCommandBuffer, srcBuffer, dstBuffer, 1, &bufferCopyRegion);
 
-	endAndSubmitCommandBuffer(device, transferCommandPool, transferQueue, transferCommandBuffer);
+	endAndSubmitCommandBuffer(device, transferPool, transferQueue, transferCommandBuffer);
 }
 
-static void copyImageBuffer(VkDevice device, VkQueue transferQueue, VkCommandPool transferCommandPool,
+static void copyImageBuffer(VkDevice device, VkQueue transferQueue, const UploadPool& transferPool,
 	VkBuffer srcBuffer, VkImage image, uint32_t width, uint32_t height)
 {
-	VkCommandBuffer transferCommandBuffer = beginCommandBuffer(device, transferCommandPool);
+	VkCommandBuffer transferCommandBuffer = beginCommandBuffer(device, transferPool);
 
 	VkBufferImageCopy bufferImageRegion = {};
 	bufferImageRegion.bufferOffset = 0;												//start
@@ -203,13 +395,13 @@ static void copyImageBuffer(VkDevice device, VkQueue transferQueue, VkCommandPoo
 	vkCmdCopyBufferToImage(transferCommandBuffer, srcBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 							1, &bufferImageRegion);
 
-	endAndSubmitCommandBuffer(device, transferCommandPool, transferQueue, transferCommandBuffer);
+	endAndSubmitCommandBuffer(device, transferPool, transferQueue, transferCommandBuffer);
 }
 
 
-static void transitionImageLayout(VkDevice device, VkQueue queue, VkCommandPool commandPool, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout)
+static void transitionImageLayout(VkDevice device, VkQueue queue, const UploadPool& uploadPool, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout)
 {
-	VkCommandBuffer commandBuffer = beginCommandBuffer(device, commandPool);
+	VkCommandBuffer commandBuffer = beginCommandBuffer(device, uploadPool);
 
 	VkImageMemoryBarrier imageMemoryBarrier = {};
 	imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -254,5 +446,5 @@ static void transitionImageLayout(VkDevice device, VkQueue queue, VkCommandPool
 		1, &imageMemoryBarrier);				//Image memory barrier count + data
 
 	
-	endAndSubmitCommandBuffer(device, commandPool, queue, commandBuffer);
+	endAndSubmitCommandBuffer(device, uploadPool, queue, commandBuffer);
 }
\ No newline at end of file
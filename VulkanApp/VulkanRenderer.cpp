@@ -9,40 +9,56 @@ VulkanRenderer::VulkanRenderer()
 {
 
 }
-int VulkanRenderer::init(GLFWwindow* newWindow)
+int VulkanRenderer::init(GLFWwindow* newWindow, PresentPolicy policy)
 {
     window = newWindow;
-    createInstance();
+    presentPolicy = policy;
     try
     {
         createInstance();
         setupDebugMessenger();
-        createSurface();
+        if (!headless)
+        {
+            createSurface();
+            glfwSetWindowUserPointer(window, this);
+            glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+        }
         getPysicalDevice();
         createLogicalDevice();
-        createSwapChain();
+        deviceAllocator.init(mainDevice.physicalDevice, mainDevice.logicalDevice);
+        geometryBuffer.create(&deviceAllocator, MAX_GEOMETRY_VERTICES, MAX_GEOMETRY_INDICES);
+        if (headless)
+        {
+            createOffscreenImages();
+        }
+        else
+        {
+            createSwapChain();
+        }
         createDepthBufferImage();
         createRenderPass();
         createDescriptorSetLayout();
-        createPushConstantRange();
         createGraphicsPipeline();
         createFrameBuffers();
         createCommandPool();
 
         createCommandBuffers();
         createTextureSampler();
-        //allocateDynamicBufferTransferSpace();
         createUniformBuffers();
+        createIndirectBuffers();
+        createCullResources();
         createDescriptorPool();
         createDescriptorSets();
         createSynchronisation();
+        createTimestampQueries();
+        createPipelineStatisticsQueries();
 
         uboViewProjection.projection = glm::perspective(glm::radians(45.0f), (float)swapChainExtent.width / (float)swapChainExtent.height, 0.1f, 100.0f);
         uboViewProjection.view = glm::lookAt(glm::vec3(30.0f, 0.0f, 20.0f), glm::vec3(0.0f, 0.0f, -4.0f), glm::vec3(0.0f, 1.0f, 0.0f));
         uboViewProjection.projection[1][1] *= -1;
 
         int firstTexture = createTexture("plain.png");
-
+        initialised = true;
 
     }
     catch (const std::runtime_error& e)
@@ -52,70 +68,431 @@ int VulkanRenderer::init(GLFWwindow* newWindow)
     }
     return 0;
 }
+int VulkanRenderer::initHeadless(uint32_t width, uint32_t height)
+{
+    //No window, surface or swapchain. Frames are rendered into a ring of renderer owned images
+    headless = true;
+    swapChainExtent = { width, height };
+    return init(nullptr);
+}
 void VulkanRenderer::updateModel(int modelID, glm::mat4 newModel)
 {
-    if (modelID >= modelList.size()) { return; }
-    modelList[modelID].setModel(newModel);
+    if (traceWriter.isOpen()) { traceWriter.writeUpdateModel(modelID, newModel); }
+    int slot = getModelSlot(modelID);
+    if (slot < 0) { return; }
+    modelList[slot].setModel(newModel);
+
+    //Only the matrix buffer changes, recorded scene commands stay valid. A model with instances moves its first one
+    if (modelFirstTransform[slot] < modelFirstTransform[slot + 1])
+    {
+        modelMatrices[modelFirstTransform[slot]] = newModel;
+        modelMatricesVersion++;
+    }
+}
+void VulkanRenderer::createInstances(int modelID, int count)
+{
+    if (traceWriter.isOpen()) { traceWriter.writeCreateInstances(modelID, count); }
+    int slot = getModelSlot(modelID);
+    if (slot < 0 || count < 0) { return; }
+
+    setInstanceCount(slot, count);
+}
+int VulkanRenderer::getModelSlot(int modelID)
+{
+    //IDs come from outside, traces included, so anything not handed out or already destroyed is ignored
+    if (modelID < 0 || static_cast<size_t>(modelID) >= modelSlots.size()) { return -1; }
+    return modelSlots[modelID];
+}
+void VulkanRenderer::setInstanceCount(int slot, int count)
+{
+    uint32_t first = modelFirstTransform[slot];
+    uint32_t oldCount = modelFirstTransform[slot + 1] - first;
+    if (modelMatrices.size() - oldCount + count > MAX_TRANSFORMS)
+    {
+        throw std::runtime_error("Too many instances, the model matrix buffer holds MAX_TRANSFORMS");
+    }
+
+    //The model's range is resized in place, every instance starts where the model is, later models' ranges move
+    modelMatrices.erase(modelMatrices.begin() + first, modelMatrices.begin() + first + oldCount);
+    modelMatrices.insert(modelMatrices.begin() + first, count, modelList[slot].getModel());
+    for (size_t i = slot + 1; i < modelFirstTransform.size(); i++)
+    {
+        modelFirstTransform[i] = modelFirstTransform[i] - oldCount + count;
+    }
+    updatePacketTransforms();
+
+    //Instance counts are baked into the recorded draws
+    sceneVersion++;
+    modelMatricesVersion++;
+}
+void VulkanRenderer::updatePacketTransforms()
+{
+    //Packets point at their model's current range, the culler's spheres follow them
+    frustumCuller.clear();
+    for (size_t i = 0; i < modelList.size(); i++)
+    {
+        for (uint32_t j = modelFirstPacket[i]; j < modelFirstPacket[i + 1]; j++)
+        {
+            drawPackets[j].transformIndex = modelFirstTransform[i];
+            drawPackets[j].instanceCount = modelFirstTransform[i + 1] - modelFirstTransform[i];
+            frustumCuller.addSphere(drawPackets[j].boundingSphere, drawPackets[j].transformIndex);
+        }
+    }
+}
+void VulkanRenderer::updateInstances(int modelID, const std::vector<glm::mat4>& instances)
+{
+    if (traceWriter.isOpen()) { traceWriter.writeUpdateInstances(modelID, instances); }
+    int slot = getModelSlot(modelID);
+    if (slot < 0) { return; }
+
+    //Past the model's instance count is ignored, createInstances sets how many there are
+    uint32_t first = modelFirstTransform[slot];
+    size_t count = std::min(instances.size(), static_cast<size_t>(modelFirstTransform[slot + 1] - first));
+    if (count == 0) { return; }
+    std::copy(instances.begin(), instances.begin() + count, modelMatrices.begin() + first);
+    modelList[slot].setModel(instances[0]);
+    modelMatricesVersion++;
 }
 void VulkanRenderer::draw()
 {
+    if (traceWriter.isOpen()) { traceWriter.writeDraw(); }
+
+    //Swapchain no longer matches the window, skip the frame while minimised
+    if (framebufferResized && !recreateSwapchain())
+    {
+        return;
+    }
+
+    auto waitStart = std::chrono::high_resolution_clock::now();
+
+    //Wait for the last frame submitted on this slot before touching any of its resources
+    waitForFrame(frameSlotValues[currentFrame]);
+    runDeferredDestroys(frameSlotValues[currentFrame]);
+
     // Get Next Image
     uint32_t imageIndex;
-    vkAcquireNextImageKHR(mainDevice.logicalDevice, swapchain, std::numeric_limits<uint64_t>::max(), imageAvailable[currentFrame], VK_NULL_HANDLE, &imageIndex);
+    if (headless)
+    {
+        //Nothing to acquire from, each frame slot has its own offscreen image. The slot's last frame was waited for above,
+        //so nothing still in flight renders into it
+        imageIndex = static_cast<uint32_t>(currentFrame);
+    }
+    else
+    {
+        //imageAvailable of this slot is free again now that its last frame completed
+        VkResult result = vkAcquireNextImageKHR(mainDevice.logicalDevice, swapchain, std::numeric_limits<uint64_t>::max(), imageAvailable[currentFrame], VK_NULL_HANDLE, &imageIndex);
+        if (result == VK_ERROR_OUT_OF_DATE_KHR)
+        {
+            //Nothing was acquired or submitted, recreate on the next draw
+            framebufferResized = true;
+            return;
+        }
+        if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)
+        {
+            throw std::runtime_error("Failed to acquire swapchain image");
+        }
+    }
 
-    vkWaitForFences(mainDevice.logicalDevice, 1, &drawFences[currentFrame], VK_TRUE, std::numeric_limits<uint64_t>::max());
-    
-    vkResetFences(mainDevice.logicalDevice, 1, &drawFences[currentFrame]);
+    //Previous frame on this slot is done, so its timestamps can be read without waiting
+    collectFrameTimings();
+    collectPipelineStatistics();
+    collectCullResults();
 
+    auto recordStart = std::chrono::high_resolution_clock::now();
+    //Uniforms first, the commands need to know where in the ring the frame's data went
+    frameStats.bytesUploaded = 0;
+    uniformRing.beginFrame(currentFrame, submittedFrame + 1, getCompletedFrame());
+    updateUniformBuffers();
     recordCommand(imageIndex);
-    updateUniformBuffers(imageIndex);
+    frameStats.uniformBytesUsed = uniformRing.getBytesUsed();
+    frameStats.totalBytesUploaded += frameStats.bytesUploaded;
+    auto recordEnd = std::chrono::high_resolution_clock::now();
+    frameStats.cpuWaitMs = std::chrono::duration<double, std::milli>(recordStart - waitStart).count();
+    frameStats.cpuRecordMs = std::chrono::duration<double, std::milli>(recordEnd - recordStart).count();
 
     //SUBMIT Command Buffer to Render
     VkSubmitInfo submitInfo = {  };
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.waitSemaphoreCount = 1;
+    submitInfo.waitSemaphoreCount = headless ? 0 : 1;
     submitInfo.pWaitSemaphores = &imageAvailable[currentFrame]; //Signal to be waited
     VkPipelineStageFlags waitStages[] = {
         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
     };
     submitInfo.pWaitDstStageMask = waitStages;
     submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
-    submitInfo.signalSemaphoreCount = 1;
-    submitInfo.pSignalSemaphores = &renderFinished[currentFrame]; //Signals when finished
+    submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+
+    //Signals when finished, the timeline with this frame's number and the image's present semaphore
+    uint64_t frameValue = submittedFrame + 1;
+    std::array<VkSemaphore, 2> signalSemaphores = { frameTimeline, headless ? VK_NULL_HANDLE : renderFinished[imageIndex] };
+    std::array<uint64_t, 2> signalValues = { frameValue, 0 }; //Binary semaphores ignore their value
+    submitInfo.signalSemaphoreCount = headless ? 1 : 2;
+    submitInfo.pSignalSemaphores = signalSemaphores.data();
+
+    VkTimelineSemaphoreSubmitInfo timelineSubmitInfo = {};
+    timelineSubmitInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timelineSubmitInfo.signalSemaphoreValueCount = submitInfo.signalSemaphoreCount;
+    timelineSubmitInfo.pSignalSemaphoreValues = signalValues.data();
+    submitInfo.pNext = &timelineSubmitInfo;
     
-    VkResult result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, drawFences[currentFrame]);
+    VkResult result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
     if (result != VK_SUCCESS)
     {
         throw std::runtime_error("Failed to submit Command Buffer to queue");
     }
+    auto submitEnd = std::chrono::high_resolution_clock::now();
+    frameStats.cpuSubmitMs = std::chrono::duration<double, std::milli>(submitEnd - recordEnd).count();
+    frameStats.cpuPresentMs = 0.0;
+    submittedFrame = frameValue;
+    frameSlotValues[currentFrame] = frameValue;
+
+    if (headless)
+    {
+        //Nothing to present, the timeline tells when the image is done
+        currentFrame = (currentFrame + 1) % maxFrameDraws;
+        return;
+    }
 
     //Present rendered image to screen;
     VkPresentInfoKHR presentInfo = {};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
     presentInfo.waitSemaphoreCount = 1;
-    presentInfo.pWaitSemaphores = &renderFinished[currentFrame]; //Semaphores to wait on
+    presentInfo.pWaitSemaphores = &renderFinished[imageIndex]; //Semaphores to wait on
     presentInfo.swapchainCount = 1;
     presentInfo.pSwapchains = &swapchain;
     presentInfo.pImageIndices = &imageIndex;
     
     result = vkQueuePresentKHR(presentationQueue,&presentInfo);
-    if (result != VK_SUCCESS)
+    frameStats.cpuPresentMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - submitEnd).count();
+    if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+    {
+        framebufferResized = true;
+    }
+    else if (result != VK_SUCCESS)
     {
         throw std::runtime_error("Failed to present Image");
     }
-    currentFrame = (currentFrame + 1) % MAX_FRAME_DRAWS;
+    currentFrame = (currentFrame + 1) % maxFrameDraws;
+}
+void VulkanRenderer::setMaxFrameDraws(int frameDraws)
+{
+    if (traceWriter.isOpen()) { traceWriter.writeSetMaxFrameDraws(frameDraws); }
+
+    //Resources exist for MAX_FRAME_DRAWS slots, changing the count only changes how many of them get used
+    frameDraws = std::max(1, std::min(frameDraws, MAX_FRAME_DRAWS));
+    if (frameDraws == maxFrameDraws) { return; }
+
+    if (initialised)
+    {
+        //Start again from slot 0 with nothing in flight so no slot is skipped while still busy
+        waitForFrame(submittedFrame);
+        currentFrame = 0;
+    }
+    maxFrameDraws = frameDraws;
+}
+int VulkanRenderer::getMaxFrameDraws()
+{
+    return maxFrameDraws;
+}
+void VulkanRenderer::waitForFrame(uint64_t frame)
+{
+    //Frame 0 is never submitted, the timeline starts there
+    if (frame == 0) { return; }
+
+    VkSemaphoreWaitInfo waitInfo = {};
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &frameTimeline;
+    waitInfo.pValues = &frame;
+
+    VkResult result = vkWaitSemaphores(mainDevice.logicalDevice, &waitInfo, std::numeric_limits<uint64_t>::max());
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to wait for frame timeline");
+    }
+}
+uint64_t VulkanRenderer::getSubmittedFrame()
+{
+    return submittedFrame;
+}
+uint64_t VulkanRenderer::getCompletedFrame()
+{
+    uint64_t completedFrame = 0;
+    VkResult result = vkGetSemaphoreCounterValue(mainDevice.logicalDevice, frameTimeline, &completedFrame);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to read frame timeline");
+    }
+    return completedFrame;
+}
+void VulkanRenderer::destroyAfterFrame(std::function<void()> destroyFunction)
+{
+    //Anything recorded so far may still be in use until the last submitted frame is done
+    deferredDestroys.push_back({ submittedFrame, destroyFunction });
+}
+void VulkanRenderer::runDeferredDestroys(uint64_t completedFrame)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < deferredDestroys.size(); i++)
+    {
+        if (deferredDestroys[i].frame <= completedFrame)
+        {
+            deferredDestroys[i].destroyFunction();
+        }
+        else
+        {
+            deferredDestroys[kept++] = deferredDestroys[i];
+        }
+    }
+    deferredDestroys.resize(kept);
+}
+void VulkanRenderer::setPipelineStatisticsEnabled(bool enabled)
+{
+    //Takes effect from the next recorded frame
+    if (enabled != pipelineStatisticsEnabled) { sceneVersion++; }
+    pipelineStatisticsEnabled = enabled;
+    if (!enabled)
+    {
+        //Frames already recorded with queries are never read back, their numbers would come back after this
+        frameStats.modelPipelineStats.clear();
+        std::fill(statisticsModelCounts.begin(), statisticsModelCounts.end(), 0);
+    }
+}
+bool VulkanRenderer::isPipelineStatisticsSupported()
+{
+    return pipelineStatisticsSupported;
+}
+void VulkanRenderer::setGpuCullingEnabled(bool enabled)
+{
+    //Draw calls are recorded differently, so the scene commands have to be recorded again
+    gpuCulling = enabled && gpuCullingSupported;
+    if (!gpuCulling)
+    {
+        frameStats.gpuVisibleDraws = 0;
+        frameStats.gpuCulledDraws = 0;
+        frameStats.gpuOccludedDraws = 0;
+        frameStats.gpuLateDraws = 0;
+    }
+    sceneVersion++;
+}
+bool VulkanRenderer::isGpuCullingSupported()
+{
+    return gpuCullingSupported;
+}
+void VulkanRenderer::setOcclusionCullingEnabled(bool enabled)
+{
+    //Only does anything while GPU culling is on. The scene commands run twice with it, so they are recorded without queries
+    occlusionCulling = enabled && occlusionCullingSupported;
+    if (!occlusionCulling)
+    {
+        frameStats.gpuOccludedDraws = 0;
+        frameStats.gpuLateDraws = 0;
+    }
+    //Whatever the pyramid holds is from before it was turned off
+    hizValid = false;
+    sceneVersion++;
+}
+bool VulkanRenderer::isOcclusionCullingSupported()
+{
+    return occlusionCullingSupported;
+}
+void VulkanRenderer::setDepthPrepassEnabled(bool enabled)
+{
+    //The pre-pass draws and the shading pipeline are baked into the scene commands
+    if (enabled != depthPrepass) { sceneVersion++; }
+    depthPrepass = enabled;
+}
+void VulkanRenderer::setCpuCullingEnabled(bool enabled)
+{
+    //Turning it off needs the instance counts it zeroed written back, which re-recording does
+    if (enabled != cpuCulling) { sceneVersion++; }
+    cpuCulling = enabled;
+}
+void VulkanRenderer::setRecordThreadCount(int threadCount)
+{
+    //Can't go past the threads and pools made at init, 1 records on the calling thread only
+    recordThreads = std::max(1, std::min(threadCount, static_cast<int>(recordWorkers.getThreadCount())));
+    sceneVersion++;
+}
+int VulkanRenderer::getRecordThreadCount()
+{
+    return recordThreads;
+}
+void VulkanRenderer::setDrawSortingEnabled(bool enabled)
+{
+    //Sorted draws get no per model timestamps, their draws are no longer next to each other
+    drawSorting = enabled;
+    sceneVersion++;
+}
+void VulkanRenderer::setCommandBufferCachingEnabled(bool enabled)
+{
+    //Off re-records the scene commands every frame, mostly there to compare against
+    commandBufferCaching = enabled;
+    sceneVersion++;
+}
+void VulkanRenderer::setPresentPolicy(PresentPolicy policy)
+{
+    if (policy == presentPolicy) { return; }
+    presentPolicy = policy;
+
+    //Present mode and image count are fixed per swapchain, so build a new one before the next frame
+    if (initialised && !headless)
+    {
+        framebufferResized = true;
+    }
+}
+VkPresentModeKHR VulkanRenderer::getPresentMode()
+{
+    return presentMode;
+}
+uint32_t VulkanRenderer::getSwapchainImageCount()
+{
+    return static_cast<uint32_t>(swapchainImages.size());
+}
+FrameStats VulkanRenderer::getFrameStats()
+{
+    return frameStats;
+}
+DeviceMemoryStats VulkanRenderer::getMemoryStats()
+{
+    return deviceAllocator.getStats();
+}
+bool VulkanRenderer::startTrace(const std::string& fileName)
+{
+    //Start right after init, model and texture IDs in the trace only line up when it sees every create call
+    if (!initialised || traceWriter.isOpen()) { return false; }
+
+    TraceHeader header;
+    header.width = swapChainExtent.width;
+    header.height = swapChainExtent.height;
+    header.maxFrameDraws = maxFrameDraws;
+    return traceWriter.open(fileName, header);
+}
+void VulkanRenderer::stopTrace()
+{
+    traceWriter.close();
 }
 void VulkanRenderer::cleanUp()
 {
     vkDeviceWaitIdle(mainDevice.logicalDevice);
+    runDeferredDestroys(submittedFrame);
+    stopTrace();
+
+    if (timestampQueryPool != VK_NULL_HANDLE)
+    {
+        vkDestroyQueryPool(mainDevice.logicalDevice, timestampQueryPool, nullptr);
+    }
+    if (pipelineStatisticsQueryPool != VK_NULL_HANDLE)
+    {
+        vkDestroyQueryPool(mainDevice.logicalDevice, pipelineStatisticsQueryPool, nullptr);
+    }
 
     for (size_t i = 0; i < modelList.size(); i++)
     {
         modelList[i].destroyMesh();
     }
+    geometryBuffer.destroy();
 
-    //_aligned_free(modelTransferSpace);
     vkDestroyDescriptorPool(mainDevice.logicalDevice, samplerDescriptorPool, nullptr);
     vkDestroyDescriptorSetLayout(mainDevice.logicalDevice, samplerSetLayout, nullptr);
 
@@ -124,43 +501,93 @@ void VulkanRenderer::cleanUp()
     {
         vkDestroyImageView(mainDevice.logicalDevice, textureImageViews[i], nullptr);
         vkDestroyImage(mainDevice.logicalDevice, textureImages[i], nullptr);
-        vkFreeMemory(mainDevice.logicalDevice, textureImagesMemory[i], nullptr);
+        deviceAllocator.free(textureImagesMemory[i]);
     }
 
     vkDestroyImageView(mainDevice.logicalDevice, depthBufferImageView, nullptr);
     vkDestroyImage(mainDevice.logicalDevice, depthBufferImage, nullptr);
-    vkFreeMemory(mainDevice.logicalDevice, depthBufferImageMemory, nullptr);
+    deviceAllocator.free(depthBufferImageMemory);
 
     vkDestroyDescriptorPool(mainDevice.logicalDevice, descriptorPool, nullptr);
     vkDestroyDescriptorSetLayout(mainDevice.logicalDevice, descriptorSetLayout,nullptr);
-    for (size_t i = 0; i < swapchainImages.size(); i++)
+    uniformRing.destroy();
+    for (size_t i = 0; i < MAX_FRAME_DRAWS; i++)
     {
-        vkDestroyBuffer(mainDevice.logicalDevice, vpUniformBuffer[i], nullptr);
-        vkFreeMemory(mainDevice.logicalDevice, vpUniformBufferMemory[i], nullptr);
-        //vkDestroyBuffer(mainDevice.logicalDevice, modelDynamicUniformBuffer[i], nullptr);
-        //vkFreeMemory(mainDevice.logicalDevice, modelDynamicUniformBufferMemory[i], nullptr);
+        destroyBuffer(&deviceAllocator, modelStorageBuffer[i], modelStorageBufferMemory[i]);
+        destroyBuffer(&deviceAllocator, indirectBuffers[i], indirectBuffersMemory[i]);
     }
     for (size_t i = 0; i < MAX_FRAME_DRAWS; i++)
     {
-        vkDestroyFence(mainDevice.logicalDevice, drawFences[i], nullptr);
-        vkDestroySemaphore(mainDevice.logicalDevice, renderFinished[i], nullptr);
         vkDestroySemaphore(mainDevice.logicalDevice, imageAvailable[i], nullptr);
     }
-    vkDestroyCommandPool(mainDevice.logicalDevice, graphicsCommandPool, nullptr);
+    for (size_t i = 0; i < renderFinished.size(); i++)
+    {
+        vkDestroySemaphore(mainDevice.logicalDevice, renderFinished[i], nullptr);
+    }
+    vkDestroySemaphore(mainDevice.logicalDevice, frameTimeline, nullptr);
+    recordWorkers.stop();
+    for (size_t i = 0; i < sceneCommandPools.size(); i++)
+    {
+        vkDestroyCommandPool(mainDevice.logicalDevice, sceneCommandPools[i], nullptr);
+    }
+    for (size_t i = 0; i < frameCommandPools.size(); i++)
+    {
+        vkDestroyCommandPool(mainDevice.logicalDevice, frameCommandPools[i], nullptr);
+    }
+    destroyUploadPool(mainDevice.logicalDevice, uploadPool);
     for (auto framebuffer : swapchainFramebuffers)
     {
         vkDestroyFramebuffer(mainDevice.logicalDevice, framebuffer, nullptr);
     }
+    if (cullPipeline != VK_NULL_HANDLE)
+    {
+        vkDestroyPipeline(mainDevice.logicalDevice, cullPipeline, nullptr);
+        vkDestroyPipelineLayout(mainDevice.logicalDevice, cullPipelineLayout, nullptr);
+        vkDestroyDescriptorPool(mainDevice.logicalDevice, cullDescriptorPool, nullptr);
+        vkDestroyDescriptorSetLayout(mainDevice.logicalDevice, cullSetLayout, nullptr);
+        destroyHizPyramid();
+        vkDestroyPipeline(mainDevice.logicalDevice, hizPipeline, nullptr);
+        vkDestroyPipelineLayout(mainDevice.logicalDevice, hizPipelineLayout, nullptr);
+        vkDestroyDescriptorPool(mainDevice.logicalDevice, hizDescriptorPool, nullptr);
+        vkDestroyDescriptorSetLayout(mainDevice.logicalDevice, hizSetLayout, nullptr);
+        for (size_t i = 0; i < cullRecordBuffers.size(); i++)
+        {
+            destroyBuffer(&deviceAllocator, occlusionFlagBuffers[i], occlusionFlagBuffersMemory[i]);
+            destroyBuffer(&deviceAllocator, cullRecordBuffers[i], cullRecordBuffersMemory[i]);
+            destroyBuffer(&deviceAllocator, drawCountBuffers[i], drawCountBuffersMemory[i]);
+        }
+    }
     vkDestroyPipeline(mainDevice.logicalDevice, graphicsPipeline, nullptr);
+    vkDestroyPipeline(mainDevice.logicalDevice, blendPipeline, nullptr);
+    vkDestroyPipeline(mainDevice.logicalDevice, alphaTestPipeline, nullptr);
+    vkDestroyPipeline(mainDevice.logicalDevice, depthEqualPipeline, nullptr);
+    vkDestroyPipeline(mainDevice.logicalDevice, depthPrepassPipeline, nullptr);
     vkDestroyPipelineLayout(mainDevice.logicalDevice, pipelineLayout, nullptr);
     vkDestroyRenderPass(mainDevice.logicalDevice, renderPass, nullptr);
+    if (lateRenderPass != VK_NULL_HANDLE)
+    {
+        vkDestroyRenderPass(mainDevice.logicalDevice, lateRenderPass, nullptr);
+    }
     for (auto image : swapchainImages)
     {
         vkDestroyImageView(mainDevice.logicalDevice, image.imageView, nullptr);
     }
-    vkDestroySwapchainKHR(mainDevice.logicalDevice, swapchain, nullptr);
-    vkDestroySurfaceKHR(instance, surface, nullptr);
+    if (headless)
+    {
+        for (size_t i = 0; i < swapchainImages.size(); i++)
+        {
+            vkDestroyImage(mainDevice.logicalDevice, swapchainImages[i].image, nullptr);
+            deviceAllocator.free(offscreenImagesMemory[i]);
+        }
+    }
+    else
+    {
+        vkDestroySwapchainKHR(mainDevice.logicalDevice, swapchain, nullptr);
+        vkDestroySurfaceKHR(instance, surface, nullptr);
+    }
 
+    //Every resource has given its memory back, only the blocks are left
+    deviceAllocator.destroy();
     vkDestroyDevice(mainDevice.logicalDevice,nullptr);
     if (enableValidationLayers)
     {
@@ -183,7 +610,7 @@ void VulkanRenderer::createInstance()
     appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     appInfo.pEngineName = "Vulkan Engine";
     appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    appInfo.apiVersion = VK_API_VERSION_1_1; 
+    appInfo.apiVersion = VK_API_VERSION_1_2; 
 
     VkInstanceCreateInfo createInfo = {};
     createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -192,12 +619,16 @@ void VulkanRenderer::createInstance()
     //Extensions list
     std::vector<const char*> instanceExtensions = std::vector<const char*>();
     
-    uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions; 
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-    for (size_t i = 0; i < glfwExtensionCount; i++)
+    //Headless runs never initialise GLFW and need no surface extensions
+    if (!headless)
     {
-        instanceExtensions.push_back(glfwExtensions[i]);
+        uint32_t glfwExtensionCount = 0;
+        const char** glfwExtensions;
+        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        for (size_t i = 0; i < glfwExtensionCount; i++)
+        {
+            instanceExtensions.push_back(glfwExtensions[i]);
+        }
     }
 
     //For INSTANCE extensions
@@ -277,7 +708,8 @@ void VulkanRenderer::createLogicalDevice()
     deviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     deviceCreateInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
     deviceCreateInfo.pQueueCreateInfos = queueCreateInfos.data();
-    deviceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
+    //Swapchain extension is only needed when presenting to a window
+    deviceCreateInfo.enabledExtensionCount = headless ? 0 : static_cast<uint32_t>(deviceExtensions.size());
     deviceCreateInfo.ppEnabledExtensionNames = deviceExtensions.data();
 
     //Physical Device features that the Logical device will be using
@@ -290,7 +722,32 @@ void VulkanRenderer::createLogicalDevice()
     {
         deviceFeatures.samplerAnisotropy = VK_FALSE; //Disable anisotropy if device does not support it
     }
+    //Optional, only used when pipeline statistics are turned on
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(mainDevice.physicalDevice, &supportedFeatures);
+    pipelineStatisticsSupported = supportedFeatures.pipelineStatisticsQuery == VK_TRUE;
+    deviceFeatures.pipelineStatisticsQuery = supportedFeatures.pipelineStatisticsQuery;
+    //Model index goes through firstInstance of the indirect draws. Without multi draw every command is its own indirect call
+    deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+    multiDrawIndirectSupported = supportedFeatures.multiDrawIndirect == VK_TRUE;
+    deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
     deviceCreateInfo.pEnabledFeatures = &deviceFeatures;
+
+    //Timeline semaphores are core since 1.2, frame syncronisation is built on them
+    VkPhysicalDeviceVulkan12Features vulkan12Features = {};
+    vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    vulkan12Features.timelineSemaphore = VK_TRUE;
+    deviceCreateInfo.pNext = &vulkan12Features;
+
+    //Optional, GPU culling draws with vkCmdDrawIndexedIndirectCount
+    VkPhysicalDeviceVulkan12Features supported12Features = {};
+    supported12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    VkPhysicalDeviceFeatures2 supportedFeatures2 = {};
+    supportedFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supportedFeatures2.pNext = &supported12Features;
+    vkGetPhysicalDeviceFeatures2(mainDevice.physicalDevice, &supportedFeatures2);
+    gpuCullingSupported = supported12Features.drawIndirectCount == VK_TRUE && multiDrawIndirectSupported;
+    vulkan12Features.drawIndirectCount = supported12Features.drawIndirectCount;
   
     VkResult result = vkCreateDevice(mainDevice.physicalDevice,&deviceCreateInfo,nullptr,&mainDevice.logicalDevice);
     if (result != VK_SUCCESS)
@@ -332,12 +789,7 @@ void VulkanRenderer::createSwapChain()
     VkPresentModeKHR presentationMode = chooseBestPresentationMode(swapChainDetails.presentationModes);
     VkExtent2D extent = chooseSwapExtent(swapChainDetails.surfaceCapabilities);
 
-    uint32_t imageCount = swapChainDetails.surfaceCapabilities.minImageCount+1;
-    if (swapChainDetails.surfaceCapabilities.maxImageCount>0 &&
-        swapChainDetails.surfaceCapabilities.maxImageCount < imageCount)
-    {
-        imageCount = swapChainDetails.surfaceCapabilities.minImageCount;
-    }
+    uint32_t imageCount = chooseSwapchainImageCount(swapChainDetails.surfaceCapabilities);
 
     VkSwapchainCreateInfoKHR swapChainCreateInfo = {};
     swapChainCreateInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
@@ -374,22 +826,29 @@ void VulkanRenderer::createSwapChain()
     }
 
     //If old swap chain being destroyed and this one replaces it then link old one to quickly hand over responsiblities. Like resizing the app
-    swapChainCreateInfo.oldSwapchain = VK_NULL_HANDLE;
+    VkSwapchainKHR oldSwapchain = swapchain;
+    swapChainCreateInfo.oldSwapchain = oldSwapchain;
 
     VkResult result = vkCreateSwapchainKHR(mainDevice.logicalDevice, &swapChainCreateInfo, nullptr, &swapchain);
     if (result != VK_SUCCESS)
     {
         throw std::runtime_error("Failed to create a Swapchain!");
     }
+    if (oldSwapchain != VK_NULL_HANDLE)
+    {
+        vkDestroySwapchainKHR(mainDevice.logicalDevice, oldSwapchain, nullptr);
+    }
 
     swapChainImageFormat = surfaceFormat.format;
     swapChainExtent = extent;
+    presentMode = presentationMode;
 
     uint32_t swapchainImageCount = 0;
     vkGetSwapchainImagesKHR(mainDevice.logicalDevice, swapchain, &swapchainImageCount, nullptr);
     std::vector<VkImage>images(swapchainImageCount);
     vkGetSwapchainImagesKHR(mainDevice.logicalDevice, swapchain, &swapchainImageCount, images.data());
     
+    swapchainImages.clear();
     for (VkImage image : images)
     {
         SwapchainImage swapchainImage = {};
@@ -402,6 +861,77 @@ void VulkanRenderer::createSwapChain()
 
 }
 
+bool VulkanRenderer::recreateSwapchain()
+{
+    //Minimised windows have a 0x0 framebuffer, no swapchain can be made for that
+    int width = 0, height = 0;
+    glfwGetFramebufferSize(window, &width, &height);
+    if (width == 0 || height == 0)
+    {
+        return false;
+    }
+
+    vkDeviceWaitIdle(mainDevice.logicalDevice);
+
+    //Only what depends on the swapchain images or extent. Render pass, pipeline (dynamic viewport/scissor),
+    //descriptors and per frame resources stay as they are
+    for (auto framebuffer : swapchainFramebuffers)
+    {
+        vkDestroyFramebuffer(mainDevice.logicalDevice, framebuffer, nullptr);
+    }
+    vkDestroyImageView(mainDevice.logicalDevice, depthBufferImageView, nullptr);
+    vkDestroyImage(mainDevice.logicalDevice, depthBufferImage, nullptr);
+    deviceAllocator.free(depthBufferImageMemory);
+    for (auto image : swapchainImages)
+    {
+        vkDestroyImageView(mainDevice.logicalDevice, image.imageView, nullptr);
+    }
+
+    createSwapChain();
+    createDepthBufferImage();
+    createFrameBuffers();
+    createPresentSemaphores(); //Image count can change with the new swapchain
+    if (cullPipeline != VK_NULL_HANDLE)
+    {
+        //Pyramid follows the depth buffer's size and its level 0 reads the new depth view
+        destroyHizPyramid();
+        createHizPyramid();
+    }
+
+    //Keep the aspect ratio in step with the new extent
+    uboViewProjection.projection = glm::perspective(glm::radians(45.0f), (float)swapChainExtent.width / (float)swapChainExtent.height, 0.1f, 100.0f);
+    uboViewProjection.projection[1][1] *= -1;
+
+    //Scene commands bake in the old viewport and scissor
+    sceneVersion++;
+
+    framebufferResized = false;
+    return true;
+}
+
+void VulkanRenderer::createOffscreenImages()
+{
+    //Stand in for the swapchain when running headless. Same format family as the window path so the
+    //render pass and pipeline are created the same way
+    //Nothing throttles headless frames, the closest present mode is IMMEDIATE
+    presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+    swapChainImageFormat = chooseSupportedFormat({ VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_B8G8R8A8_UNORM }, VK_IMAGE_TILING_OPTIMAL,
+                                                 VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT);
+
+    for (int i = 0; i < OFFSCREEN_IMAGE_COUNT; i++)
+    {
+        DeviceAllocation imageMemory;
+
+        SwapchainImage offscreenImage = {};
+        offscreenImage.image = createImage(swapChainExtent.width, swapChainExtent.height, swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &imageMemory);
+        offscreenImage.imageView = createImageView(offscreenImage.image, swapChainImageFormat, VK_IMAGE_ASPECT_COLOR_BIT);
+
+        swapchainImages.push_back(offscreenImage);
+        offscreenImagesMemory.push_back(imageMemory);
+    }
+}
+
 void VulkanRenderer::createRenderPass()
 {
     //Attachments
@@ -415,14 +945,15 @@ void VulkanRenderer::createRenderPass()
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    //Offscreen images are never presented, leave them ready to be copied out instead
+    colorAttachment.finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     //Depth Attachment of render Pass
     VkAttachmentDescription depthAttachment = {};
     depthAttachment.format = depthFormat;
     depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
     depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE; //Kept for the Hi-Z build and the late pass
     depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 
@@ -449,13 +980,15 @@ void VulkanRenderer::createRenderPass()
     std::array<VkSubpassDependency, 2> subpassDependencies;
 
     //Conversion from VK_IMAGE_LAYOUT_UNDEFINED to VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+    //The single depth buffer is shared by every frame in flight, so depth writes of the previous frame have to finish first
     subpassDependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
-    subpassDependencies[0].srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-    subpassDependencies[0].srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    subpassDependencies[0].srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    subpassDependencies[0].srcAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
     subpassDependencies[0].dstSubpass = 0;
-    subpassDependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    subpassDependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    subpassDependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    subpassDependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+        VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
     subpassDependencies[0].dependencyFlags = 0;
 
     //Conversion from VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL to VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
@@ -484,6 +1017,31 @@ void VulkanRenderer::createRenderPass()
     {
         throw std::runtime_error("Failed to create renderpass");
     }
+
+    if (!occlusionCullingSupported)
+    {
+        return;
+    }
+
+    //Late pass of occlusion culling, draws on top of what the main pass left. Compatible with the main pass,
+    //so it uses the same framebuffers and scene commands
+    renderPassAttachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    renderPassAttachments[0].initialLayout = colorAttachment.finalLayout;
+    renderPassAttachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    renderPassAttachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    renderPassAttachments[1].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL; //Where the Hi-Z build left it
+
+    //Main pass color writes and the Hi-Z build's depth reads come before
+    subpassDependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    subpassDependencies[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    subpassDependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+        VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+
+    result = vkCreateRenderPass(mainDevice.logicalDevice, &renderPassCreateInfo, nullptr, &lateRenderPass);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create the late renderpass");
+    }
 }
 
 void VulkanRenderer::createDescriptorSetLayout()
@@ -491,19 +1049,20 @@ void VulkanRenderer::createDescriptorSetLayout()
     //UniformValues DescriptorSetLayout
     VkDescriptorSetLayoutBinding vpLayoutBinding = {};
     vpLayoutBinding.binding = 0;
-    vpLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    vpLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     vpLayoutBinding.descriptorCount = 1;
     vpLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
     vpLayoutBinding.pImmutableSamplers = nullptr; //For texture
 
-    //VkDescriptorSetLayoutBinding modelLayoutBinding = {};
-    //modelLayoutBinding.binding = 1;
-    //modelLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-    //modelLayoutBinding.descriptorCount = 1;
-    //modelLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-    //modelLayoutBinding.pImmutableSamplers = nullptr;
+    //Model matrices, indexed by gl_InstanceIndex
+    VkDescriptorSetLayoutBinding modelLayoutBinding = {};
+    modelLayoutBinding.binding = 1;
+    modelLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    modelLayoutBinding.descriptorCount = 1;
+    modelLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    modelLayoutBinding.pImmutableSamplers = nullptr;
 
-    std::vector<VkDescriptorSetLayoutBinding> layoutBindings = { vpLayoutBinding };
+    std::vector<VkDescriptorSetLayoutBinding> layoutBindings = { vpLayoutBinding, modelLayoutBinding };
 
     VkDescriptorSetLayoutCreateInfo layoutCreateInfo = {};
     layoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -539,13 +1098,6 @@ void VulkanRenderer::createDescriptorSetLayout()
     }
 }
 
-void VulkanRenderer::createPushConstantRange()
-{
-    pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-    pushConstantRange.offset = 0;
-    pushConstantRange.size = sizeof(Model);
-}
-
 void VulkanRenderer::createGraphicsPipeline()
 {
     auto vertexShaderCode = readFile("Shaders/vert.spv");
@@ -623,22 +1175,20 @@ void VulkanRenderer::createGraphicsPipeline()
     VkPipelineViewportStateCreateInfo viewportStateCreateInfo = {};
     viewportStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewportStateCreateInfo.viewportCount = 1;
-    viewportStateCreateInfo.pViewports = &viewport;
+    viewportStateCreateInfo.pViewports = &viewport; //Ignored, viewport and scissor are dynamic
     viewportStateCreateInfo.scissorCount = 1;
     viewportStateCreateInfo.pScissors = &scissor;
 
+    //Dynaimc States
+    //Set with vkCmdSetViewport/vkCmdSetScissor while recording so a resized swapchain doesn't need a new pipeline
+    std::vector<VkDynamicState> dynamicStateEnable;
+    dynamicStateEnable.push_back(VK_DYNAMIC_STATE_VIEWPORT);
+    dynamicStateEnable.push_back(VK_DYNAMIC_STATE_SCISSOR);
 
-    // In case of making the window resizable
-
-    ////Dynaimc States
-    //std::vector<VkDynamicState> dynamicStateEnable;
-    //dynamicStateEnable.push_back(VK_DYNAMIC_STATE_VIEWPORT); // Can Resize command buffer with vkCmdSetViewport(commandbuffer,0,1,&viewport);
-    //dynamicStateEnable.push_back(VK_DYNAMIC_STATE_SCISSOR); // Can Resize command buffer with vkCmdSetScissor(commandbuffer,0,1,&viewport);
-    ////Everytime the window is resized you have to destroy swapchain and and re zie it as well
-
-    //VkPipelineDynamicStateCreateInfo dynamicStateCreateInfo = {};
-    //dynamicStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    //dynamicStateCreateInfo.dynamicStateCount = static_cast<uint32_t>(dynamicStateEnable.size());
+    VkPipelineDynamicStateCreateInfo dynamicStateCreateInfo = {};
+    dynamicStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicStateCreateInfo.dynamicStateCount = static_cast<uint32_t>(dynamicStateEnable.size());
+    dynamicStateCreateInfo.pDynamicStates = dynamicStateEnable.data();
 
     //Rasteriser
     VkPipelineRasterizationStateCreateInfo rasterizerCreateInfo = {};
@@ -662,7 +1212,7 @@ void VulkanRenderer::createGraphicsPipeline()
     VkPipelineColorBlendAttachmentState colorStateAttachment = {};
     colorStateAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT 
                               | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    colorStateAttachment.blendEnable = VK_TRUE;
+    colorStateAttachment.blendEnable = VK_FALSE; //Opaque, only blendPipeline turns it on
 
     //equation for blending : (srcColorBlendFactor * new color) colorBlendOp (dstColorBlendFactor * old color)
     colorStateAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
@@ -690,8 +1240,8 @@ void VulkanRenderer::createGraphicsPipeline()
     pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutCreateInfo.setLayoutCount = static_cast<uint32_t>(descriptorSetLayouts.size());
     pipelineLayoutCreateInfo.pSetLayouts = descriptorSetLayouts.data();
-    pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
-    pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 0;
+    pipelineLayoutCreateInfo.pPushConstantRanges = nullptr;
 
     VkResult result = vkCreatePipelineLayout(mainDevice.logicalDevice, &pipelineLayoutCreateInfo, nullptr, &pipelineLayout);
     if (result != VK_SUCCESS)
@@ -717,7 +1267,7 @@ void VulkanRenderer::createGraphicsPipeline()
     pipelineCreateInfo.pVertexInputState = &vertexInputCreateInfo;
     pipelineCreateInfo.pInputAssemblyState = &inputAssembly;
     pipelineCreateInfo.pViewportState = &viewportStateCreateInfo;
-    pipelineCreateInfo.pDynamicState = nullptr; //For now its null
+    pipelineCreateInfo.pDynamicState = &dynamicStateCreateInfo;
     pipelineCreateInfo.pRasterizationState = &rasterizerCreateInfo;
     pipelineCreateInfo.pMultisampleState = &multisampleCreateInfo;
     pipelineCreateInfo.pColorBlendState = &colorBlendingCreateInfo;
@@ -736,8 +1286,69 @@ void VulkanRenderer::createGraphicsPipeline()
         throw std::runtime_error("Failed to Create a graphics pipeline");
     }
 
+    //After the depth pre-pass only the nearest surface's fragments pass, the depth is already there
+    depthStencilCreateInfo.depthWriteEnable = VK_FALSE;
+    depthStencilCreateInfo.depthCompareOp = VK_COMPARE_OP_EQUAL;
+    result = vkCreateGraphicsPipelines(mainDevice.logicalDevice, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr, &depthEqualPipeline);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to Create the depth equal pipeline");
+    }
+    depthStencilCreateInfo.depthWriteEnable = VK_TRUE;
+    depthStencilCreateInfo.depthCompareOp = VK_COMPARE_OP_LESS;
+
+    //Alpha tested, the fragment shader discards under the cutoff. Not drawn in the depth pre-pass, the holes would be filled
+    VkBool32 alphaTest = VK_TRUE;
+    VkSpecializationMapEntry alphaTestEntry = {};
+    alphaTestEntry.constantID = 0;
+    alphaTestEntry.offset = 0;
+    alphaTestEntry.size = sizeof(VkBool32);
+
+    VkSpecializationInfo alphaTestInfo = {};
+    alphaTestInfo.mapEntryCount = 1;
+    alphaTestInfo.pMapEntries = &alphaTestEntry;
+    alphaTestInfo.dataSize = sizeof(VkBool32);
+    alphaTestInfo.pData = &alphaTest;
+
+    shaderStages[1].pSpecializationInfo = &alphaTestInfo;
+    result = vkCreateGraphicsPipelines(mainDevice.logicalDevice, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr, &alphaTestPipeline);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to Create the alpha test pipeline");
+    }
+    shaderStages[1].pSpecializationInfo = nullptr;
+
+    //Blended, tested against the opaque depth but not writing it, drawn back to front after everything else
+    colorStateAttachment.blendEnable = VK_TRUE;
+    depthStencilCreateInfo.depthWriteEnable = VK_FALSE;
+    result = vkCreateGraphicsPipelines(mainDevice.logicalDevice, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr, &blendPipeline);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to Create the blend pipeline");
+    }
+
+    //Depth pre-pass, the position out of the interleaved vertices and no fragment shader or color writes
+    auto depthShaderCode = readFile("Shaders/depth.spv");
+    VkShaderModule depthShaderModule = createShaderModule(depthShaderCode);
+    vertexCreateInfo.module = depthShaderModule;
+
+    vertexInputCreateInfo.vertexAttributeDescriptionCount = 1;
+    colorStateAttachment.colorWriteMask = 0;
+    colorStateAttachment.blendEnable = VK_FALSE;
+    depthStencilCreateInfo.depthWriteEnable = VK_TRUE;
+    depthStencilCreateInfo.depthCompareOp = VK_COMPARE_OP_LESS;
+
+    pipelineCreateInfo.stageCount = 1;
+    pipelineCreateInfo.pStages = &vertexCreateInfo;
+    result = vkCreateGraphicsPipelines(mainDevice.logicalDevice, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr, &depthPrepassPipeline);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to Create the depth pre-pass pipeline");
+    }
+
     //Destryo Shader Modules
 
+    vkDestroyShaderModule(mainDevice.logicalDevice, depthShaderModule, nullptr);
     vkDestroyShaderModule(mainDevice.logicalDevice, fragmentShaderModule, nullptr);
     vkDestroyShaderModule(mainDevice.logicalDevice, vertexShaderModule, nullptr);
 
@@ -749,8 +1360,16 @@ void VulkanRenderer::createDepthBufferImage()
     depthFormat = chooseSupportedFormat({ VK_FORMAT_D32_SFLOAT_S8_UINT , VK_FORMAT_D32_SFLOAT , 
                                                    VK_FORMAT_D24_UNORM_S8_UINT },VK_IMAGE_TILING_OPTIMAL, 
                                                    VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+
+    //Occlusion culling reduces the depth into the Hi-Z pyramid, which needs it sampled
+    VkFormatProperties depthProperties;
+    vkGetPhysicalDeviceFormatProperties(mainDevice.physicalDevice, depthFormat, &depthProperties);
+    depthSampled = (depthProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) != 0;
+    occlusionCullingSupported = gpuCullingSupported && depthSampled;
+
+    VkImageUsageFlags depthUsage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | (depthSampled ? VK_IMAGE_USAGE_SAMPLED_BIT : 0);
     depthBufferImage = createImage(swapChainExtent.width, swapChainExtent.height, depthFormat, VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &depthBufferImageMemory);
+        depthUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &depthBufferImageMemory);
 
     depthBufferImageView = createImageView(depthBufferImage, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
 }
@@ -785,61 +1404,214 @@ void VulkanRenderer::createFrameBuffers()
 
 void VulkanRenderer::createCommandPool()
 {
+    //Uploads and one off layout changes, the frames have their own pools
     QueueFamilyIndices queueFamilyIndices = getQueueFamiles(mainDevice.physicalDevice);
-
-    VkCommandPoolCreateInfo poolInfo = {};
-    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily;
-
-    VkResult result = vkCreateCommandPool(mainDevice.logicalDevice, &poolInfo, nullptr, &graphicsCommandPool);
-    if (result != VK_SUCCESS)
-    {
-        throw std::runtime_error("Failed to create graphics command pool");
-    }
+    uploadPool = createUploadPool(mainDevice.logicalDevice, queueFamilyIndices.graphicsFamily);
 }
 
 void VulkanRenderer::createCommandBuffers()
 {
-    commandBuffers.resize(swapchainFramebuffers.size());
+    //One per frame slot, not per swapchain image. A slot's buffer is only re-recorded after its fence signalled.
+    //Everything recorded fresh each frame comes from the slot's transient pool, which is reset in one call instead
+    //of every buffer resetting itself, so its buffers don't need VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT
+    QueueFamilyIndices queueFamilyIndices = getQueueFamiles(mainDevice.physicalDevice);
+
+    VkCommandPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily;
 
     VkCommandBufferAllocateInfo cbAllocInfo = {};
     cbAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cbAllocInfo.commandPool = graphicsCommandPool;
-    cbAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cbAllocInfo.commandBufferCount = static_cast<uint32_t>(commandBuffers.size());
+    cbAllocInfo.commandBufferCount = 1;
 
-    VkResult result =  vkAllocateCommandBuffers(mainDevice.logicalDevice, &cbAllocInfo, commandBuffers.data());
-    if (result != VK_SUCCESS)
+    VkResult result;
+    frameCommandPools.resize(MAX_FRAME_DRAWS);
+    commandBuffers.resize(MAX_FRAME_DRAWS);
+    blendCommandBuffers.resize(MAX_FRAME_DRAWS);
+    for (size_t i = 0; i < frameCommandPools.size(); i++)
     {
-        throw std::runtime_error("Failed to allacote Command Buffers!");
+        result = vkCreateCommandPool(mainDevice.logicalDevice, &poolInfo, nullptr, &frameCommandPools[i]);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create frame command pool");
+        }
+
+        cbAllocInfo.commandPool = frameCommandPools[i];
+        cbAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        result = vkAllocateCommandBuffers(mainDevice.logicalDevice, &cbAllocInfo, &commandBuffers[i]);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allacote Command Buffers!");
+        }
+
+        //Blended draws depend on the camera, so they are re-recorded every frame as well
+        cbAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        result = vkAllocateCommandBuffers(mainDevice.logicalDevice, &cbAllocInfo, &blendCommandBuffers[i]);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allacote blend Command Buffers!");
+        }
+    }
+
+    //Scene draws of each slot, recorded once and executed from the primary until the scene changes.
+    //One pool per chunk, a pool can only be used by one thread at a time and is reset as a whole before re-recording
+    poolInfo.flags = 0;
+
+    sceneCommandPools.resize(MAX_FRAME_DRAWS * MAX_RECORD_THREADS);
+    sceneCommandBuffers.resize(MAX_FRAME_DRAWS * MAX_RECORD_THREADS);
+    prepassCommandBuffers.resize(MAX_FRAME_DRAWS * MAX_RECORD_THREADS);
+    for (size_t i = 0; i < sceneCommandPools.size(); i++)
+    {
+        result = vkCreateCommandPool(mainDevice.logicalDevice, &poolInfo, nullptr, &sceneCommandPools[i]);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create scene command pool");
+        }
+
+        cbAllocInfo.commandPool = sceneCommandPools[i];
+        cbAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        cbAllocInfo.commandBufferCount = 1;
+
+        result = vkAllocateCommandBuffers(mainDevice.logicalDevice, &cbAllocInfo, &sceneCommandBuffers[i]);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allacote scene Command Buffers!");
+        }
+        result = vkAllocateCommandBuffers(mainDevice.logicalDevice, &cbAllocInfo, &prepassCommandBuffers[i]);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to allacote pre-pass Command Buffers!");
+        }
     }
+
+    //Version 0 is never current, so every slot records on its first frame
+    recordedSceneVersions.assign(MAX_FRAME_DRAWS, 0);
+    uploadedMatricesVersions.assign(MAX_FRAME_DRAWS, 0);
+    recordedSceneInfos.assign(MAX_FRAME_DRAWS, SceneRecordInfo());
+    recordedChunkCounts.assign(MAX_FRAME_DRAWS, 0);
+
+    //Calling thread is one of the recording threads
+    unsigned int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+    recordWorkers.start(std::min(hardwareThreads, static_cast<unsigned int>(MAX_RECORD_THREADS)));
+    recordThreads = static_cast<int>(recordWorkers.getThreadCount());
 }
 
 void VulkanRenderer::createSynchronisation()
 {
+    //Frame timeline, starts at 0 and every submitted frame moves it one up
+    VkSemaphoreTypeCreateInfo timelineCreateInfo = {};
+    timelineCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    timelineCreateInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    timelineCreateInfo.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphoreCreateInfo = {};
+    semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreCreateInfo.pNext = &timelineCreateInfo;
+
+    if (vkCreateSemaphore(mainDevice.logicalDevice, &semaphoreCreateInfo, nullptr, &frameTimeline) != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create frame timeline semaphore!");
+    }
+
+    //Binary ones for acquire
+    semaphoreCreateInfo.pNext = nullptr;
     imageAvailable.resize(MAX_FRAME_DRAWS);
-    renderFinished.resize(MAX_FRAME_DRAWS);
-    drawFences.resize(MAX_FRAME_DRAWS);
+    for (size_t i = 0; i < MAX_FRAME_DRAWS; i++)
+    {
+        if (vkCreateSemaphore(mainDevice.logicalDevice, &semaphoreCreateInfo, nullptr, &imageAvailable[i]) != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to create at least one semaphore!");
+        }
+    }
 
-    VkFenceCreateInfo fenceCreateInfo = {};
-    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    createPresentSemaphores();
+}
+
+void VulkanRenderer::createPresentSemaphores()
+{
+    //Nothing is presented when headless
+    if (headless) { return; }
+
+    for (size_t i = 0; i < renderFinished.size(); i++)
+    {
+        vkDestroySemaphore(mainDevice.logicalDevice, renderFinished[i], nullptr);
+    }
+    renderFinished.resize(swapchainImages.size());
 
     VkSemaphoreCreateInfo semaphoreCreateInfo = {};
     semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-    for (size_t i = 0; i < MAX_FRAME_DRAWS; i++)
+    for (size_t i = 0; i < renderFinished.size(); i++)
     {
-        if (vkCreateSemaphore(mainDevice.logicalDevice, &semaphoreCreateInfo, nullptr, &imageAvailable[i]) != VK_SUCCESS ||
-            vkCreateSemaphore(mainDevice.logicalDevice, &semaphoreCreateInfo, nullptr, &renderFinished[i]) ||
-            vkCreateFence(mainDevice.logicalDevice,&fenceCreateInfo,nullptr, &drawFences[i]))
+        if (vkCreateSemaphore(mainDevice.logicalDevice, &semaphoreCreateInfo, nullptr, &renderFinished[i]) != VK_SUCCESS)
         {
-            throw std::runtime_error("Failed to create at least one semaphore and/or Fence!");
+            throw std::runtime_error("Failed to create at least one semaphore!");
         }
     }
 }
 
+void VulkanRenderer::createTimestampQueries()
+{
+    timestampsWritten.assign(MAX_FRAME_DRAWS, false);
+    timedModelCounts.assign(MAX_FRAME_DRAWS, 0);
+    queriedModelIDs.assign(MAX_FRAME_DRAWS, std::vector<int>());
+
+    //Not every queue can write timestamps, leave the pool out if the graphics one can't
+    QueueFamilyIndices indices = getQueueFamiles(mainDevice.physicalDevice);
+
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(mainDevice.physicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilyList(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(mainDevice.physicalDevice, &queueFamilyCount, queueFamilyList.data());
+
+    if (queueFamilyList[indices.graphicsFamily].timestampValidBits == 0)
+    {
+        return;
+    }
+
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(mainDevice.physicalDevice, &deviceProperties);
+    timestampPeriod = deviceProperties.limits.timestampPeriod;
+
+    //Frame, main pass and per model timestamps for each frame in flight
+    VkQueryPoolCreateInfo queryPoolCreateInfo = {};
+    queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolCreateInfo.queryCount = MAX_FRAME_DRAWS * TIMESTAMPS_PER_FRAME;
+
+    VkResult result = vkCreateQueryPool(mainDevice.logicalDevice, &queryPoolCreateInfo, nullptr, &timestampQueryPool);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create timestamp query pool");
+    }
+}
+
+void VulkanRenderer::createPipelineStatisticsQueries()
+{
+    statisticsModelCounts.assign(MAX_FRAME_DRAWS, 0);
+
+    if (!pipelineStatisticsSupported)
+    {
+        return;
+    }
+
+    //Results come back in flag bit order: vertex invocations, clipping primitives, fragment invocations
+    VkQueryPoolCreateInfo queryPoolCreateInfo = {};
+    queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolCreateInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    queryPoolCreateInfo.queryCount = MAX_FRAME_DRAWS * MAX_TIMED_MODELS;
+    queryPoolCreateInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+                                             VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+                                             VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+    VkResult result = vkCreateQueryPool(mainDevice.logicalDevice, &queryPoolCreateInfo, nullptr, &pipelineStatisticsQueryPool);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create pipeline statistics query pool");
+    }
+}
+
 void VulkanRenderer::createTextureSampler()
 {
     VkSamplerCreateInfo samplerCreateInfo = {};
@@ -875,26 +1647,370 @@ void VulkanRenderer::createTextureSampler()
 
 void VulkanRenderer::createUniformBuffers()
 {
-    //View projection buffer size
-    VkDeviceSize vpBufferSize = sizeof(UBOViewProjection);
+    //A segment per frame slot, the segment being written is never one the GPU is still reading
+    uniformRing.create(&deviceAllocator, UNIFORM_RING_SEGMENT_SIZE, MAX_FRAME_DRAWS, minUniformBufferOffset);
+
+    //Model matrices per frame slot, kept mapped since they are rewritten whenever a model moves
+    VkDeviceSize modelBufferSize = sizeof(glm::mat4) * MAX_TRANSFORMS;
+    modelStorageBuffer.resize(MAX_FRAME_DRAWS);
+    modelStorageBufferMemory.resize(MAX_FRAME_DRAWS);
+    modelStorageMapped.resize(MAX_FRAME_DRAWS);
+
+    for (size_t i = 0; i < MAX_FRAME_DRAWS; i++)
+    {
+        createBuffer(&deviceAllocator, modelBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &modelStorageBuffer[i], &modelStorageBufferMemory[i]);
+        modelStorageMapped[i] = modelStorageBufferMemory[i].mapped;
+    }
+}
+
+void VulkanRenderer::createIndirectBuffers()
+{
+    //Draw commands of each frame slot, written when the slot's scene commands are recorded
+    VkDeviceSize indirectBufferSize = sizeof(VkDrawIndexedIndirectCommand) * MAX_INDIRECT_DRAWS;
+    indirectBuffers.resize(MAX_FRAME_DRAWS);
+    indirectBuffersMemory.resize(MAX_FRAME_DRAWS);
+    indirectMapped.resize(MAX_FRAME_DRAWS);
 
-    //ModelBufferSize
-    //VkDeviceSize modelBufferSize = modelUniformAllignment * MAX_OBJECTS;
+    for (size_t i = 0; i < MAX_FRAME_DRAWS; i++)
+    {
+        createBuffer(&deviceAllocator, indirectBufferSize, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &indirectBuffers[i], &indirectBuffersMemory[i]);
+        indirectMapped[i] = indirectBuffersMemory[i].mapped;
+    }
+}
 
-    vpUniformBuffer.resize(swapchainImages.size());
-    vpUniformBufferMemory.resize(swapchainImages.size());
-    //modelDynamicUniformBuffer.resize(swapchainImages.size());
-    //modelDynamicUniformBufferMemory.resize(swapchainImages.size());
+void VulkanRenderer::createCullResources()
+{
+    culledRecordCounts.assign(MAX_FRAME_DRAWS, 0);
+    culledSkippedCounts.assign(MAX_FRAME_DRAWS, 0);
+    if (!gpuCullingSupported)
+    {
+        return;
+    }
+
+    //Records and counts per frame slot. Counts are host visible so the stat counters can be read back
+    VkDeviceSize recordBufferSize = sizeof(CullRecord) * MAX_INDIRECT_DRAWS;
+    VkDeviceSize countBufferSize = sizeof(uint32_t) * (MAX_INDIRECT_DRAWS + CULL_STAT_COUNT);
+    VkDeviceSize flagBufferSize = sizeof(uint32_t) * MAX_INDIRECT_DRAWS;
+    cullRecordBuffers.resize(MAX_FRAME_DRAWS);
+    cullRecordBuffersMemory.resize(MAX_FRAME_DRAWS);
+    cullRecordMapped.resize(MAX_FRAME_DRAWS);
+    drawCountBuffers.resize(MAX_FRAME_DRAWS);
+    drawCountBuffersMemory.resize(MAX_FRAME_DRAWS);
+    drawCountMapped.resize(MAX_FRAME_DRAWS);
+    occlusionFlagBuffers.resize(MAX_FRAME_DRAWS);
+    occlusionFlagBuffersMemory.resize(MAX_FRAME_DRAWS);
 
-    for (size_t i = 0; i < swapchainImages.size(); i++)
+    for (size_t i = 0; i < MAX_FRAME_DRAWS; i++)
     {
-        createBuffer(mainDevice.physicalDevice, mainDevice.logicalDevice, vpBufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+        createBuffer(&deviceAllocator, recordBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &cullRecordBuffers[i], &cullRecordBuffersMemory[i]);
+        cullRecordMapped[i] = cullRecordBuffersMemory[i].mapped;
+
+        createBuffer(&deviceAllocator, countBufferSize,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-            &vpUniformBuffer[i], &vpUniformBufferMemory[i]);
-        //createBuffer(mainDevice.physicalDevice, mainDevice.logicalDevice, modelBufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        //    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        //    &modelDynamicUniformBuffer[i], &modelDynamicUniformBufferMemory[i]);
+            &drawCountBuffers[i], &drawCountBuffersMemory[i]);
+        drawCountMapped[i] = drawCountBuffersMemory[i].mapped;
+
+        //Only the GPU touches the flags, the early cull writes them and the late one reads them
+        createBuffer(&deviceAllocator, flagBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &occlusionFlagBuffers[i], &occlusionFlagBuffersMemory[i]);
+    }
+
+    //View projection, model matrices, records, draw commands, draw counts, depth pyramid, occlusion flags.
+    //Same order as the bindings in cull.comp
+    std::array<VkDescriptorSetLayoutBinding, 7> layoutBindings = {};
+    for (uint32_t i = 0; i < layoutBindings.size(); i++)
+    {
+        layoutBindings[i].binding = i;
+        layoutBindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC :
+            i == 5 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layoutBindings[i].descriptorCount = 1;
+        layoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        layoutBindings[i].pImmutableSamplers = nullptr;
+    }
+
+    VkDescriptorSetLayoutCreateInfo layoutCreateInfo = {};
+    layoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutCreateInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
+    layoutCreateInfo.pBindings = layoutBindings.data();
+
+    VkResult result = vkCreateDescriptorSetLayout(mainDevice.logicalDevice, &layoutCreateInfo, nullptr, &cullSetLayout);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create the cull descriptor set layout");
+    }
+
+    std::array<VkDescriptorPoolSize, 3> poolSizes = {};
+    poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    poolSizes[0].descriptorCount = MAX_FRAME_DRAWS;
+    poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    poolSizes[1].descriptorCount = 5 * MAX_FRAME_DRAWS;
+    poolSizes[2].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    poolSizes[2].descriptorCount = MAX_FRAME_DRAWS;
+
+    VkDescriptorPoolCreateInfo poolCreateInfo = {};
+    poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolCreateInfo.maxSets = MAX_FRAME_DRAWS;
+    poolCreateInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+    poolCreateInfo.pPoolSizes = poolSizes.data();
+
+    result = vkCreateDescriptorPool(mainDevice.logicalDevice, &poolCreateInfo, nullptr, &cullDescriptorPool);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create the cull Descriptor Pool");
+    }
+
+    std::vector<VkDescriptorSetLayout> setLayouts(MAX_FRAME_DRAWS, cullSetLayout);
+    VkDescriptorSetAllocateInfo setAllocateInfo = {};
+    setAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    setAllocateInfo.descriptorPool = cullDescriptorPool;
+    setAllocateInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAME_DRAWS);
+    setAllocateInfo.pSetLayouts = setLayouts.data();
+
+    cullDescriptorSets.resize(MAX_FRAME_DRAWS);
+    result = vkAllocateDescriptorSets(mainDevice.logicalDevice, &setAllocateInfo, cullDescriptorSets.data());
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to allocate cull Descriptor Sets");
+    }
+
+    //The depth pyramid is written by createHizPyramid, it changes with the swapchain
+    for (size_t i = 0; i < MAX_FRAME_DRAWS; i++)
+    {
+        std::array<VkDescriptorBufferInfo, 6> bufferInfos = {};
+        bufferInfos[0] = { uniformRing.getBuffer(), 0, sizeof(UBOViewProjection) };
+        bufferInfos[1] = { modelStorageBuffer[i], 0, VK_WHOLE_SIZE };
+        bufferInfos[2] = { cullRecordBuffers[i], 0, VK_WHOLE_SIZE };
+        bufferInfos[3] = { indirectBuffers[i], 0, VK_WHOLE_SIZE };
+        bufferInfos[4] = { drawCountBuffers[i], 0, VK_WHOLE_SIZE };
+        bufferInfos[5] = { occlusionFlagBuffers[i], 0, VK_WHOLE_SIZE };
+
+        std::array<VkWriteDescriptorSet, 6> setWrites = {};
+        for (uint32_t j = 0; j < setWrites.size(); j++)
+        {
+            uint32_t binding = j < 5 ? j : 6;
+            setWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            setWrites[j].dstSet = cullDescriptorSets[i];
+            setWrites[j].dstBinding = binding;
+            setWrites[j].dstArrayElement = 0;
+            setWrites[j].descriptorType = layoutBindings[binding].descriptorType;
+            setWrites[j].descriptorCount = 1;
+            setWrites[j].pBufferInfo = &bufferInfos[j];
+        }
+
+        vkUpdateDescriptorSets(mainDevice.logicalDevice, static_cast<uint32_t>(setWrites.size()), setWrites.data(), 0, nullptr);
+    }
+
+    VkPushConstantRange cullPushRange = {};
+    cullPushRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    cullPushRange.offset = 0;
+    cullPushRange.size = sizeof(CullPushConstants);
+
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
+    pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutCreateInfo.setLayoutCount = 1;
+    pipelineLayoutCreateInfo.pSetLayouts = &cullSetLayout;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+    pipelineLayoutCreateInfo.pPushConstantRanges = &cullPushRange;
+
+    result = vkCreatePipelineLayout(mainDevice.logicalDevice, &pipelineLayoutCreateInfo, nullptr, &cullPipelineLayout);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create the cull Pipeline Layout");
+    }
+
+    auto cullShaderCode = readFile("Shaders/cull.spv");
+    VkShaderModule cullShaderModule = createShaderModule(cullShaderCode);
+
+    VkComputePipelineCreateInfo pipelineCreateInfo = {};
+    pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineCreateInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineCreateInfo.stage.module = cullShaderModule;
+    pipelineCreateInfo.stage.pName = "main";
+    pipelineCreateInfo.layout = cullPipelineLayout;
+
+    result = vkCreateComputePipelines(mainDevice.logicalDevice, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr, &cullPipeline);
+    vkDestroyShaderModule(mainDevice.logicalDevice, cullShaderModule, nullptr);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create the cull Pipeline");
+    }
+
+    //Hi-Z build, one dispatch per pyramid level reading the depth buffer or the level before
+    std::array<VkDescriptorSetLayoutBinding, 2> hizBindings = {};
+    hizBindings[0].binding = 0;
+    hizBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    hizBindings[0].descriptorCount = 1;
+    hizBindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    hizBindings[1].binding = 1;
+    hizBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    hizBindings[1].descriptorCount = 1;
+    hizBindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    layoutCreateInfo.bindingCount = static_cast<uint32_t>(hizBindings.size());
+    layoutCreateInfo.pBindings = hizBindings.data();
+    result = vkCreateDescriptorSetLayout(mainDevice.logicalDevice, &layoutCreateInfo, nullptr, &hizSetLayout);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create the Hi-Z descriptor set layout");
+    }
+
+    //Sets are allocated again whenever the pyramid is, so the pool gets reset
+    std::array<VkDescriptorPoolSize, 2> hizPoolSizes = {};
+    hizPoolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    hizPoolSizes[0].descriptorCount = MAX_HIZ_LEVELS;
+    hizPoolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    hizPoolSizes[1].descriptorCount = MAX_HIZ_LEVELS;
+
+    poolCreateInfo.maxSets = MAX_HIZ_LEVELS;
+    poolCreateInfo.poolSizeCount = static_cast<uint32_t>(hizPoolSizes.size());
+    poolCreateInfo.pPoolSizes = hizPoolSizes.data();
+    result = vkCreateDescriptorPool(mainDevice.logicalDevice, &poolCreateInfo, nullptr, &hizDescriptorPool);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create the Hi-Z Descriptor Pool");
+    }
+
+    pipelineLayoutCreateInfo.pSetLayouts = &hizSetLayout;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 0;
+    pipelineLayoutCreateInfo.pPushConstantRanges = nullptr;
+    result = vkCreatePipelineLayout(mainDevice.logicalDevice, &pipelineLayoutCreateInfo, nullptr, &hizPipelineLayout);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create the Hi-Z Pipeline Layout");
+    }
+
+    auto hizShaderCode = readFile("Shaders/hiz.spv");
+    VkShaderModule hizShaderModule = createShaderModule(hizShaderCode);
+    pipelineCreateInfo.stage.module = hizShaderModule;
+    pipelineCreateInfo.layout = hizPipelineLayout;
+
+    result = vkCreateComputePipelines(mainDevice.logicalDevice, VK_NULL_HANDLE, 1, &pipelineCreateInfo, nullptr, &hizPipeline);
+    vkDestroyShaderModule(mainDevice.logicalDevice, hizShaderModule, nullptr);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to create the Hi-Z Pipeline");
+    }
+
+    createHizPyramid();
+}
+
+void VulkanRenderer::createHizPyramid()
+{
+    //Largest power of two that fits in the depth buffer, every level halves it down to 1x1
+    hizExtent.width = 1;
+    while (hizExtent.width * 2 <= swapChainExtent.width) { hizExtent.width *= 2; }
+    hizExtent.height = 1;
+    while (hizExtent.height * 2 <= swapChainExtent.height) { hizExtent.height *= 2; }
+    uint32_t levels = 1;
+    while ((std::max(hizExtent.width, hizExtent.height) >> levels) > 0) { levels++; }
+    levels = std::min(levels, MAX_HIZ_LEVELS);
+
+    hizImage = createImage(hizExtent.width, hizExtent.height, VK_FORMAT_R32_SFLOAT, VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &hizImageMemory, levels);
+    hizImageView = createImageView(hizImage, VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, 0, levels);
+    hizLevelViews.resize(levels);
+    for (uint32_t i = 0; i < levels; i++)
+    {
+        hizLevelViews[i] = createImageView(hizImage, VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, i, 1);
+    }
+
+    //Stays in the general layout for good, written as storage and read with texelFetch
+    VkCommandBuffer commandBuffer = beginCommandBuffer(mainDevice.logicalDevice, uploadPool);
+    VkImageMemoryBarrier layoutBarrier = {};
+    layoutBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    layoutBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    layoutBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    layoutBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    layoutBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    layoutBarrier.image = hizImage;
+    layoutBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, levels, 0, 1 };
+    layoutBarrier.srcAccessMask = 0;
+    layoutBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+        0, nullptr, 0, nullptr, 1, &layoutBarrier);
+    endAndSubmitCommandBuffer(mainDevice.logicalDevice, uploadPool, graphicsQueue, commandBuffer);
+
+    //texelFetch ignores the sampler's filtering and LOD range, the texture one will do
+    VkDescriptorImageInfo pyramidInfo = { textureSampler, hizImageView, VK_IMAGE_LAYOUT_GENERAL };
+    for (size_t i = 0; i < MAX_FRAME_DRAWS; i++)
+    {
+        VkWriteDescriptorSet pyramidWrite = {};
+        pyramidWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        pyramidWrite.dstSet = cullDescriptorSets[i];
+        pyramidWrite.dstBinding = 5;
+        pyramidWrite.dstArrayElement = 0;
+        pyramidWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        pyramidWrite.descriptorCount = 1;
+        pyramidWrite.pImageInfo = &pyramidInfo;
+        vkUpdateDescriptorSets(mainDevice.logicalDevice, 1, &pyramidWrite, 0, nullptr);
+    }
+
+    //Nothing has been drawn into it yet
+    hizValid = false;
+    if (!occlusionCullingSupported)
+    {
+        return;
+    }
+
+    std::vector<VkDescriptorSetLayout> setLayouts(levels, hizSetLayout);
+    VkDescriptorSetAllocateInfo setAllocateInfo = {};
+    setAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    setAllocateInfo.descriptorPool = hizDescriptorPool;
+    setAllocateInfo.descriptorSetCount = levels;
+    setAllocateInfo.pSetLayouts = setLayouts.data();
+
+    hizDescriptorSets.resize(levels);
+    VkResult result = vkAllocateDescriptorSets(mainDevice.logicalDevice, &setAllocateInfo, hizDescriptorSets.data());
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to allocate Hi-Z Descriptor Sets");
+    }
+
+    for (uint32_t i = 0; i < levels; i++)
+    {
+        VkDescriptorImageInfo sourceInfo = i == 0 ?
+            VkDescriptorImageInfo{ textureSampler, depthBufferImageView, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL } :
+            VkDescriptorImageInfo{ textureSampler, hizLevelViews[i - 1], VK_IMAGE_LAYOUT_GENERAL };
+        VkDescriptorImageInfo destinationInfo = { VK_NULL_HANDLE, hizLevelViews[i], VK_IMAGE_LAYOUT_GENERAL };
+
+        std::array<VkWriteDescriptorSet, 2> setWrites = {};
+        for (uint32_t j = 0; j < setWrites.size(); j++)
+        {
+            setWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            setWrites[j].dstSet = hizDescriptorSets[i];
+            setWrites[j].dstBinding = j;
+            setWrites[j].dstArrayElement = 0;
+            setWrites[j].descriptorCount = 1;
+        }
+        setWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        setWrites[0].pImageInfo = &sourceInfo;
+        setWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        setWrites[1].pImageInfo = &destinationInfo;
+
+        vkUpdateDescriptorSets(mainDevice.logicalDevice, static_cast<uint32_t>(setWrites.size()), setWrites.data(), 0, nullptr);
+    }
+}
+
+void VulkanRenderer::destroyHizPyramid()
+{
+    vkResetDescriptorPool(mainDevice.logicalDevice, hizDescriptorPool, 0);
+    hizDescriptorSets.clear();
+    for (VkImageView levelView : hizLevelViews)
+    {
+        vkDestroyImageView(mainDevice.logicalDevice, levelView, nullptr);
     }
+    hizLevelViews.clear();
+    vkDestroyImageView(mainDevice.logicalDevice, hizImageView, nullptr);
+    vkDestroyImage(mainDevice.logicalDevice, hizImage, nullptr);
+    deviceAllocator.free(hizImageMemory);
 }
 
 void VulkanRenderer::createDescriptorPool()
@@ -902,19 +2018,19 @@ void VulkanRenderer::createDescriptorPool()
     //Create Unifor Descriptor Pool
     //ViewProjeciton Pool
     VkDescriptorPoolSize vpPoolSize = {};
-    vpPoolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    vpPoolSize.descriptorCount = static_cast<uint32_t>(vpUniformBuffer.size());
+    vpPoolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    vpPoolSize.descriptorCount = static_cast<uint32_t>(MAX_FRAME_DRAWS);
 
-    ////Model Projection Pool
-    //VkDescriptorPoolSize modelPoolSize = {};
-    //modelPoolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-    //modelPoolSize.descriptorCount = static_cast<uint32_t>(modelDynamicUniformBuffer.size());
+    //Model matrices Pool
+    VkDescriptorPoolSize modelPoolSize = {};
+    modelPoolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    modelPoolSize.descriptorCount = static_cast<uint32_t>(modelStorageBuffer.size());
 
-    std::vector<VkDescriptorPoolSize> poolSizeList = { vpPoolSize };
+    std::vector<VkDescriptorPoolSize> poolSizeList = { vpPoolSize, modelPoolSize };
 
     VkDescriptorPoolCreateInfo poolCreateInfo = {};
     poolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    poolCreateInfo.maxSets = static_cast<uint32_t> (swapchainImages.size());
+    poolCreateInfo.maxSets = static_cast<uint32_t> (MAX_FRAME_DRAWS);
     poolCreateInfo.poolSizeCount = static_cast<uint32_t> (poolSizeList.size());
     poolCreateInfo.pPoolSizes = poolSizeList.data();
 
@@ -929,11 +2045,11 @@ void VulkanRenderer::createDescriptorPool()
     VkDescriptorPoolSize samplerPoolSize = {};
     samplerPoolSize.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER; //Separate this later
     //Since I'm creating the images and the descriptor sets at the same time, I'm assuming there will be one texture for each objects which is not optimal way to do this
-    samplerPoolSize.descriptorCount = MAX_OBJECTS; 
+    samplerPoolSize.descriptorCount = MAX_TEXTURES; 
 
     VkDescriptorPoolCreateInfo samplerPoolCreateInfo = {};
     samplerPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    samplerPoolCreateInfo.maxSets = MAX_OBJECTS;
+    samplerPoolCreateInfo.maxSets = MAX_TEXTURES;
     samplerPoolCreateInfo.poolSizeCount = 1;
     samplerPoolCreateInfo.pPoolSizes = &samplerPoolSize;
 
@@ -947,14 +2063,14 @@ void VulkanRenderer::createDescriptorPool()
 
 void VulkanRenderer::createDescriptorSets()
 {
-    descriptorSets.resize(swapchainImages.size());
+    descriptorSets.resize(MAX_FRAME_DRAWS);
 
-    std::vector<VkDescriptorSetLayout> setLayouts(swapchainImages.size(),descriptorSetLayout);
+    std::vector<VkDescriptorSetLayout> setLayouts(MAX_FRAME_DRAWS,descriptorSetLayout);
 
     VkDescriptorSetAllocateInfo setAllocateInfo = {};
     setAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     setAllocateInfo.descriptorPool = descriptorPool;
-    setAllocateInfo.descriptorSetCount = static_cast<uint32_t>(swapchainImages.size());
+    setAllocateInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAME_DRAWS);
     setAllocateInfo.pSetLayouts = setLayouts.data();
 
     VkResult result = vkAllocateDescriptorSets(mainDevice.logicalDevice, &setAllocateInfo, descriptorSets.data());
@@ -965,9 +2081,9 @@ void VulkanRenderer::createDescriptorSets()
 
     for (size_t i = 0; i < descriptorSets.size(); i++)
     {
-        //View Projeciton Buffer info and data offset info
+        //View Projeciton Buffer info, where in the ring comes from the dynamic offset
         VkDescriptorBufferInfo vpBufferInfo = {};
-        vpBufferInfo.buffer = vpUniformBuffer[i];
+        vpBufferInfo.buffer = uniformRing.getBuffer();
         vpBufferInfo.offset = 0;
         vpBufferInfo.range = sizeof(UBOViewProjection);
 
@@ -977,27 +2093,27 @@ void VulkanRenderer::createDescriptorSets()
         vpSetWrite.dstSet = descriptorSets[i];
         vpSetWrite.dstBinding = 0;
         vpSetWrite.dstArrayElement = 0;
-        vpSetWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        vpSetWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
         vpSetWrite.descriptorCount = 1;
         vpSetWrite.pBufferInfo = &vpBufferInfo;
 
 
-        //Model Projeciton Buffer info and data offset info
-        //VkDescriptorBufferInfo modelBufferInfo = {};
-        //modelBufferInfo.buffer = modelDynamicUniformBuffer[i];
-        //modelBufferInfo.offset = 0;
-        //modelBufferInfo.range = modelUniformAllignment; // this is dynamic it's gonna start from 0 and jump to the model block size
+        //Model matrices Buffer info and data offset info
+        VkDescriptorBufferInfo modelBufferInfo = {};
+        modelBufferInfo.buffer = modelStorageBuffer[i];
+        modelBufferInfo.offset = 0;
+        modelBufferInfo.range = VK_WHOLE_SIZE;
 
-        //VkWriteDescriptorSet modelSetWrite = {};
-        //modelSetWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        //modelSetWrite.dstSet = descriptorSets[i];
-        //modelSetWrite.dstBinding = 1;
-        //modelSetWrite.dstArrayElement = 0;
-        //modelSetWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-        //modelSetWrite.descriptorCount = 1;
-        //modelSetWrite.pBufferInfo = &modelBufferInfo;
+        VkWriteDescriptorSet modelSetWrite = {};
+        modelSetWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        modelSetWrite.dstSet = descriptorSets[i];
+        modelSetWrite.dstBinding = 1;
+        modelSetWrite.dstArrayElement = 0;
+        modelSetWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        modelSetWrite.descriptorCount = 1;
+        modelSetWrite.pBufferInfo = &modelBufferInfo;
 
-        std::vector<VkWriteDescriptorSet> descriptorSets = { vpSetWrite  };
+        std::vector<VkWriteDescriptorSet> descriptorSets = { vpSetWrite, modelSetWrite };
 
         vkUpdateDescriptorSets(mainDevice.logicalDevice, static_cast<uint32_t>(descriptorSets.size()), descriptorSets.data(),
                                0, nullptr);
@@ -1005,31 +2121,197 @@ void VulkanRenderer::createDescriptorSets()
 
 }
 
-void VulkanRenderer::updateUniformBuffers(uint32_t imageIndex)
+void VulkanRenderer::updateUniformBuffers()
+{
+    //Copy VP Data, first in the frame's ring segment
+    vpAllocation = uniformRing.allocate(sizeof(UBOViewProjection));
+    memcpy(vpAllocation.data, &uboViewProjection, sizeof(UBOViewProjection));
+
+    frameStats.bytesUploaded += sizeof(UBOViewProjection);
+
+    //Model matrices, only when one changed since this slot's buffer was last written
+    if (uploadedMatricesVersions[currentFrame] != modelMatricesVersion)
+    {
+        memcpy(modelStorageMapped[currentFrame], modelMatrices.data(), sizeof(glm::mat4) * modelMatrices.size());
+        frameStats.bytesUploaded += sizeof(glm::mat4) * modelMatrices.size();
+        uploadedMatricesVersions[currentFrame] = modelMatricesVersion;
+    }
+}
+
+void VulkanRenderer::collectFrameTimings()
+{
+    if (timestampQueryPool == VK_NULL_HANDLE || !timestampsWritten[currentFrame])
+    {
+        return;
+    }
+
+    //Only the queries the slot's last frame wrote, the model ones after it were never reset
+    uint32_t queryCount = TIMESTAMP_FIRST_MODEL + 2 * timedModelCounts[currentFrame];
+    std::vector<uint64_t> timestamps(queryCount);
+    VkResult result = vkGetQueryPoolResults(mainDevice.logicalDevice, timestampQueryPool, currentFrame * TIMESTAMPS_PER_FRAME, queryCount,
+        timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (result != VK_SUCCESS)
+    {
+        return;
+    }
+
+    auto ticksToMs = [this](uint64_t begin, uint64_t end) {
+        return static_cast<double>(end - begin) * timestampPeriod / 1000000.0;
+    };
+
+    frameStats.gpuStatsFrame = frameSlotValues[currentFrame];
+    frameStats.gpuFrameMs = ticksToMs(timestamps[TIMESTAMP_FRAME_BEGIN], timestamps[TIMESTAMP_FRAME_END]);
+    frameStats.gpuMainPassMs = ticksToMs(timestamps[TIMESTAMP_MAIN_PASS_BEGIN], timestamps[TIMESTAMP_MAIN_PASS_END]);
+
+    //Queries are by position in modelList when the frame was recorded, the stats by model ID
+    const std::vector<int>& queriedIDs = queriedModelIDs[currentFrame];
+    frameStats.gpuModelMs.assign(modelSlots.size(), -1.0);
+    for (size_t j = 0; j < timedModelCounts[currentFrame] && j < queriedIDs.size(); j++)
+    {
+        uint32_t query = TIMESTAMP_FIRST_MODEL + 2 * static_cast<uint32_t>(j);
+        frameStats.gpuModelMs[queriedIDs[j]] = ticksToMs(timestamps[query], timestamps[query + 1]);
+    }
+}
+
+void VulkanRenderer::collectPipelineStatistics()
+{
+    uint32_t modelCount = statisticsModelCounts[currentFrame];
+    statisticsModelCounts[currentFrame] = 0;
+    if (modelCount == 0 || !pipelineStatisticsEnabled)
+    {
+        return;
+    }
+
+    std::vector<uint64_t> results(modelCount * 3);
+    VkResult result = vkGetQueryPoolResults(mainDevice.logicalDevice, pipelineStatisticsQueryPool, currentFrame * MAX_TIMED_MODELS, modelCount,
+        results.size() * sizeof(uint64_t), results.data(), 3 * sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if (result != VK_SUCCESS)
+    {
+        return;
+    }
+
+    const std::vector<int>& queriedIDs = queriedModelIDs[currentFrame];
+    frameStats.modelPipelineStats.assign(modelSlots.size(), ModelPipelineStats());
+    for (size_t j = 0; j < modelCount && j < queriedIDs.size(); j++)
+    {
+        ModelPipelineStats& stats = frameStats.modelPipelineStats[queriedIDs[j]];
+        stats.vertexInvocations = results[j * 3];
+        stats.clippingPrimitives = results[j * 3 + 1];
+        stats.fragmentInvocations = results[j * 3 + 2];
+    }
+}
+
+void VulkanRenderer::collectCullResults()
 {
-    //Copy VP Data
-    void* data;
-    vkMapMemory(mainDevice.logicalDevice, vpUniformBufferMemory[imageIndex], 0, sizeof(UBOViewProjection), 0, &data);
-    memcpy(data, &uboViewProjection, sizeof(UBOViewProjection));
-    vkUnmapMemory(mainDevice.logicalDevice, vpUniformBufferMemory[imageIndex]);
+    uint32_t recordCount = culledRecordCounts[currentFrame];
+    if (recordCount == 0)
+    {
+        return;
+    }
 
-    //For dynamic uniform Buffers
-    //Copy Model Data 
-    //for (size_t i = 0; i < meshList.size(); i++)
-    //{
-    //    UBOModel* model = (UBOModel*)((uint32_t)modelTransferSpace + (i * modelUniformAllignment));
-    //    *model = meshList[i].getModel();
-    //}
+    //Slot's last frame is done, its counters are final. Without occlusion culling only the early one is used
+    const uint32_t* counters = static_cast<uint32_t*>(drawCountMapped[currentFrame]) + MAX_INDIRECT_DRAWS;
+    uint32_t lateVisible = counters[CULL_STAT_LATE_VISIBLE];
+    uint32_t visible = counters[CULL_STAT_EARLY_VISIBLE] + lateVisible;
+    frameStats.gpuVisibleDraws = visible;
+    frameStats.gpuCulledDraws = recordCount - culledSkippedCounts[currentFrame] - visible;
+    frameStats.gpuOccludedDraws = counters[CULL_STAT_OCCLUDED] - lateVisible;
+    frameStats.gpuLateDraws = lateVisible;
+}
+
+void VulkanRenderer::recordCull(uint32_t recordCount, uint32_t phase, bool occlusion)
+{
+    VkCommandBuffer commandBuffer = commandBuffers[currentFrame];
+
+    //Every batch starts empty, the stat counters only once a frame since the late phase adds to them
+    uint32_t clearedCounts = phase == CULL_PHASE_EARLY ? MAX_INDIRECT_DRAWS + CULL_STAT_COUNT : MAX_INDIRECT_DRAWS;
+    vkCmdFillBuffer(commandBuffer, drawCountBuffers[currentFrame], 0, sizeof(uint32_t) * clearedCounts, 0);
+
+    //The pyramid is written by compute, by the previous frame for the early phase
+    VkMemoryBarrier fillBarrier = {};
+    fillBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    fillBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    fillBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+        1, &fillBarrier, 0, nullptr, 0, nullptr);
+
+    //Early phase tests against the pyramid of the previous frame, the late one against this frame's
+    CullPushConstants pushCull = {};
+    pushCull.recordCount = recordCount;
+    pushCull.statsIndex = MAX_INDIRECT_DRAWS;
+    pushCull.phase = phase;
+    pushCull.occlusion = occlusion ? 1 : 0;
+    pushCull.occlusionViewProjection = phase == CULL_PHASE_EARLY ? hizViewProjection : uboViewProjection.projection * uboViewProjection.view;
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, &cullDescriptorSets[currentFrame], 1, &vpAllocation.offset);
+    vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullPushConstants), &pushCull);
+    vkCmdDispatch(commandBuffer, (recordCount + 63) / 64, 1, 1);
+
+    //Commands and counts are read by the indirect draws, the counts by the host once the frame is done
+    VkMemoryBarrier cullBarrier = {};
+    cullBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    cullBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    cullBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0,
+        1, &cullBarrier, 0, nullptr, 0, nullptr);
+
+    culledRecordCounts[currentFrame] = recordCount;
+}
 
-    //vkMapMemory(mainDevice.logicalDevice, modelDynamicUniformBufferMemory[imageIndex], 0, modelUniformAllignment*meshList.size(), 0, &data);
-    //memcpy(data, modelTransferSpace, modelUniformAllignment * meshList.size());
-    //vkUnmapMemory(mainDevice.logicalDevice, modelDynamicUniformBufferMemory[imageIndex]);
+void VulkanRenderer::recordHizBuild()
+{
+    VkCommandBuffer commandBuffer = commandBuffers[currentFrame];
+
+    //Depth of the main pass goes to a layout it can be sampled in. The late cull also rewrites the commands and
+    //counts the main pass drew with, so the indirect reads have to be done first
+    VkImageMemoryBarrier depthBarrier = {};
+    depthBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    depthBarrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depthBarrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    depthBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    depthBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    depthBarrier.image = depthBufferImage;
+    depthBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    if (depthFormat == VK_FORMAT_D32_SFLOAT_S8_UINT || depthFormat == VK_FORMAT_D24_UNORM_S8_UINT)
+    {
+        depthBarrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+    }
+    depthBarrier.subresourceRange.levelCount = 1;
+    depthBarrier.subresourceRange.layerCount = 1;
+    depthBarrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    depthBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer,
+        VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &depthBarrier);
+
+    //Each level reads the one before, so it waits for its writes
+    VkMemoryBarrier levelBarrier = {};
+    levelBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    levelBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    levelBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, hizPipeline);
+    for (uint32_t i = 0; i < hizDescriptorSets.size(); i++)
+    {
+        uint32_t levelWidth = std::max(hizExtent.width >> i, 1u);
+        uint32_t levelHeight = std::max(hizExtent.height >> i, 1u);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, hizPipelineLayout, 0, 1, &hizDescriptorSets[i], 0, nullptr);
+        vkCmdDispatch(commandBuffer, (levelWidth + 7) / 8, (levelHeight + 7) / 8, 1);
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+            1, &levelBarrier, 0, nullptr, 0, nullptr);
+    }
+
+    //The next frame's early cull uses it with this frame's view projection
+    hizViewProjection = uboViewProjection.projection * uboViewProjection.view;
+    hizValid = true;
 }
 
-void VulkanRenderer::recordCommand(uint32_t currentImage)
+void VulkanRenderer::recordCommand(uint32_t imageIndex)
 {
     VkCommandBufferBeginInfo bufferBeginInfo = {};
     bufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    bufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
     //only needed for Graphical Applications
     VkRenderPassBeginInfo renderPassBeginInfo = {};
@@ -1043,64 +2325,581 @@ void VulkanRenderer::recordCommand(uint32_t currentImage)
     renderPassBeginInfo.pClearValues = clearValues.data(); //List of clear values
     renderPassBeginInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
 
-       renderPassBeginInfo.framebuffer = swapchainFramebuffers[currentImage];
-       VkResult result = vkBeginCommandBuffer(commandBuffers[currentImage], &bufferBeginInfo);
+       renderPassBeginInfo.framebuffer = swapchainFramebuffers[imageIndex];
+
+       //The slot's last frame has completed, everything it recorded every frame goes back to the pool at once
+       vkResetCommandPool(mainDevice.logicalDevice, frameCommandPools[currentFrame], 0);
+
+       //Scene commands of this slot are reused until a model is added or something they bake in changes
+       frameStats.sceneCommandsReused = commandBufferCaching && recordedSceneVersions[currentFrame] == sceneVersion &&
+           recordedSceneInfos[currentFrame].vpOffset == vpAllocation.offset;
+       if (!frameStats.sceneCommandsReused)
+       {
+           recordSceneCommands();
+       }
+
+       VkResult result = vkBeginCommandBuffer(commandBuffers[currentFrame], &bufferBeginInfo);
        if (result != VK_SUCCESS)
        {
            throw std::runtime_error("Failed to start recording a Command Buffer");
        }
        //Start recording
-       
-        vkCmdBeginRenderPass(commandBuffers[currentImage], &renderPassBeginInfo,VK_SUBPASS_CONTENTS_INLINE);
+       //The primary is small and recorded every frame, it only wraps the slot's scene commands with the render pass and queries
+       const SceneRecordInfo& sceneInfo = recordedSceneInfos[currentFrame];
+       frameStats.drawCalls = sceneInfo.drawCalls;
+       frameStats.indirectCommands = sceneInfo.indirectCommands;
+       frameStats.bindsIssued = sceneInfo.bindsIssued;
+       frameStats.bindsSkipped = sceneInfo.bindsSkipped;
+       frameStats.bindsUnsorted = sceneInfo.bindsUnsorted;
+       frameStats.sceneRecordChunks = recordedChunkCounts[currentFrame];
+       cullOnCpu(sceneInfo);
+       bool blendedRecorded = recordBlendedDraws(sceneInfo);
+
+       //Timestamps go to this slot's range of the query pool, the per model ones are written by the scene commands
+       //and the counts have to match what they were recorded with
+       bool timed = timestampQueryPool != VK_NULL_HANDLE;
+       uint32_t queryBase = currentFrame * TIMESTAMPS_PER_FRAME;
+       uint32_t timedModels = sceneInfo.timedModels;
+       uint32_t statisticsModels = sceneInfo.statisticsModels;
+       if (statisticsModels > 0)
+       {
+           vkCmdResetQueryPool(commandBuffers[currentFrame], pipelineStatisticsQueryPool, currentFrame * MAX_TIMED_MODELS, statisticsModels);
+       }
+       statisticsModelCounts[currentFrame] = statisticsModels;
+       //Query positions are modelList positions, which move when a model is destroyed
+       queriedModelIDs[currentFrame].assign(modelIDs.begin(), modelIDs.begin() + std::min(static_cast<size_t>(std::max(timedModels, statisticsModels)), modelIDs.size()));
+
+       if (timed)
+       {
+           vkCmdResetQueryPool(commandBuffers[currentFrame], timestampQueryPool, queryBase, TIMESTAMP_FIRST_MODEL + 2 * timedModels);
+           vkCmdWriteTimestamp(commandBuffers[currentFrame], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, queryBase + TIMESTAMP_FRAME_BEGIN);
+       }
+
+       //Culling runs every frame, the recorded draws only read what it wrote
+       culledRecordCounts[currentFrame] = 0;
+       culledSkippedCounts[currentFrame] = sceneInfo.zeroInstanceCommands;
+       bool lateCull = sceneInfo.occlusionCulled && sceneInfo.indirectCommands > 0;
+       if (sceneInfo.gpuCulled && sceneInfo.indirectCommands > 0)
+       {
+           recordCull(sceneInfo.indirectCommands, CULL_PHASE_EARLY, lateCull && hizValid);
+       }
+
+       if (timed)
+       {
+           vkCmdWriteTimestamp(commandBuffers[currentFrame], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, queryBase + TIMESTAMP_MAIN_PASS_BEGIN);
+       }
+
+       //With the depth pre-pass every chunk's depth draws go first, so the shading draws see the final depth
+       std::array<VkCommandBuffer, 2 * MAX_RECORD_THREADS> sceneCommands;
+       uint32_t sceneCommandCount = 0;
+       uint32_t chunkCount = recordedChunkCounts[currentFrame];
+       for (uint32_t i = 0; sceneInfo.depthPrepass && i < chunkCount; i++)
+       {
+           sceneCommands[sceneCommandCount++] = prepassCommandBuffers[currentFrame * MAX_RECORD_THREADS + i];
+       }
+       for (uint32_t i = 0; i < chunkCount; i++)
+       {
+           sceneCommands[sceneCommandCount++] = sceneCommandBuffers[currentFrame * MAX_RECORD_THREADS + i];
+       }
+
+        vkCmdBeginRenderPass(commandBuffers[currentFrame], &renderPassBeginInfo,VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
         //Begin Render Pass
+            vkCmdExecuteCommands(commandBuffers[currentFrame], sceneCommandCount, sceneCommands.data());
+            //Blended draws go over everything opaque, in the late pass when there is one
+            if (blendedRecorded && !lateCull)
+            {
+                vkCmdExecuteCommands(commandBuffers[currentFrame], 1, &blendCommandBuffers[currentFrame]);
+            }
+        //End renderPass
+        vkCmdEndRenderPass(commandBuffers[currentFrame]);
+
+       //Occlusion culling: the depth so far becomes the new pyramid, what the early cull occluded is tested against it
+       //and drawn on top by the same scene commands. Counted in the main pass time
+       if (lateCull)
+       {
+           recordHizBuild();
+           recordCull(sceneInfo.indirectCommands, CULL_PHASE_LATE, true);
+
+           renderPassBeginInfo.renderPass = lateRenderPass;
+           vkCmdBeginRenderPass(commandBuffers[currentFrame], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+           vkCmdExecuteCommands(commandBuffers[currentFrame], sceneCommandCount, sceneCommands.data());
+           if (blendedRecorded)
+           {
+               vkCmdExecuteCommands(commandBuffers[currentFrame], 1, &blendCommandBuffers[currentFrame]);
+           }
+           vkCmdEndRenderPass(commandBuffers[currentFrame]);
+       }
+
+       if (timed)
+       {
+           vkCmdWriteTimestamp(commandBuffers[currentFrame], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, queryBase + TIMESTAMP_MAIN_PASS_END);
+           vkCmdWriteTimestamp(commandBuffers[currentFrame], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, queryBase + TIMESTAMP_FRAME_END);
+           timestampsWritten[currentFrame] = true;
+           timedModelCounts[currentFrame] = timedModels;
+       }
+       //End recording
+       result = vkEndCommandBuffer(commandBuffers[currentFrame]);
+       if (result != VK_SUCCESS)
+       {
+           throw std::runtime_error("Failed to stop recording a Command Buffer");
+       }
+
+}
+
+void VulkanRenderer::cullOnCpu(const SceneRecordInfo& sceneInfo)
+{
+    frameStats.cpuVisibleDraws = sceneInfo.indirectCommands;
+    frameStats.cpuCulledDraws = 0;
+    frameStats.cpuCullMs = 0.0;
+    if (!cpuCulling || sceneInfo.gpuCulled || sceneInfo.indirectCommands == 0)
+    {
+        return;
+    }
+
+    auto cullStart = std::chrono::high_resolution_clock::now();
+
+    //World bounds only move when a matrix does, adding a model bumps the version too
+    if (culledMatricesVersion != modelMatricesVersion)
+    {
+        frustumCuller.updateWorldSpheres(modelMatrices);
+        culledMatricesVersion = modelMatricesVersion;
+    }
+    uint32_t visible = frustumCuller.cull(uboViewProjection.projection * uboViewProjection.view, packetVisibility);
+
+    //Only the instance counts change, the slot's commands are in the order they were recorded with.
+    //Instanced meshes are always drawn, their sphere only covers the first instance. Meshes with no
+    //instances are never drawn, whatever their padding sphere tested as, so they are neither visible nor culled
+    VkDrawIndexedIndirectCommand* commands = static_cast<VkDrawIndexedIndirectCommand*>(indirectMapped[currentFrame]);
+    const uint32_t* order = sceneInfo.sorted ? drawQueue.getOrder().data() : nullptr;
+    uint32_t skipped = 0;
+    for (uint32_t i = 0; i < sceneInfo.indirectCommands; i++)
+    {
+        uint32_t packet = order ? order[i] : i;
+        uint32_t instanceCount = drawPackets[packet].instanceCount;
+        commands[i].instanceCount = instanceCount == 1 ? packetVisibility[packet] : instanceCount;
+        if (instanceCount > 1) { visible += packetVisibility[packet] ^ 1; }
+        else if (instanceCount == 0) { visible -= packetVisibility[packet]; skipped++; }
+    }
+    frameStats.bytesUploaded += sizeof(uint32_t) * sceneInfo.indirectCommands;
+
+    frameStats.cpuVisibleDraws = visible;
+    frameStats.cpuCulledDraws = sceneInfo.indirectCommands - skipped - visible;
+    frameStats.cpuCullMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - cullStart).count();
+}
+
+bool VulkanRenderer::recordBlendedDraws(const SceneRecordInfo& sceneInfo)
+{
+    frameStats.blendedDraws = 0;
+
+    //Blended packets the camera can see, with the view space depth of their sphere's centre.
+    //CPU culling already tested them this frame, with GPU culling they are all drawn
+    bool cpuCulled = cpuCulling && !sceneInfo.gpuCulled && sceneInfo.indirectCommands > 0;
+    blendedOrder.clear();
+    for (uint32_t i = 0; i < static_cast<uint32_t>(drawPackets.size()); i++)
+    {
+        const DrawPacket& packet = drawPackets[i];
+        if (packet.materialClass != MaterialClass::Blended || packet.instanceCount == 0 || (cpuCulled && packet.instanceCount == 1 && packetVisibility[i] == 0))
+        {
+            continue;
+        }
+
+        glm::vec4 centre = uboViewProjection.view * modelMatrices[packet.transformIndex] * glm::vec4(glm::vec3(packet.boundingSphere), 1.0f);
+        blendedOrder.push_back(std::make_pair(centre.z, i));
+    }
+    if (blendedOrder.empty())
+    {
+        return false;
+    }
+
+    //The camera looks down -z, the most negative depth is the farthest and goes first.
+    //Instances of one packet are drawn together in their own order
+    std::sort(blendedOrder.begin(), blendedOrder.end(), [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) {
+        return a.first < b.first;
+    });
+
+    //Reset with the slot's frame pool at the start of recordCommand
+    VkCommandBuffer commandBuffer = blendCommandBuffers[currentFrame];
+
+    //Compatible with the late render pass as well, they only differ in load operations
+    VkCommandBufferInheritanceInfo inheritanceInfo = {};
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritanceInfo.renderPass = renderPass;
+    inheritanceInfo.subpass = 0;
+    inheritanceInfo.framebuffer = VK_NULL_HANDLE;
+
+    VkCommandBufferBeginInfo bufferBeginInfo = {};
+    bufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    bufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    bufferBeginInfo.pInheritanceInfo = &inheritanceInfo;
+
+    VkResult result = vkBeginCommandBuffer(commandBuffer, &bufferBeginInfo);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to start recording a blend Command Buffer");
+    }
+
+    VkViewport viewport = {};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float)swapChainExtent.width;
+    viewport.height = (float)swapChainExtent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+    VkRect2D scissor = {};
+    scissor.offset = { 0,0 };
+    scissor.extent = swapChainExtent;
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+    //Sorted by depth the texture changes from draw to draw, the tracker still skips what repeats
+    BindTracker binds(commandBuffer, pipelineLayout);
+    binds.bindPipeline(blendPipeline);
+    binds.bindDescriptorSet(0, descriptorSets[currentFrame], vpAllocation.offset);
+    binds.bindVertexBuffer(geometryBuffer.getVertexBuffer(), 0);
+    binds.bindIndexBuffer(geometryBuffer.getIndexBuffer());
+    for (const std::pair<float, uint32_t>& blended : blendedOrder)
+    {
+        const DrawPacket& packet = drawPackets[blended.second];
+        binds.bindDescriptorSet(1, packet.textureSet);
+        vkCmdDrawIndexed(commandBuffer, packet.indexCount, packet.instanceCount, packet.firstIndex, packet.vertexOffset, packet.transformIndex);
+    }
+
+    result = vkEndCommandBuffer(commandBuffer);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to stop recording a blend Command Buffer");
+    }
+
+    frameStats.blendedDraws = static_cast<uint32_t>(blendedOrder.size());
+    frameStats.drawCalls += frameStats.blendedDraws;
+    frameStats.bindsIssued += binds.getBindsIssued();
+    frameStats.bindsSkipped += binds.getBindsSkipped();
+    frameStats.bindsUnsorted += binds.getBindsIssued() + binds.getBindsSkipped();
+    return true;
+}
+
+void VulkanRenderer::recordSceneCommands()
+{
+    //Pipeline statistics are per model, so they keep the draws in model order like turning sorting off does
+    bool sorted = drawSorting && !pipelineStatisticsEnabled;
+
+    SceneRecordInfo info;
+    bool timed = timestampQueryPool != VK_NULL_HANDLE;
+    //Occlusion culling executes the scene commands in both passes, a query can't be begun twice before it's reset
+    info.gpuCulled = gpuCulling;
+    info.occlusionCulled = gpuCulling && occlusionCulling;
+    info.depthPrepass = depthPrepass;
+    if (timed && !sorted && !info.occlusionCulled)
+    {
+        info.timedModels = static_cast<uint32_t>(std::min(modelList.size(), static_cast<size_t>(MAX_TIMED_MODELS)));
+    }
+    if (pipelineStatisticsEnabled && pipelineStatisticsQueryPool != VK_NULL_HANDLE && !info.occlusionCulled)
+    {
+        info.statisticsModels = static_cast<uint32_t>(std::min(modelList.size(), static_cast<size_t>(MAX_TIMED_MODELS)));
+    }
+    info.sorted = sorted;
+    info.vpOffset = vpAllocation.offset;
+
+    //Only sorted again when the scene commands are re-recorded, cached frames keep the order they were recorded with
+    size_t itemCount = modelList.size();
+    if (sorted)
+    {
+        drawQueue.build(drawPackets);
+        itemCount = drawPackets.size();
+    }
+
+    //Contiguous chunks of models, or of sorted draws, keep the draw order the same as recording on one thread
+    size_t chunkCount = getRecordChunkCount(itemCount);
+    size_t itemsPerChunk = (itemCount + chunkCount - 1) / chunkCount;
+
+    std::vector<SceneRecordInfo> chunkInfos(chunkCount, info);
+    recordWorkers.run(chunkCount, [&](size_t chunk, size_t thread) {
+        size_t begin = std::min(chunk * itemsPerChunk, itemCount);
+        size_t end = std::min(begin + itemsPerChunk, itemCount);
+        recordSceneChunk(static_cast<uint32_t>(chunk), begin, end, sorted, &chunkInfos[chunk]);
+    });
+
+    for (const SceneRecordInfo& chunkInfo : chunkInfos)
+    {
+        info.drawCalls += chunkInfo.drawCalls;
+        info.bindsIssued += chunkInfo.bindsIssued;
+        info.bindsSkipped += chunkInfo.bindsSkipped;
+        info.indirectCommands += chunkInfo.indirectCommands;
+        info.zeroInstanceCommands += chunkInfo.zeroInstanceCommands;
+    }
+    //Sorted batches merge texture runs across models, what model order would bind has to be counted separately
+    info.bindsUnsorted = sorted ? countModelOrderBinds(info.depthPrepass) : info.bindsIssued + info.bindsSkipped;
+    frameStats.bytesUploaded += (info.gpuCulled ? sizeof(CullRecord) : sizeof(VkDrawIndexedIndirectCommand)) * info.indirectCommands;
+
+    recordedSceneInfos[currentFrame] = info;
+    recordedChunkCounts[currentFrame] = static_cast<uint32_t>(chunkCount);
+    recordedSceneVersions[currentFrame] = sceneVersion;
+}
+
+size_t VulkanRenderer::getRecordChunkCount(size_t itemCount)
+{
+    size_t chunkCount = (itemCount + MIN_MODELS_PER_RECORD_THREAD - 1) / MIN_MODELS_PER_RECORD_THREAD;
+    return std::max(static_cast<size_t>(1), std::min(chunkCount, static_cast<size_t>(recordThreads)));
+}
+
+uint32_t VulkanRenderer::countModelOrderBinds(bool depthPrepass)
+{
+    //Every bind recordSceneChunk makes in model order: set 0 and the geometry buffers per chunk, with the
+    //pre-pass pipeline and its own three when it's on, then a pipeline and a texture per batch that isn't blended
+    size_t chunkCount = getRecordChunkCount(modelList.size());
+    uint32_t binds = static_cast<uint32_t>(chunkCount) * (depthPrepass ? 7 : 3);
+    for (size_t j = 0; j < modelList.size(); j++)
+    {
+        for (uint32_t i = modelFirstPacket[j]; i < modelFirstPacket[j + 1]; i++)
+        {
+            //Batches never cross models, a new one starts where texture or material changes
+            const DrawPacket& packet = drawPackets[i];
+            bool batchStart = i == modelFirstPacket[j] || packet.textureSet != drawPackets[i - 1].textureSet
+                || packet.materialClass != drawPackets[i - 1].materialClass;
+            if (batchStart && packet.materialClass != MaterialClass::Blended)
+            {
+                binds += 2;
+            }
+        }
+    }
+    return binds;
+}
+
+void VulkanRenderer::recordSceneChunk(uint32_t chunk, size_t begin, size_t end, bool sorted, SceneRecordInfo* info)
+{
+    //Runs on a worker thread, only touches this chunk's pool and buffer
+    uint32_t commandIndex = currentFrame * MAX_RECORD_THREADS + chunk;
+    VkCommandBuffer commandBuffer = sceneCommandBuffers[commandIndex];
+    vkResetCommandPool(mainDevice.logicalDevice, sceneCommandPools[commandIndex], 0);
+
+    //Runs inside the main render pass, the framebuffer is left open so any swapchain image can use it
+    VkCommandBufferInheritanceInfo inheritanceInfo = {};
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritanceInfo.renderPass = renderPass;
+    inheritanceInfo.subpass = 0;
+    inheritanceInfo.framebuffer = VK_NULL_HANDLE;
+
+    VkCommandBufferBeginInfo bufferBeginInfo = {};
+    bufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    bufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    if (info->occlusionCulled)
+    {
+        //Executed by both the main and the late pass of the same primary
+        bufferBeginInfo.flags |= VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+    }
+    bufferBeginInfo.pInheritanceInfo = &inheritanceInfo;
+
+    VkResult result = vkBeginCommandBuffer(commandBuffer, &bufferBeginInfo);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to start recording a scene Command Buffer");
+    }
+
+    //Depth only draws of the same batches go to a second buffer from the same pool
+    VkCommandBuffer prepassBuffer = info->depthPrepass ? prepassCommandBuffers[commandIndex] : VK_NULL_HANDLE;
+    if (prepassBuffer != VK_NULL_HANDLE)
+    {
+        result = vkBeginCommandBuffer(prepassBuffer, &bufferBeginInfo);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to start recording a pre-pass Command Buffer");
+        }
+    }
+
+    uint32_t queryBase = currentFrame * TIMESTAMPS_PER_FRAME;
+    uint32_t statisticsBase = currentFrame * MAX_TIMED_MODELS;
+    BindTracker binds(commandBuffer, pipelineLayout);
+    BindTracker prepassBinds(prepassBuffer, pipelineLayout);
+
+        //Pipeline is bound per batch, it depends on the batch's material class
+        VkPipeline opaquePipeline = info->depthPrepass ? depthEqualPipeline : graphicsPipeline;
+
+        //Viewport and scissor follow the current swapchain extent, dynamic state isn't inherited from the primary
+        VkViewport viewport = {};
+        viewport.x = 0.0f;
+        viewport.y = 0.0f;
+        viewport.width = (float)swapChainExtent.width;
+        viewport.height = (float)swapChainExtent.height;
+        viewport.minDepth = 0.0f;
+        viewport.maxDepth = 1.0f;
+        vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+        VkRect2D scissor = {};
+        scissor.offset = { 0,0 };
+        scissor.extent = swapChainExtent;
+        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+        if (prepassBuffer != VK_NULL_HANDLE)
+        {
+            prepassBinds.bindPipeline(depthPrepassPipeline);
+            vkCmdSetViewport(prepassBuffer, 0, 1, &viewport);
+            vkCmdSetScissor(prepassBuffer, 0, 1, &scissor);
+            prepassBinds.bindDescriptorSet(0, descriptorSets[currentFrame], info->vpOffset);
+            prepassBinds.bindVertexBuffer(geometryBuffer.getVertexBuffer(), 0);
+            prepassBinds.bindIndexBuffer(geometryBuffer.getIndexBuffer());
+        }
+
+        //Draw commands go to the same position in the slot's indirect buffer as in the draw order, so chunks never overlap
+        //With GPU culling the CPU writes cull records instead and the compute pass fills in the commands
+        VkDrawIndexedIndirectCommand* commands = static_cast<VkDrawIndexedIndirectCommand*>(indirectMapped[currentFrame]);
+        CullRecord* cullRecords = info->gpuCulled ? static_cast<CullRecord*>(cullRecordMapped[currentFrame]) : nullptr;
+        binds.bindDescriptorSet(0, descriptorSets[currentFrame], info->vpOffset);
+
+        //Every mesh is in the same two buffers, bound once for the whole chunk
+        binds.bindVertexBuffer(geometryBuffer.getVertexBuffer(), 0);
+        binds.bindIndexBuffer(geometryBuffer.getIndexBuffer());
+
+        //drawCount commands of a batch from the slot's indirect buffer, the pre-pass draws the same ones
+        auto drawIndirect = [&](VkCommandBuffer target, size_t batchStart, uint32_t drawCount) {
+            VkDeviceSize offset = batchStart * sizeof(VkDrawIndexedIndirectCommand);
+            if (cullRecords)
+            {
+                //Count written by the cull pass, at most every packet of the batch
+                vkCmdDrawIndexedIndirectCount(target, indirectBuffers[currentFrame], offset, drawCountBuffers[currentFrame],
+                    batchStart * sizeof(uint32_t), drawCount, sizeof(VkDrawIndexedIndirectCommand));
+                info->drawCalls++;
+            }
+            else if (multiDrawIndirectSupported)
+            {
+                vkCmdDrawIndexedIndirect(target, indirectBuffers[currentFrame], offset, drawCount, sizeof(VkDrawIndexedIndirectCommand));
+                info->drawCalls++;
+            }
+            else
+            {
+                for (uint32_t i = 0; i < drawCount; i++)
+                {
+                    vkCmdDrawIndexedIndirect(target, indirectBuffers[currentFrame], offset + i * sizeof(VkDrawIndexedIndirectCommand), 1,
+                        sizeof(VkDrawIndexedIndirectCommand));
+                }
+                info->drawCalls += drawCount;
+            }
+        };
 
-            //Bind pipeline to be used in render pass
-            vkCmdBindPipeline(commandBuffers[currentImage], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
-                
-            for (size_t j = 0; j < modelList.size(); j++)
+        //Positions [first, last) of the order, no order means packet index == position
+        auto drawBatches = [&](size_t first, size_t last, const uint32_t* order) {
+            size_t batchStart = first;
+            while (batchStart < last)
             {
-                MeshModel thisModel = modelList[j];
-                glm::mat4 matModel = thisModel.getModel();
+                const DrawPacket& batchPacket = drawPackets[order ? order[batchStart] : batchStart];
 
-                vkCmdPushConstants(commandBuffers[currentImage],
-                    pipelineLayout,
-                    VK_SHADER_STAGE_VERTEX_BIT,
-                    0,
-                    sizeof(Model),
-                    &matModel);
+                //Packets with the same texture and material share one indirect draw, the model comes through firstInstance
+                //and the geometry through vertexOffset and firstIndex
+                size_t batchEnd = batchStart;
+                while (batchEnd < last)
+                {
+                    const DrawPacket& packet = drawPackets[order ? order[batchEnd] : batchEnd];
+                    if (packet.textureSet != batchPacket.textureSet || packet.materialClass != batchPacket.materialClass)
+                    {
+                        break;
+                    }
+
+                    //Blended packets keep their position but are drawn back to front every frame instead, nothing draws their command
+                    bool blended = packet.materialClass == MaterialClass::Blended;
+                    uint32_t instanceCount = blended ? 0 : packet.instanceCount;
+                    if (instanceCount == 0)
+                    {
+                        info->zeroInstanceCommands++;
+                    }
+
+                    if (cullRecords)
+                    {
+                        CullRecord& record = cullRecords[batchEnd];
+                        record.sphere = packet.boundingSphere;
+                        record.indexCount = packet.indexCount;
+                        record.firstIndex = packet.firstIndex;
+                        record.vertexOffset = packet.vertexOffset;
+                        record.transformIndex = packet.transformIndex;
+                        record.batchStart = static_cast<uint32_t>(batchStart);
+                        record.instanceCount = instanceCount;
+                    }
+                    else
+                    {
+                        VkDrawIndexedIndirectCommand& command = commands[batchEnd];
+                        command.indexCount = packet.indexCount;
+                        command.instanceCount = instanceCount;
+                        command.firstIndex = packet.firstIndex;
+                        command.vertexOffset = packet.vertexOffset;
+                        command.firstInstance = packet.transformIndex;
+                    }
+                    batchEnd++;
+                }
 
-                for (size_t k = 0; k < thisModel.getMeshCount(); k++)
+                uint32_t drawCount = static_cast<uint32_t>(batchEnd - batchStart);
+                info->indirectCommands += drawCount;
+                if (batchPacket.materialClass == MaterialClass::Blended)
                 {
-                    VkBuffer vertexBuffers[] = { thisModel.getMesh(k)->getVertexBuffer()};
-                    VkDeviceSize offsets[] = { 0 };
-                    vkCmdBindVertexBuffers(commandBuffers[currentImage], 0, 1, vertexBuffers, offsets);
+                    batchStart = batchEnd;
+                    continue;
+                }
 
-                    vkCmdBindIndexBuffer(commandBuffers[currentImage], thisModel.getMesh(k)->getIndexBuffer(), 0, VK_INDEX_TYPE_UINT32);
+                bool alphaTested = batchPacket.materialClass == MaterialClass::AlphaTested;
+                binds.bindPipeline(alphaTested ? alphaTestPipeline : opaquePipeline);
+                binds.bindDescriptorSet(1, batchPacket.textureSet);
 
-                    //Dynamic offset amount
-                    //uint32_t dynamicOffset = static_cast<uint32_t> (modelUniformAllignment) * j; //Mult with current mesh graph
+                //Execute pipeline
+                drawIndirect(commandBuffer, batchStart, drawCount);
 
+                if (prepassBuffer != VK_NULL_HANDLE && !alphaTested)
+                {
+                    //Depth only, the texture isn't needed. Alpha tested draws write their own depth in the shading pass
+                    drawIndirect(prepassBuffer, batchStart, drawCount);
+                }
 
+                batchStart = batchEnd;
+            }
+        };
 
-                    std::array<VkDescriptorSet, 2> descriptorSetGroup = {descriptorSets[currentImage],
-                    samplerDescriptorSets[thisModel.getMesh(k)->getTextureID()] };
+        if (sorted)
+        {
+            //begin/end are positions in the sorted order
+            drawBatches(begin, end, drawQueue.getOrder().data());
+        }
+        else
+        {
+            //begin/end are model IDs, each model's draws are wrapped with its queries
+            for (size_t j = begin; j < end; j++)
+            {
+                //Both ends at bottom of pipe, the model's time is from the previous work finishing to its own draws finishing
+                uint32_t modelQuery = queryBase + TIMESTAMP_FIRST_MODEL + 2 * static_cast<uint32_t>(j);
+                if (j < info->timedModels)
+                {
+                    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, modelQuery);
+                }
+                if (j < info->statisticsModels)
+                {
+                    vkCmdBeginQuery(commandBuffer, pipelineStatisticsQueryPool, statisticsBase + static_cast<uint32_t>(j), 0);
+                }
 
-                    vkCmdBindDescriptorSets(commandBuffers[currentImage], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout,
-                        0, static_cast<uint32_t>(descriptorSetGroup.size()), descriptorSetGroup.data(), 0, nullptr);
+                drawBatches(modelFirstPacket[j], modelFirstPacket[j + 1], nullptr);
 
-                    //Execute pipeline
-                    vkCmdDrawIndexed(commandBuffers[currentImage], thisModel.getMesh(k)->getIndexCount(), 1, 0, 0, 0);
+                if (j < info->statisticsModels)
+                {
+                    vkCmdEndQuery(commandBuffer, pipelineStatisticsQueryPool, statisticsBase + static_cast<uint32_t>(j));
+                }
+                if (j < info->timedModels)
+                {
+                    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool, modelQuery + 1);
                 }
             }
-        //End renderPass
-        vkCmdEndRenderPass(commandBuffers[currentImage]);
-       //End recording
-       result = vkEndCommandBuffer(commandBuffers[currentImage]);
-       if (result != VK_SUCCESS)
-       {
-           throw std::runtime_error("Failed to stop recording a Command Buffer");
-       }
+        }
+
+    info->bindsIssued = binds.getBindsIssued() + prepassBinds.getBindsIssued();
+    info->bindsSkipped = binds.getBindsSkipped() + prepassBinds.getBindsSkipped();
 
+    result = vkEndCommandBuffer(commandBuffer);
+    if (result != VK_SUCCESS)
+    {
+        throw std::runtime_error("Failed to stop recording a scene Command Buffer");
+    }
+    if (prepassBuffer != VK_NULL_HANDLE)
+    {
+        result = vkEndCommandBuffer(prepassBuffer);
+        if (result != VK_SUCCESS)
+        {
+            throw std::runtime_error("Failed to stop recording a pre-pass Command Buffer");
+        }
+    }
 }
 
 VkResult VulkanRenderer::CreateDebugUtilsMessengerEXT(VkInstance instance, const VkDebugUtilsMessengerCreateInfoEXT* pCreateInfo, const VkAllocationCallbacks* pAllocator, VkDebugUtilsMessengerEXT* pDebugMessenger)
@@ -1151,26 +2950,19 @@ void VulkanRenderer::getPysicalDevice()
     VkPhysicalDeviceProperties deviceProperties;
     vkGetPhysicalDeviceProperties(mainDevice.physicalDevice,&deviceProperties);
 
-    //minUniformBufferOffset = deviceProperties.limits.minUniformBufferOffsetAlignment;
+    minUniformBufferOffset = deviceProperties.limits.minUniformBufferOffsetAlignment;
 }
 
-//void VulkanRenderer::allocateDynamicBufferTransferSpace()
-//{
-//    //Calculate model allignment
-//    modelUniformAllignment = sizeof(UBOModel) + (minUniformBufferOffset-1) 
-//                             & ~(minUniformBufferOffset - 1);
-//
-//    //Create space in memory to hold dynamic buffer that is aligned to our required alignment and holds Max Objects
-//    modelTransferSpace = (UBOModel*) _aligned_malloc(modelUniformAllignment * MAX_OBJECTS,modelUniformAllignment);
-//}
-
 std::vector<const char*> VulkanRenderer::getRequriredExtensions()
 {
-    uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-    std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    std::vector<const char*> extensions;
+    if (!headless)
+    {
+        uint32_t glfwExtensionCount = 0;
+        const char** glfwExtensions;
+        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+        extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+    }
     if (enableValidationLayers)
     {
         extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -1208,6 +3000,12 @@ bool VulkanRenderer::checkInstanceExtensionSupport(std::vector<const char*>* che
 
 bool VulkanRenderer::checkDeviceExtensionSupport(VkPhysicalDevice device)
 {
+    //Only device extension in use is the swapchain
+    if (headless)
+    {
+        return true;
+    }
+
     uint32_t extensionCount = 0;
     vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
 
@@ -1253,14 +3051,30 @@ bool VulkanRenderer::checkDeviceSuitable(VkPhysicalDevice device)
 
     bool extensionsSupported = checkDeviceExtensionSupport(device);
 
-    bool swapChainValid = false;
-    if (extensionsSupported)
+    bool swapChainValid = headless;
+    if (extensionsSupported && !headless)
     {
         SwapChainDetails swapChainDetails = getSwapChainDetails(device);
         swapChainValid = !swapChainDetails.presentationModes.empty() && !swapChainDetails.formats.empty();
     }
 
-    return indices.isValid() && extensionsSupported && swapChainValid &&deviceFeatures.samplerAnisotropy;
+    //Need 1.2 for the timeline semaphore
+    VkPhysicalDeviceProperties deviceProperties;
+    vkGetPhysicalDeviceProperties(device, &deviceProperties);
+    bool timelineSupported = false;
+    if (deviceProperties.apiVersion >= VK_API_VERSION_1_2)
+    {
+        VkPhysicalDeviceVulkan12Features vulkan12Features = {};
+        vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+        VkPhysicalDeviceFeatures2 deviceFeatures2 = {};
+        deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        deviceFeatures2.pNext = &vulkan12Features;
+        vkGetPhysicalDeviceFeatures2(device, &deviceFeatures2);
+        timelineSupported = vulkan12Features.timelineSemaphore;
+    }
+
+    return indices.isValid() && extensionsSupported && swapChainValid &&deviceFeatures.samplerAnisotropy && timelineSupported &&
+        deviceFeatures.drawIndirectFirstInstance;
 }
 
 bool VulkanRenderer::checkValidationLayerSupport()
@@ -1308,11 +3122,19 @@ QueueFamilyIndices VulkanRenderer::getQueueFamiles(VkPhysicalDevice device)
             indices.graphicsFamily = i; //If valid the get index;
         }
 
-        VkBool32 presentationSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentationSupport);
-        if (queueFamily.queueCount > 0 && presentationSupport)
+        if (headless)
         {
-            indices.presentationFamily = i;
+            //Nothing gets presented, so the graphics queue stands in for the presentation one
+            indices.presentationFamily = indices.graphicsFamily;
+        }
+        else
+        {
+            VkBool32 presentationSupport = false;
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentationSupport);
+            if (queueFamily.queueCount > 0 && presentationSupport)
+            {
+                indices.presentationFamily = i;
+            }
         }
 
         if (indices.isValid())
@@ -1370,17 +3192,56 @@ VkSurfaceFormatKHR VulkanRenderer::chooseBestSurfaceFormat(const std::vector<VkS
 
 VkPresentModeKHR VulkanRenderer::chooseBestPresentationMode(const std::vector<VkPresentModeKHR> presentationModes)
 {
-    for (const auto& presentationMode : presentationModes)
+    //Wanted modes for the policy, best first
+    std::vector<VkPresentModeKHR> wantedModes;
+    switch (presentPolicy)
+    {
+    case PresentPolicy::LowLatency:
+        wantedModes = { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR };
+        break;
+    case PresentPolicy::FifoRelaxed:
+        wantedModes = { VK_PRESENT_MODE_FIFO_RELAXED_KHR };
+        break;
+    case PresentPolicy::Throughput:
+        break;
+    }
+
+    for (const auto& wantedMode : wantedModes)
     {
-        if (presentationMode == VK_PRESENT_MODE_MAILBOX_KHR)
+        if (std::find(presentationModes.begin(), presentationModes.end(), wantedMode) != presentationModes.end())
         {
-            return presentationMode;
+            return wantedMode;
         }
     }
     //This is always available in Vulkan
     return VK_PRESENT_MODE_FIFO_KHR;
 }
 
+uint32_t VulkanRenderer::chooseSwapchainImageCount(const VkSurfaceCapabilitiesKHR& surfaceCapabilities)
+{
+    //Fewer images means less queued frames between input and display, more lets FIFO keep the GPU fed
+    uint32_t imageCount = 0;
+    switch (presentPolicy)
+    {
+    case PresentPolicy::LowLatency:
+        imageCount = 2;
+        break;
+    case PresentPolicy::Throughput:
+        imageCount = 3;
+        break;
+    case PresentPolicy::FifoRelaxed:
+        imageCount = surfaceCapabilities.minImageCount + 1;
+        break;
+    }
+
+    imageCount = std::max(imageCount, surfaceCapabilities.minImageCount);
+    if (surfaceCapabilities.maxImageCount > 0 && surfaceCapabilities.maxImageCount < imageCount)
+    {
+        imageCount = surfaceCapabilities.maxImageCount;
+    }
+    return imageCount;
+}
+
 VkExtent2D VulkanRenderer::chooseSwapExtent(const VkSurfaceCapabilitiesKHR& surfaceCapabilities)
 {
     if (surfaceCapabilities.currentExtent.width != std::numeric_limits<uint32_t>::max())
@@ -1426,7 +3287,7 @@ VkFormat VulkanRenderer::chooseSupportedFormat(const std::vector<VkFormat>& form
     throw std::runtime_error("Failed to find a matching format");
 }
 
-VkImageView VulkanRenderer::createImageView(VkImage image, VkFormat imageformat, VkImageAspectFlags aspectFlags)
+VkImageView VulkanRenderer::createImageView(VkImage image, VkFormat imageformat, VkImageAspectFlags aspectFlags, uint32_t baseMipLevel, uint32_t levelCount)
 {
     VkImageViewCreateInfo viewCreateInfo = {};
     viewCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -1440,8 +3301,8 @@ VkImageView VulkanRenderer::createImageView(VkImage image, VkFormat imageformat,
     viewCreateInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
 
     viewCreateInfo.subresourceRange.aspectMask = aspectFlags;
-    viewCreateInfo.subresourceRange.baseMipLevel = 0;
-    viewCreateInfo.subresourceRange.levelCount = 1;
+    viewCreateInfo.subresourceRange.baseMipLevel = baseMipLevel;
+    viewCreateInfo.subresourceRange.levelCount = levelCount;
     viewCreateInfo.subresourceRange.baseArrayLayer = 0;
     viewCreateInfo.subresourceRange.layerCount = 1;
 
@@ -1472,7 +3333,7 @@ VkShaderModule VulkanRenderer::createShaderModule(const std::vector<char>& code)
     return shaderModule;
 }
 
-VkImage VulkanRenderer::createImage(uint32_t witdh, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags useFlags, VkMemoryPropertyFlags propFlags, VkDeviceMemory* imageMemory)
+VkImage VulkanRenderer::createImage(uint32_t witdh, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags useFlags, VkMemoryPropertyFlags propFlags, DeviceAllocation* imageMemory, uint32_t mipLevels)
 {
     //Create Image
 
@@ -1482,7 +3343,7 @@ VkImage VulkanRenderer::createImage(uint32_t witdh, uint32_t height, VkFormat fo
     imageCreateInfo.extent.width = witdh;
     imageCreateInfo.extent.height = height;
     imageCreateInfo.extent.depth = 1;
-    imageCreateInfo.mipLevels = 1;
+    imageCreateInfo.mipLevels = mipLevels;
     imageCreateInfo.arrayLayers = 1;
     imageCreateInfo.format = format;
     imageCreateInfo.tiling = tiling;
@@ -1499,23 +3360,8 @@ VkImage VulkanRenderer::createImage(uint32_t witdh, uint32_t height, VkFormat fo
         throw std::runtime_error("Failed to create image");
     }
 
-    //Create memory for Image
-
-    VkMemoryRequirements memoryRequirements;
-    vkGetImageMemoryRequirements(mainDevice.logicalDevice, image, &memoryRequirements);
-    VkMemoryAllocateInfo memoryAllocateInfo = {};
-    memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memoryAllocateInfo.allocationSize = memoryRequirements.size;
-    memoryAllocateInfo.memoryTypeIndex = findMemoryTypeIndex(mainDevice.physicalDevice,memoryRequirements.memoryTypeBits,propFlags);
-
-    result = vkAllocateMemory(mainDevice.logicalDevice, &memoryAllocateInfo, nullptr, imageMemory);
-    if (result != VK_SUCCESS)
-    {
-        throw std::runtime_error("Failed to allocate memory for Image");
-    }
-
-    //Connect memory to image
-    vkBindImageMemory(mainDevice.logicalDevice, image, *imageMemory, 0);
+    //Memory for the image, placed in one of the allocator's blocks and bound
+    deviceAllocator.allocateImage(image, tiling, propFlags, imageMemory);
 
     return image;
 }
@@ -1526,22 +3372,31 @@ int VulkanRenderer::createTextureImage(std::string fileName)
     VkDeviceSize imageSize;
     stbi_uc* imageData = loadTextureFile(fileName, &width, &height, &imageSize);
 
+    int textureImageLocation = createTextureImage(width, height, imageData);
+
+    stbi_image_free(imageData);
+
+    return textureImageLocation;
+}
+
+int VulkanRenderer::createTextureImage(uint32_t width, uint32_t height, const unsigned char* pixels)
+{
+    //Pixels are always RGBA
+    VkDeviceSize imageSize = width * height * 4;
+
     //create staging buffer to hold loaded date ready to copy to device
     VkBuffer imageStagingBuffer;
-    VkDeviceMemory imageStagingBufferMemory;
-    createBuffer(mainDevice.physicalDevice, mainDevice.logicalDevice, imageSize,
+    DeviceAllocation imageStagingBufferMemory;
+    createBuffer(&deviceAllocator, imageSize,
                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                  &imageStagingBuffer, &imageStagingBufferMemory);
 
-    void* data;
-    vkMapMemory(mainDevice.logicalDevice, imageStagingBufferMemory, 0, imageSize, 0, &data);
-    memcpy(data, imageData, static_cast<size_t>(imageSize));
-    vkUnmapMemory(mainDevice.logicalDevice, imageStagingBufferMemory);
+    memcpy(imageStagingBufferMemory.mapped, pixels, static_cast<size_t>(imageSize));
 
-    stbi_image_free(imageData);
+    frameStats.totalBytesUploaded += imageSize;
 
     VkImage textureImage;
-    VkDeviceMemory textureImageMemory;
+    DeviceAllocation textureImageMemory;
 
     textureImage = createImage(width, height, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL,
                                VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
@@ -1550,13 +3405,13 @@ int VulkanRenderer::createTextureImage(std::string fileName)
     //Copy data to image
 
     //Transition image to be dst for copy operation
-    transitionImageLayout(mainDevice.logicalDevice, graphicsQueue, graphicsCommandPool, textureImage,
+    transitionImageLayout(mainDevice.logicalDevice, graphicsQueue, uploadPool, textureImage,
                         VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
     //Copy Image data
-    copyImageBuffer(mainDevice.logicalDevice, graphicsQueue, graphicsCommandPool, imageStagingBuffer, textureImage, width, height);
+    copyImageBuffer(mainDevice.logicalDevice, graphicsQueue, uploadPool, imageStagingBuffer, textureImage, width, height);
 
     //Transition image to be shader readable
-    transitionImageLayout(mainDevice.logicalDevice, graphicsQueue, graphicsCommandPool, textureImage,
+    transitionImageLayout(mainDevice.logicalDevice, graphicsQueue, uploadPool, textureImage,
         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
 
     //Add texture data to vector for reference (texture manager)
@@ -1564,8 +3419,7 @@ int VulkanRenderer::createTextureImage(std::string fileName)
     textureImagesMemory.push_back(textureImageMemory);
 
     //Destroy staging buffers
-    vkDestroyBuffer(mainDevice.logicalDevice, imageStagingBuffer, nullptr);
-    vkFreeMemory(mainDevice.logicalDevice, imageStagingBufferMemory, nullptr);
+    destroyBuffer(&deviceAllocator, imageStagingBuffer, imageStagingBufferMemory);
 
     //Return the index of new image
     return textureImages.size() - 1;
@@ -1584,6 +3438,18 @@ int VulkanRenderer::createTexture(std::string fileName)
     return descriptorLoc;
 }
 
+int VulkanRenderer::createTexture(uint32_t width, uint32_t height, const unsigned char* pixels)
+{
+    if (traceWriter.isOpen()) { traceWriter.writeCreateTexture(width, height, pixels); }
+
+    int textureImageLocation = createTextureImage(width, height, pixels);
+
+    VkImageView imageView = createImageView(textureImages[textureImageLocation], VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_ASPECT_COLOR_BIT);
+    textureImageViews.push_back(imageView);
+
+    return createTextureDescriptor(imageView);
+}
+
 int VulkanRenderer::createTextureDescriptor(VkImageView textureImage)
 {
     VkDescriptorSet descriptorSet;
@@ -1627,6 +3493,8 @@ int VulkanRenderer::createTextureDescriptor(VkImageView textureImage)
 
 int VulkanRenderer::createMeshModel(std::string modelFile)
 {
+    if (traceWriter.isOpen()) { traceWriter.writeCreateMeshModel(modelFile); }
+
     //Import Model "scene
     Assimp::Importer importer;
     //Add GenSmoothnormals if using lighting 
@@ -1637,7 +3505,8 @@ int VulkanRenderer::createMeshModel(std::string modelFile)
         throw std::runtime_error("Failed to load model! (" + modelFile + " )");
     }
     //Get vector of all material with 1:1 ID placement
-    std::vector<std::string> textureNames = MeshModel::LoadMaterials(scene);
+    std::vector<MaterialClass> materialClasses;
+    std::vector<std::string> textureNames = MeshModel::LoadMaterials(scene, &materialClasses);
 
     //Conversion from the materials list IDs to Descriptor Array IDs
 
@@ -1656,13 +3525,136 @@ int VulkanRenderer::createMeshModel(std::string modelFile)
     }
 
     //Load all meshes
-    std::vector<Mesh> modelMeshes = MeshModel::LoadNode(mainDevice.physicalDevice, mainDevice.logicalDevice, graphicsQueue, graphicsCommandPool
-        , scene->mRootNode, scene, matToTex);
+    std::vector<Mesh> modelMeshes = MeshModel::LoadNode(&geometryBuffer, graphicsQueue, uploadPool
+        , scene->mRootNode, scene, matToTex, materialClasses);
+
+    return addMeshModel(modelMeshes);
+}
+
+int VulkanRenderer::createMeshModel(std::vector<MeshData>& meshData)
+{
+    if (traceWriter.isOpen()) { traceWriter.writeCreateMeshModel(meshData); }
+
+    std::vector<Mesh> modelMeshes;
+    for (auto& data : meshData)
+    {
+        modelMeshes.push_back(Mesh(&geometryBuffer, graphicsQueue, uploadPool,
+            &data.vertices, &data.indices, data.textureID, data.materialClass));
+    }
+
+    return addMeshModel(modelMeshes);
+}
+
+void VulkanRenderer::destroyMeshModel(int modelID)
+{
+    if (traceWriter.isOpen()) { traceWriter.writeDestroyMeshModel(modelID); }
+    int slot = getModelSlot(modelID);
+    if (slot < 0) { return; }
+
+    //Frames in flight may still draw the geometry, its ranges are reused once they are done
+    MeshModel destroyedModel = modelList[slot];
+    destroyAfterFrame([destroyedModel]() mutable { destroyedModel.destroyMesh(); });
+
+    //Packets and matrices of later models move down, so the indirect buffer and culling only cover live models.
+    //Their IDs stay the same, only their position changes
+    uint32_t firstPacket = modelFirstPacket[slot];
+    uint32_t packetCount = modelFirstPacket[slot + 1] - firstPacket;
+    uint32_t firstTransform = modelFirstTransform[slot];
+    uint32_t transformCount = modelFirstTransform[slot + 1] - firstTransform;
+    drawPackets.erase(drawPackets.begin() + firstPacket, drawPackets.begin() + firstPacket + packetCount);
+    modelMatrices.erase(modelMatrices.begin() + firstTransform, modelMatrices.begin() + firstTransform + transformCount);
+    modelFirstPacket.erase(modelFirstPacket.begin() + slot + 1);
+    modelFirstTransform.erase(modelFirstTransform.begin() + slot + 1);
+    for (size_t i = slot + 1; i < modelFirstPacket.size(); i++)
+    {
+        modelFirstPacket[i] -= packetCount;
+        modelFirstTransform[i] -= transformCount;
+    }
+
+    modelList.erase(modelList.begin() + slot);
+    modelIDs.erase(modelIDs.begin() + slot);
+    modelSlots[modelID] = -1;
+    for (size_t i = slot; i < modelIDs.size(); i++)
+    {
+        modelSlots[modelIDs[i]] = static_cast<int>(i);
+    }
+    updatePacketTransforms();
+
+    //Fewer draws to record and the matrices moved
+    sceneVersion++;
+    modelMatricesVersion++;
+}
+
+int VulkanRenderer::addMeshModel(std::vector<Mesh>& meshes)
+{
+    //Every model owns at least one matrix, so MAX_TRANSFORMS also caps the model count. Destroyed models took
+    //their packets and matrices with them, only live ones count
+    const char* limit = nullptr;
+    if (drawPackets.size() + meshes.size() > MAX_INDIRECT_DRAWS)
+    {
+        limit = "Too many meshes, the indirect buffer holds MAX_INDIRECT_DRAWS";
+    }
+    else if (modelMatrices.size() >= MAX_TRANSFORMS)
+    {
+        limit = "Too many model matrices, the model matrix buffer holds MAX_TRANSFORMS";
+    }
+    for (size_t i = 0; !limit && i < meshes.size(); i++)
+    {
+        //IDs from MeshData and traces come from outside, not only from createTexture
+        int textureID = meshes[i].getTextureID();
+        if (textureID < 0 || static_cast<size_t>(textureID) >= samplerDescriptorSets.size())
+        {
+            limit = "Mesh texture ID is not a loaded texture";
+        }
+    }
+    if (limit)
+    {
+        //Already uploaded but nothing draws them yet, the ranges can go straight back
+        for (auto& mesh : meshes)
+        {
+            mesh.freeGeometry();
+        }
+        throw std::runtime_error(limit);
+    }
+
+    for (auto& mesh : meshes)
+    {
+        frameStats.totalBytesUploaded += sizeof(Vertex) * mesh.getVertexCount() + sizeof(uint32_t) * mesh.getIndexCount();
+    }
 
-    MeshModel meshModel = MeshModel(modelMeshes);
+    MeshModel meshModel = MeshModel(meshes);
+    int modelID = static_cast<int>(modelSlots.size());
+    modelSlots.push_back(static_cast<int>(modelList.size()));
+    modelIDs.push_back(modelID);
     modelList.push_back(meshModel);
 
-    return modelList.size() - 1;
+    //Packets and matrix for the new model go on the end, the ones before it don't move
+    uint32_t transformIndex = static_cast<uint32_t>(modelMatrices.size());
+    modelMatrices.push_back(meshModel.getModel());
+    modelFirstTransform.push_back(static_cast<uint32_t>(modelMatrices.size()));
+    for (auto& mesh : meshes)
+    {
+        DrawPacket packet = {};
+        packet.vertexOffset = mesh.getVertexOffset();
+        packet.firstIndex = mesh.getFirstIndex();
+        packet.indexCount = static_cast<uint32_t>(mesh.getIndexCount());
+        packet.textureSet = samplerDescriptorSets[mesh.getTextureID()];
+        packet.transformIndex = transformIndex;
+        packet.instanceCount = 1;
+        packet.boundingSphere = mesh.getBoundingSphere();
+        packet.materialClass = mesh.getMaterialClass();
+        //Geometry is one buffer for every mesh and never changes state, the stable sort keeps packet order within a texture
+        packet.sortKey = DrawQueue::makeSortKey(static_cast<uint32_t>(packet.materialClass), static_cast<uint32_t>(mesh.getTextureID()), 0);
+        drawPackets.push_back(packet);
+        frustumCuller.addSphere(packet.boundingSphere, packet.transformIndex);
+    }
+    modelFirstPacket.push_back(static_cast<uint32_t>(drawPackets.size()));
+
+    //New draws to record and a new matrix to upload
+    sceneVersion++;
+    modelMatricesVersion++;
+
+    return modelID;
 }
 
 stbi_uc* VulkanRenderer::loadTextureFile(std::string fileName, int* width, int* height, VkDeviceSize* imageSize)
@@ -11,12 +11,37 @@
 #include <set>
 #include <algorithm>
 #include <array>
+#include <functional>
+#include <chrono>
 
 #include "stb_image.h"
 
 #include "Utilities.h"
 #include "Mesh.h"
 #include "MeshModel.h"
+#include "FrameTrace.h"
+#include "WorkerPool.h"
+#include "DrawQueue.h"
+#include "FrustumCuller.h"
+#include "UniformRing.h"
+
+//What one recording of a slot's scene commands contains, the primary needs it whenever they are executed
+struct SceneRecordInfo
+{
+	uint32_t drawCalls = 0;
+	uint32_t bindsIssued = 0;
+	uint32_t bindsSkipped = 0;
+	uint32_t bindsUnsorted = 0;		//Binds the same draws recorded in model order without the bind tracker would make
+	uint32_t indirectCommands = 0;	//Commands written to the indirect buffer, one per mesh
+	uint32_t zeroInstanceCommands = 0;	//Of those, blended or without instances, the command is neither culled nor drawn
+	uint32_t timedModels = 0;		//Models with timestamp queries, 0 when draws are sorted
+	uint32_t statisticsModels = 0;	//Models with pipeline statistics queries
+	bool gpuCulled = false;			//Draw commands come from the cull dispatch instead of the CPU
+	bool occlusionCulled = false;	//Executed a second time in the late pass, so no per model queries
+	bool depthPrepass = false;		//Depth only draws are in prepassCommandBuffers, the shading draws test EQUAL
+	bool sorted = false;			//Indirect commands are in drawQueue order instead of packet order
+	uint32_t vpOffset = 0;			//Dynamic offset of the view projection the draws were recorded with
+};
 
 class VulkanRenderer
 {
@@ -24,12 +49,43 @@ class VulkanRenderer
 public:
 	VulkanRenderer();
 	
-	int init(GLFWwindow* newWindow);
+	int init(GLFWwindow* newWindow, PresentPolicy policy = PresentPolicy::LowLatency);
+	int initHeadless(uint32_t width, uint32_t height);
 
 	int createMeshModel(std::string modelFile);
+	int createMeshModel(std::vector<MeshData>& meshData);
+	void destroyMeshModel(int modelID);
+	int createTexture(uint32_t width, uint32_t height, const unsigned char* pixels);
 	void updateModel(int modelID, glm::mat4 newModel);
+	void createInstances(int modelID, int count);
+	void updateInstances(int modelID, const std::vector<glm::mat4>& instances);
 
 	void draw();
+	void setMaxFrameDraws(int frameDraws);
+	int getMaxFrameDraws();
+	void waitForFrame(uint64_t frame);
+	uint64_t getSubmittedFrame();
+	uint64_t getCompletedFrame();
+	void destroyAfterFrame(std::function<void()> destroyFunction);
+	void setCommandBufferCachingEnabled(bool enabled);
+	void setRecordThreadCount(int threadCount);
+	void setDrawSortingEnabled(bool enabled);
+	int getRecordThreadCount();
+	void setPipelineStatisticsEnabled(bool enabled);
+	bool isPipelineStatisticsSupported();
+	void setGpuCullingEnabled(bool enabled);
+	bool isGpuCullingSupported();
+	void setCpuCullingEnabled(bool enabled);
+	void setOcclusionCullingEnabled(bool enabled);
+	bool isOcclusionCullingSupported();
+	void setDepthPrepassEnabled(bool enabled);
+	void setPresentPolicy(PresentPolicy policy);
+	VkPresentModeKHR getPresentMode();
+	uint32_t getSwapchainImageCount();
+	FrameStats getFrameStats();
+	DeviceMemoryStats getMemoryStats();
+	bool startTrace(const std::string& fileName);
+	void stopTrace();
 	void cleanUp();
 
 	~VulkanRenderer();
@@ -37,10 +93,50 @@ public:
 private:
 	GLFWwindow* window;
 
+	//Headless mode renders into renderer owned images instead of a swapchain
+	bool headless = false;
+
+	//Frame slots, every slot owns its command buffer, VP uniform buffer, descriptor set, semaphores and fence
 	int currentFrame = 0;
+	int maxFrameDraws = DEFAULT_FRAME_DRAWS;	//Frames in flight actually used, 1 to MAX_FRAME_DRAWS
+	bool initialised = false;
+
+	//Set by the framebuffer size callback, an out of date/suboptimal swapchain or a policy change, handled at the start of the next draw
+	bool framebufferResized = false;
 
-	//Scene Objects
+	PresentPolicy presentPolicy = PresentPolicy::LowLatency;
+	VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;	//What the swapchain was actually created with
+
+	//Scene Objects. modelList only holds live models, in the order they were added, destroying one moves the later ones down
 	std::vector<MeshModel> modelList;
+	std::vector<int> modelIDs;				//Per modelList position, the ID createMeshModel returned for it
+	std::vector<int> modelSlots;			//Per model ID, its modelList position or -1 once destroyed. IDs are never reused
+	GeometryBuffer geometryBuffer;			//Vertices and indices of every mesh, bound once per command buffer
+	std::vector<glm::mat4> modelMatrices;	//Every model's matrices in modelList order, copied as one block into the slot's model buffer
+	std::vector<uint32_t> modelFirstTransform = { 0 };	//Position i owns matrices [modelFirstTransform[i], modelFirstTransform[i + 1]), one per instance
+
+	//Draws of every model in modelList order, appended when a model is added and removed with it.
+	//Position i owns packets [modelFirstPacket[i], modelFirstPacket[i + 1])
+	std::vector<DrawPacket> drawPackets;
+	std::vector<uint32_t> modelFirstPacket = { 0 };
+
+	//Sorted draws group packets by state, model order (the default) keeps per model timestamps and queries possible
+	bool drawSorting = false;
+	DrawQueue drawQueue;
+
+	//Draws are recorded once per frame slot into a secondary command buffer and reused until the scene changes.
+	//Matrices changing doesn't count, the shader reads them from the model buffer
+	bool commandBufferCaching = true;
+	uint64_t sceneVersion = 1;				//Bumped by anything that changes the recorded draws
+	uint64_t modelMatricesVersion = 1;		//Bumped by updateModel
+	std::vector<uint64_t> recordedSceneVersions;		//Per frame slot, 0 if never recorded
+	std::vector<uint64_t> uploadedMatricesVersions;	//Per frame slot
+	std::vector<SceneRecordInfo> recordedSceneInfos;	//Per frame slot
+	std::vector<uint32_t> recordedChunkCounts;			//Per frame slot, scene command buffers to execute
+
+	//Scene recording is split into contiguous chunks of modelList, one per thread
+	WorkerPool recordWorkers;
+	int recordThreads = 1;
 
 	//Scen Settings
 	//Model View Projection
@@ -57,47 +153,111 @@ private:
 		VkDevice logicalDevice;
 	} mainDevice;
 
+	//Every buffer and image gets its memory from here instead of its own vkAllocateMemory
+	DeviceAllocator deviceAllocator;
+
 	VkQueue graphicsQueue;
 	VkQueue presentationQueue;
 	VkSurfaceKHR surface;
-	VkSwapchainKHR swapchain;
+	VkSwapchainKHR swapchain = VK_NULL_HANDLE;
 
 	std::vector<SwapchainImage> swapchainImages;
+	std::vector<DeviceAllocation> offscreenImagesMemory;
 	std::vector<VkFramebuffer> swapchainFramebuffers;
-	std::vector<VkCommandBuffer> commandBuffers;
+	std::vector<VkCommandPool> frameCommandPools;		//Per frame slot, transient, reset as a whole once the slot's frame completed
+	std::vector<VkCommandBuffer> commandBuffers;		//Per frame slot, from frameCommandPools
+	//Scene draws, [slot * MAX_RECORD_THREADS + chunk]. Each chunk has its own pool so chunks can record at the same time
+	std::vector<VkCommandPool> sceneCommandPools;
+	std::vector<VkCommandBuffer> sceneCommandBuffers;
+	std::vector<VkCommandBuffer> prepassCommandBuffers;	//Same indexing and pools, the chunk's depth only draws
+	//Blended draws, per frame slot from frameCommandPools. Sorted back to front, so recorded every frame after the scene commands
+	std::vector<VkCommandBuffer> blendCommandBuffers;
+	std::vector<std::pair<float, uint32_t>> blendedOrder;	//View space depth and draw packet, kept to reuse its memory
 
 	VkImage depthBufferImage;
-	VkDeviceMemory depthBufferImageMemory;
+	DeviceAllocation depthBufferImageMemory;
 	VkImageView depthBufferImageView;
 	VkFormat depthFormat;
+	bool depthSampled = false;	//Depth buffer is also read by the Hi-Z build
 
 	VkSampler textureSampler;
 
 	//Descriptors
 	VkDescriptorSetLayout descriptorSetLayout;
 	VkDescriptorSetLayout samplerSetLayout;
-	VkPushConstantRange pushConstantRange;
 		
 	VkDescriptorPool descriptorPool;
 	std::vector<VkDescriptorSet> descriptorSets;
 
 	
 
-	std::vector<VkBuffer> vpUniformBuffer;
-	std::vector<VkDeviceMemory> vpUniformBufferMemory;
-
-	std::vector<VkBuffer> modelDynamicUniformBuffer;
-	std::vector<VkDeviceMemory> modelDynamicUniformBufferMemory;
-
-	//For Dynamic Uniform buffers not in use for now
-	//VkDeviceSize minUniformBufferOffset;
-	//size_t modelUniformAllignment;
-	//UBOModel* modelTransferSpace;
+	//Per frame uniform data, bound with dynamic offsets. The view projection is each frame's first allocation,
+	//so its offset only depends on the slot and recorded scene commands can keep it
+	UniformRing uniformRing;
+	VkDeviceSize minUniformBufferOffset = 1;
+	UniformAllocation vpAllocation;
+
+	//Per frame slot, mapped for the renderer's whole life
+	std::vector<VkBuffer> modelStorageBuffer;
+	std::vector<DeviceAllocation> modelStorageBufferMemory;
+	std::vector<void*> modelStorageMapped;
+
+	//Per frame slot, VkDrawIndexedIndirectCommand for every draw packet in recorded order
+	std::vector<VkBuffer> indirectBuffers;
+	std::vector<DeviceAllocation> indirectBuffersMemory;
+	std::vector<void*> indirectMapped;
+	bool multiDrawIndirectSupported = false;
+
+	//GPU frustum culling. A compute pass before the render pass tests every draw packet's bounds and packs the
+	//visible ones of each batch into the indirect buffer, the draws then take their count from drawCountBuffers
+	bool gpuCullingSupported = false;
+	bool gpuCulling = false;
+	VkDescriptorSetLayout cullSetLayout = VK_NULL_HANDLE;
+	VkDescriptorPool cullDescriptorPool = VK_NULL_HANDLE;
+	std::vector<VkDescriptorSet> cullDescriptorSets;
+	VkPipelineLayout cullPipelineLayout = VK_NULL_HANDLE;
+	VkPipeline cullPipeline = VK_NULL_HANDLE;
+	std::vector<VkBuffer> cullRecordBuffers;			//Per frame slot, CullRecord for every draw packet in recorded order
+	std::vector<DeviceAllocation> cullRecordBuffersMemory;
+	std::vector<void*> cullRecordMapped;
+	std::vector<VkBuffer> drawCountBuffers;				//Per frame slot, draw count at each batch's first command, total at the end
+	std::vector<DeviceAllocation> drawCountBuffersMemory;
+	std::vector<void*> drawCountMapped;
+	std::vector<uint32_t> culledRecordCounts;			//Per frame slot, records tested by its last frame
+	std::vector<uint32_t> culledSkippedCounts;			//Per frame slot, records of those with no instances, the shader returns on them
+
+	//Hi-Z occlusion culling, on top of GPU culling. The early cull also tests against the depth pyramid of the previous
+	//frame, then the main pass depth is reduced into a new pyramid and a late cull tests what the early one occluded
+	//again. What turned out visible is drawn by the late pass, which executes the same scene commands
+	bool occlusionCullingSupported = false;				//Needs GPU culling and a depth format that can be sampled
+	bool occlusionCulling = false;
+	VkRenderPass lateRenderPass = VK_NULL_HANDLE;		//Loads what the main pass drew
+	VkImage hizImage = VK_NULL_HANDLE;					//R32F, farthest depth of every texel, stays in the general layout
+	DeviceAllocation hizImageMemory;
+	VkImageView hizImageView = VK_NULL_HANDLE;			//Every level, read by the cull pass
+	std::vector<VkImageView> hizLevelViews;				//One level each, written by the build
+	VkExtent2D hizExtent = {};
+	VkDescriptorSetLayout hizSetLayout = VK_NULL_HANDLE;
+	VkDescriptorPool hizDescriptorPool = VK_NULL_HANDLE;
+	std::vector<VkDescriptorSet> hizDescriptorSets;		//Per level, reads the depth buffer or the level before
+	VkPipelineLayout hizPipelineLayout = VK_NULL_HANDLE;
+	VkPipeline hizPipeline = VK_NULL_HANDLE;
+	std::vector<VkBuffer> occlusionFlagBuffers;			//Per frame slot, set for the records the early cull occluded
+	std::vector<DeviceAllocation> occlusionFlagBuffersMemory;
+	bool hizValid = false;								//Pyramid holds a frame's depth, not since resized or turned on
+	glm::mat4 hizViewProjection = glm::mat4(1.0f);		//View projection of the frame the pyramid was built from
+
+	//CPU frustum culling, every frame the bounds of each draw packet are tested and the instance count of its
+	//indirect command set to 0 or 1, so the cached scene commands stay valid. Not used while GPU culling is on
+	bool cpuCulling = true;
+	FrustumCuller frustumCuller;						//One sphere per draw packet, same order
+	uint64_t culledMatricesVersion = 0;					//Matrices the culler's world spheres were made from
+	std::vector<uint8_t> packetVisibility;
 
 	//Assets
 	
 	std::vector<VkImage> textureImages;
-	std::vector<VkDeviceMemory> textureImagesMemory;
+	std::vector<DeviceAllocation> textureImagesMemory;
 	std::vector<VkImageView> textureImageViews;
 
 	VkDescriptorPool samplerDescriptorPool;
@@ -105,17 +265,51 @@ private:
 
 
 	//Pipeline
-	VkPipeline graphicsPipeline;
+	VkPipeline graphicsPipeline;		//Opaque, no blending
+	VkPipeline alphaTestPipeline;		//Discards texels under the alpha cutoff
+	VkPipeline blendPipeline;			//Blends and leaves the depth alone
+	//Optional depth pre-pass. Every draw is first drawn depth only, then shaded with EQUAL and depth writes off,
+	//so each pixel runs the fragment shader once. All chunks' depth draws execute before the first shading one
+	bool depthPrepass = false;
+	VkPipeline depthPrepassPipeline;	//Position only, no fragment shader
+	VkPipeline depthEqualPipeline;		//graphicsPipeline with the EQUAL test
 	VkPipelineLayout pipelineLayout;
 	VkRenderPass renderPass;
 
 	//Pools
-	VkCommandPool graphicsCommandPool;
+	UploadPool uploadPool;
 
 	//Syncronisation
-	std::vector<VkSemaphore> imageAvailable;
-	std::vector<VkSemaphore> renderFinished;
-	std::vector<VkFence> drawFences;
+	//Frame N signals frameTimeline to N when its commands are done, the binary semaphores are only for the swapchain
+	VkSemaphore frameTimeline;
+	uint64_t submittedFrame = 0;						//Value signalled by the last submitted frame
+	uint64_t frameSlotValues[MAX_FRAME_DRAWS] = {};		//Value signalled by the last frame of each slot
+	std::vector<VkSemaphore> imageAvailable;			//Per frame slot
+	std::vector<VkSemaphore> renderFinished;			//Per swapchain image, reusable once that image is acquired again
+
+	//Destroyed once the frame they were queued in has completed
+	struct DeferredDestroy {
+		uint64_t frame;
+		std::function<void()> destroyFunction;
+	};
+	std::vector<DeferredDestroy> deferredDestroys;
+
+	//Records the public calls while a trace is running
+	FrameTraceWriter traceWriter;
+
+	//Stats
+	FrameStats frameStats;
+	VkQueryPool timestampQueryPool = VK_NULL_HANDLE;
+	float timestampPeriod = 1.0f;					//Nanoseconds per timestamp tick
+	std::vector<bool> timestampsWritten;			//Per frame slot
+	std::vector<uint32_t> timedModelCounts;			//Models with timestamps in the slot's last frame
+	std::vector<std::vector<int>> queriedModelIDs;	//Per frame slot, ID of the model at each timestamp and statistics query position
+
+	//One pipeline statistics query per model and frame slot, off by default since it can slow the GPU down
+	bool pipelineStatisticsSupported = false;
+	bool pipelineStatisticsEnabled = false;
+	VkQueryPool pipelineStatisticsQueryPool = VK_NULL_HANDLE;
+	std::vector<uint32_t> statisticsModelCounts;	//Models with statistics in the slot's last frame
 
 	//Utility
 	VkFormat swapChainImageFormat;
@@ -144,25 +338,45 @@ private:
 	void setupDebugMessenger();
 	void createSurface();
 	void createSwapChain();
+	bool recreateSwapchain();
+	void createOffscreenImages();
 	void createRenderPass();
 	void createDescriptorSetLayout();
-	void createPushConstantRange();
 	void createGraphicsPipeline();
 	void createDepthBufferImage();
 	void createFrameBuffers();
 	void createCommandPool();
 	void createCommandBuffers();
 	void createSynchronisation();
+	void createPresentSemaphores();
+	void runDeferredDestroys(uint64_t completedFrame);
+	void createTimestampQueries();
+	void createPipelineStatisticsQueries();
 	void createTextureSampler();
 	
 	void createUniformBuffers();
+	void createIndirectBuffers();
+	void createCullResources();
+	void createHizPyramid();
+	void destroyHizPyramid();
 	void createDescriptorPool();
 	void createDescriptorSets();
 
-	void updateUniformBuffers(uint32_t imageIndex);
+	void updateUniformBuffers();
+	void collectFrameTimings();
+	void collectPipelineStatistics();
+	void collectCullResults();
 
 	//Record functions
-	void recordCommand(uint32_t currentImage);
+	void recordCommand(uint32_t imageIndex);
+	void recordSceneCommands();
+	void recordCull(uint32_t recordCount, uint32_t phase, bool occlusion);
+	void recordHizBuild();
+	void cullOnCpu(const SceneRecordInfo& sceneInfo);
+	bool recordBlendedDraws(const SceneRecordInfo& sceneInfo);
+	void recordSceneChunk(uint32_t chunk, size_t begin, size_t end, bool sorted, SceneRecordInfo* info);
+	size_t getRecordChunkCount(size_t itemCount);
+	uint32_t countModelOrderBinds(bool depthPrepass);
 
 	VkResult CreateDebugUtilsMessengerEXT(VkInstance instance, const VkDebugUtilsMessengerCreateInfoEXT* pCreateInfo,
 		const VkAllocationCallbacks* pAllocator, VkDebugUtilsMessengerEXT* pDebugMessenger);
@@ -171,8 +385,6 @@ private:
 	//Get Funcitons
 	void getPysicalDevice();
 
-	//For Dynamic Uniform Bufferss
-	//void allocateDynamicBufferTransferSpace();
 	std::vector<const char*> getRequriredExtensions();
 
 	//Support Functions
@@ -180,6 +392,10 @@ private:
 	bool checkDeviceExtensionSupport(VkPhysicalDevice device);
 	bool checkDeviceSuitable(VkPhysicalDevice device);
 	bool checkValidationLayerSupport();
+	static void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
+		auto renderer = reinterpret_cast<VulkanRenderer*>(glfwGetWindowUserPointer(window));
+		renderer->framebufferResized = true;
+	}
 	static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSverity,
 		VkDebugUtilsMessageTypeFlagsEXT messageType,
 		const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData,
@@ -194,18 +410,24 @@ private:
 	//Choose Funcionts
 	VkSurfaceFormatKHR chooseBestSurfaceFormat(const std::vector<VkSurfaceFormatKHR> &surfaceFormats);
 	VkPresentModeKHR chooseBestPresentationMode(const std::vector<VkPresentModeKHR> presentationModes);
+	uint32_t chooseSwapchainImageCount(const VkSurfaceCapabilitiesKHR& surfaceCapabilities);
 	VkExtent2D chooseSwapExtent(const VkSurfaceCapabilitiesKHR& surfaceCapabilities);
 	VkFormat chooseSupportedFormat(const std::vector<VkFormat>& formats, VkImageTiling tiling, VkFormatFeatureFlags  featureFlags);
 
 	//Support Create Functions
-	VkImageView createImageView(VkImage image, VkFormat imageformat, VkImageAspectFlags aspectFlags);
+	VkImageView createImageView(VkImage image, VkFormat imageformat, VkImageAspectFlags aspectFlags, uint32_t baseMipLevel = 0, uint32_t levelCount = 1);
 	VkShaderModule createShaderModule(const std::vector<char> &code);
 	VkImage createImage(uint32_t witdh, uint32_t height, VkFormat format, VkImageTiling tiling,
-		VkImageUsageFlags useFlags, VkMemoryPropertyFlags propFlags, VkDeviceMemory* imageMemory);
+		VkImageUsageFlags useFlags, VkMemoryPropertyFlags propFlags, DeviceAllocation* imageMemory, uint32_t mipLevels = 1);
 
 	int createTextureImage(std::string fileName);
+	int createTextureImage(uint32_t width, uint32_t height, const unsigned char* pixels);
 	int createTexture(std::string fileName);
 	int createTextureDescriptor(VkImageView texutreImage);
+	int addMeshModel(std::vector<Mesh>& meshes);
+	int getModelSlot(int modelID);
+	void setInstanceCount(int slot, int count);
+	void updatePacketTransforms();
 
 
 
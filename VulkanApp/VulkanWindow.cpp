@@ -7,8 +7,8 @@ VulkanWindow::VulkanWindow(std::string wName, const int width, const int height)
 	//GLFW not set for openGL
 	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
 
-	//Window Not Resizable
-	glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+	//Resizable, the renderer recreates its swapchain when the framebuffer size changes
+	glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
 	mainWindow = glfwCreateWindow(width, height, wName.c_str(), nullptr, nullptr);
 }
@@ -0,0 +1,131 @@
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool()
+{
+}
+
+void WorkerPool::start(size_t threadCount)
+{
+	stop();
+	stopping = false;
+
+	//Thread 0 is whoever calls run()
+	for (size_t i = 1; i < threadCount; i++)
+	{
+		threads.push_back(std::thread(&WorkerPool::workerLoop, this, i));
+	}
+}
+
+void WorkerPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	batchReady.notify_all();
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	threads.clear();
+}
+
+size_t WorkerPool::getThreadCount()
+{
+	return threads.size() + 1;
+}
+
+void WorkerPool::run(size_t jobCount, const std::function<void(size_t, size_t)>& job)
+{
+	if (jobCount == 0) { return; }
+
+	//Nothing to hand out, skip the locking
+	if (threads.empty() || jobCount == 1)
+	{
+		for (size_t i = 0; i < jobCount; i++)
+		{
+			job(i, 0);
+		}
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		batchJob = &job;
+		batchJobCount = jobCount;
+		nextJob = 0;
+		finishedJobs = 0;
+		batchError = nullptr;
+		batchNumber++;
+	}
+	batchReady.notify_all();
+
+	runJobs(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	batchDone.wait(lock, [this] { return finishedJobs == batchJobCount; });
+	batchJob = nullptr;
+
+	if (batchError)
+	{
+		std::rethrow_exception(batchError);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+}
+
+void WorkerPool::workerLoop(size_t threadIndex)
+{
+	uint64_t seenBatch = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			batchReady.wait(lock, [this, seenBatch] { return stopping || batchNumber != seenBatch; });
+			if (stopping) { return; }
+			seenBatch = batchNumber;
+		}
+
+		runJobs(threadIndex);
+	}
+}
+
+void WorkerPool::runJobs(size_t threadIndex)
+{
+	while (true)
+	{
+		size_t jobIndex;
+		const std::function<void(size_t, size_t)>* job;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (batchJob == nullptr || nextJob >= batchJobCount) { return; }
+			jobIndex = nextJob++;
+			job = batchJob;
+		}
+
+		std::exception_ptr error;
+		try
+		{
+			(*job)(jobIndex, threadIndex);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		bool lastJob;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (error && !batchError) { batchError = error; }
+			lastJob = ++finishedJobs == batchJobCount;
+		}
+		if (lastJob)
+		{
+			batchDone.notify_one();
+		}
+	}
+}
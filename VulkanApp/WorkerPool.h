@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+#include <exception>
+
+//Fixed set of threads that run one batch of jobs at a time. The calling thread takes jobs too and
+//run() returns once every job of the batch is done
+class WorkerPool
+{
+public:
+	WorkerPool();
+
+	void start(size_t threadCount);
+	void stop();
+
+	//Worker threads plus the calling thread
+	size_t getThreadCount();
+
+	//job(jobIndex, threadIndex), threadIndex is below getThreadCount() and no two jobs run on the same one at once.
+	//The first exception a job throws is rethrown here once the batch is done
+	void run(size_t jobCount, const std::function<void(size_t, size_t)>& job);
+
+	~WorkerPool();
+
+private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable batchReady;
+	std::condition_variable batchDone;
+
+	//Current batch, guarded by mutex
+	const std::function<void(size_t, size_t)>* batchJob = nullptr;
+	size_t batchJobCount = 0;
+	size_t nextJob = 0;
+	size_t finishedJobs = 0;
+	uint64_t batchNumber = 0;
+	std::exception_ptr batchError;
+	bool stopping = false;
+
+	void workerLoop(size_t threadIndex);
+	void runJobs(size_t threadIndex);
+};
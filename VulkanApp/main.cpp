@@ -15,7 +15,7 @@ GLFWwindow* mainWindow = nullptr;
 
 VulkanRenderer vulkanRenderer;
 
-int main()
+int main(int argc, char* argv[])
 {
 	VulkanWindow* window = new VulkanWindow("MainWindow",800,600);
 
@@ -26,6 +26,15 @@ int main()
 		return EXIT_FAILURE;
 	}
 
+	//--trace FILE records the session so the Benchmark can replay it with --replay FILE
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (std::string(argv[i]) == "--trace" && !vulkanRenderer.startTrace(argv[i + 1]))
+		{
+			printf("Failed to start trace %s\n", argv[i + 1]);
+		}
+	}
+
 	float angle = 0.0f;
 	float deltaTime = 0.0f;
 	float lastTime = 0.0f;